@@ -0,0 +1,447 @@
+/*
+ * Microbenchmarks for buffer operations on synthetic corpora.
+ *
+ *   bench [--json] [--quick] [filter...]
+ *
+ * Each benchmark runs on every corpus whose "benchmark/corpus" name
+ * contains one of the filters (all if none) and reports time per
+ * operation, throughput and the peak RSS reached while it ran, plus for
+ * the packing benchmarks the memory the buffer holds afterwards.  --json
+ * prints one JSON document instead of the table, for tracking results
+ * over time; --quick runs each benchmark for a shorter time.
+ */
+#include "buffer.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define NEEDLE "needle-7f3a"
+#define SHELL_READ_SIZE 4095    /* shell_buf_read() appends 4 KiB reads */
+#define MAX_RESULTS 64
+
+typedef struct Corpus {
+    const char *name;
+    char *text;
+    size_t len;
+    char path[64];          /* the text on disk, for loading */
+} Corpus;
+
+/* What one benchmark round measured */
+typedef struct Round {
+    long ops;
+    double ns;              /* time spent in the measured operations */
+    double bytes;           /* bytes processed by them */
+    size_t held;            /* buffer memory left by the last one, if set */
+} Round;
+
+typedef struct Result {
+    const char *bench;
+    const char *corpus;
+    long ops;
+    double ns_per_op;
+    double mb_per_s;
+    long peak_rss_kb;
+    long held_kb;           /* -1 if the benchmark does not report it */
+} Result;
+
+static Result s_results[MAX_RESULTS];
+static int s_num_results;
+
+/* --- Timing and memory --- */
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Start a new peak-RSS measurement: Linux resets VmHWM on "5". */
+static void peak_rss_reset(void) {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (!f) return;
+    fputs("5", f);
+    fclose(f);
+}
+
+static long peak_rss_kb(void) {
+    long kb = -1;
+    char line[256];
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+        fclose(f);
+    }
+    if (kb < 0) {
+        /* No procfs: the process-wide peak */
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        kb = ru.ru_maxrss;
+    }
+    return kb;
+}
+
+/* --- Corpora --- */
+
+static uint64_t s_rng = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng(void) {
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 7;
+    s_rng ^= s_rng << 17;
+    return s_rng;
+}
+
+typedef struct Text {
+    char *s;
+    size_t len, cap;
+} Text;
+
+static void put(Text *t, const char *s, size_t n) {
+    if (t->len + n + 1 > t->cap) {
+        while (t->len + n + 1 > t->cap) t->cap = t->cap ? t->cap * 2 : 1 << 16;
+        t->s = realloc(t->s, t->cap);
+        if (!t->s) {
+            perror("bench");
+            exit(1);
+        }
+    }
+    memcpy(t->s + t->len, s, n);
+    t->len += n;
+    t->s[t->len] = '\0';
+}
+
+static void put_word(Text *t) {
+    static const char *const words[] = {
+        "the", "buffer", "line", "editor", "cursor", "insert", "value", "return",
+        "static", "count", "error", "result", "index", "window", "search", "e"
+    };
+    const char *w = words[rng() % 16];
+    put(t, w, strlen(w));
+}
+
+/* Line `i` of `n` is the needle line, 90% of the way in, so a search
+ * from the top scans most of the text */
+static int needle_line(int i, int n) {
+    return i == n - n / 10;
+}
+
+/* ~4000-byte lines */
+static void gen_long_lines(Text *t) {
+    for (int i = 0; i < 2000; i++) {
+        size_t start = t->len;
+        if (needle_line(i, 2000)) put(t, NEEDLE " ", strlen(NEEDLE) + 1);
+        while (t->len - start < 4000) {
+            put_word(t);
+            put(t, " ", 1);
+        }
+        put(t, "\n", 1);
+    }
+}
+
+static void gen_many_lines(Text *t) {
+    for (int i = 0; i < 200000; i++) {
+        if (needle_line(i, 200000)) put(t, NEEDLE " ", strlen(NEEDLE) + 1);
+        int words = 2 + (int)(rng() % 8);
+        for (int w = 0; w < words; w++) {
+            if (w) put(t, " ", 1);
+            put_word(t);
+        }
+        put(t, "\n", 1);
+    }
+}
+
+static void gen_log(Text *t) {
+    static const char *const levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    char line[256];
+    for (int i = 0; i < 100000; i++) {
+        int n = snprintf(line, sizeof(line),
+                         "2024-03-%02d %02d:%02d:%02d.%03d %-5s [worker-%d] request id=%08x "
+                         "path=/api/v1/items/%d status=%d took=%dms",
+                         1 + i / 86400 % 28, i / 3600 % 24, i / 60 % 60, i % 60,
+                         (int)(rng() % 1000), levels[rng() % 6], (int)(rng() % 16),
+                         (unsigned)rng(), (int)(rng() % 100000),
+                         rng() % 10 ? 200 : 500, (int)(rng() % 2000));
+        put(t, line, (size_t)n);
+        if (needle_line(i, 100000)) put(t, " " NEEDLE, strlen(NEEDLE) + 1);
+        put(t, "\n", 1);
+    }
+}
+
+static void corpus_init(Corpus *c, const char *name, void (*gen)(Text *)) {
+    Text t = { 0 };
+    gen(&t);
+    c->name = name;
+    c->text = t.s;
+    c->len = t.len;
+
+    snprintf(c->path, sizeof(c->path), "/tmp/bench-corpus-XXXXXX");
+    int fd = mkstemp(c->path);
+    if (fd < 0 || write(fd, c->text, c->len) != (ssize_t)c->len) {
+        perror("bench: corpus file");
+        exit(1);
+    }
+    close(fd);
+}
+
+static Buffer *buffer_from(const Corpus *c) {
+    Buffer *buf = buffer_create("bench");
+    if (!buf || buffer_load_file(buf, c->path) != 0) {
+        fprintf(stderr, "bench: cannot load %s\n", c->path);
+        exit(1);
+    }
+    return buf;
+}
+
+/* --- Benchmarks: each runs one round, timing only the operations --- */
+
+/* Typing into the middle of the text */
+static void bench_insert_char(const Corpus *c, Round *r) {
+    Buffer *buf = buffer_from(c);
+    buf->cursor_line = buf->num_lines / 2;
+    buf->cursor_col = (int)strlen(buf->lines[buf->cursor_line]) / 2;
+    double t0 = now_ns();
+    for (int i = 0; i < 10000; i++) buffer_insert_char(buf, (char)('a' + i % 26));
+    r->ns += now_ns() - t0;
+    r->ops += 10000;
+    r->bytes += 10000;
+    buffer_destroy(buf);
+}
+
+static void bench_load_file(const Corpus *c, Round *r) {
+    Buffer *buf = buffer_create("bench");
+    double t0 = now_ns();
+    int rc = buffer_load_file(buf, c->path);
+    r->ns += now_ns() - t0;
+    if (rc != 0) {
+        fprintf(stderr, "bench: cannot load %s\n", c->path);
+        exit(1);
+    }
+    r->ops++;
+    r->bytes += (double)c->len;
+    buffer_destroy(buf);
+}
+
+/* A search from the top that finds the needle 90% of the way in */
+static void bench_search_forward(const Corpus *c, Round *r) {
+    Buffer *buf = buffer_from(c);
+    size_t scanned = (size_t)(strstr(c->text, NEEDLE) - c->text);
+    for (int i = 0; i < 5; i++) {
+        buf->cursor_line = 0;
+        buf->cursor_col = 0;
+        double t0 = now_ns();
+        int found = buffer_search_forward(buf, NEEDLE);
+        r->ns += now_ns() - t0;
+        if (!found) {
+            fprintf(stderr, "bench: needle not found in %s\n", c->name);
+            exit(1);
+        }
+        r->ops++;
+        r->bytes += (double)scanned;
+    }
+    buffer_destroy(buf);
+}
+
+/* A common one-letter word: many replacements on most lines */
+static void bench_replace_all(const Corpus *c, Round *r) {
+    Buffer *buf = buffer_from(c);
+    double t0 = now_ns();
+    buffer_replace_all(buf, "e", "E");
+    r->ns += now_ns() - t0;
+    r->ops++;
+    r->bytes += (double)c->len;
+    buffer_destroy(buf);
+}
+
+/* Killing 10-line regions from the middle of the buffer */
+static void bench_kill_region(const Corpus *c, Round *r) {
+    Buffer *buf = buffer_from(c);
+    KillRing ring;
+    kill_ring_init(&ring);
+    for (int i = 0; i < 100 && buf->num_lines > 20; i++) {
+        buf->cursor_line = buf->num_lines / 2;
+        buf->cursor_col = 0;
+        buffer_set_mark(buf);
+        buf->cursor_line += 10;
+        double t0 = now_ns();
+        buffer_kill_region(buf, &ring, 0);
+        r->ns += now_ns() - t0;
+        r->ops++;
+        r->bytes += ring.count ? (double)kill_ring_current(&ring)->len : 0;
+    }
+    kill_ring_free(&ring);
+    buffer_destroy(buf);
+}
+
+/* Shell output ingestion: the text arrives in read()-sized pieces */
+static void bench_append_string(const Corpus *c, Round *r) {
+    Buffer *buf = buffer_create("bench");
+    char chunk[SHELL_READ_SIZE + 1];
+    double t0 = now_ns();
+    for (size_t off = 0; off < c->len; off += SHELL_READ_SIZE) {
+        size_t n = c->len - off < SHELL_READ_SIZE ? c->len - off : SHELL_READ_SIZE;
+        memcpy(chunk, c->text + off, n);
+        chunk[n] = '\0';
+        buffer_append_string(buf, chunk);
+        r->ops++;
+    }
+    r->ns += now_ns() - t0;
+    r->bytes += (double)c->len;
+    buffer_destroy(buf);
+}
+
+/* Compressing a whole buffer, as the idle tick does; `held` is the
+ * packed size */
+static void bench_pack(const Corpus *c, Round *r) {
+    Buffer *buf = buffer_from(c);
+    double t0 = now_ns();
+    int rc = buffer_pack(buf);
+    r->ns += now_ns() - t0;
+    if (rc != 0) {
+        fprintf(stderr, "bench: cannot pack %s\n", c->name);
+        exit(1);
+    }
+    BufferMemStats st;
+    buffer_mem_stats(buf, &st);
+    r->held = st.total;
+    r->ops++;
+    r->bytes += (double)c->len;
+    buffer_destroy(buf);
+}
+
+/* Switching back to a packed buffer; `held` is what the lines take again */
+static void bench_unpack(const Corpus *c, Round *r) {
+    Buffer *buf = buffer_from(c);
+    if (buffer_pack(buf) != 0) {
+        fprintf(stderr, "bench: cannot pack %s\n", c->name);
+        exit(1);
+    }
+    double t0 = now_ns();
+    int rc = buffer_unpack(buf);
+    r->ns += now_ns() - t0;
+    if (rc != 0) {
+        fprintf(stderr, "bench: cannot unpack %s\n", c->name);
+        exit(1);
+    }
+    BufferMemStats st;
+    buffer_mem_stats(buf, &st);
+    r->held = st.total;
+    r->ops++;
+    r->bytes += (double)c->len;
+    buffer_destroy(buf);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(const Corpus *c, Round *r);
+} s_benches[] = {
+    { "insert_char",   bench_insert_char },
+    { "load_file",     bench_load_file },
+    { "search_forward", bench_search_forward },
+    { "replace_all",   bench_replace_all },
+    { "kill_region",   bench_kill_region },
+    { "append_string", bench_append_string },
+    { "pack",          bench_pack },
+    { "unpack",        bench_unpack },
+};
+#define NUM_BENCHES (int)(sizeof(s_benches) / sizeof(s_benches[0]))
+
+/* --- Driver --- */
+
+static int selected(const char *bench, const char *corpus, char **filters, int nfilters) {
+    if (nfilters == 0) return 1;
+    char name[128];
+    snprintf(name, sizeof(name), "%s/%s", bench, corpus);
+    for (int i = 0; i < nfilters; i++)
+        if (strstr(name, filters[i])) return 1;
+    return 0;
+}
+
+static void run(int b, const Corpus *c, double min_ns) {
+    Round r = { 0 };
+    peak_rss_reset();
+    /* At least 3 rounds, and until min_ns of measured time */
+    for (int rounds = 0; rounds < 3 || r.ns < min_ns; rounds++)
+        s_benches[b].fn(c, &r);
+
+    if (s_num_results == MAX_RESULTS) return;
+    Result *res = &s_results[s_num_results++];
+    res->bench = s_benches[b].name;
+    res->corpus = c->name;
+    res->ops = r.ops;
+    res->ns_per_op = r.ops ? r.ns / r.ops : 0;
+    res->mb_per_s = r.ns > 0 ? r.bytes / (1 << 20) / (r.ns / 1e9) : 0;
+    res->peak_rss_kb = peak_rss_kb();
+    res->held_kb = r.held ? (long)(r.held / 1024) : -1;
+}
+
+static void print_table(void) {
+    printf("%-16s %-12s %10s %14s %10s %12s %10s\n",
+           "benchmark", "corpus", "ops", "ns/op", "MB/s", "peak RSS kB", "held kB");
+    for (int i = 0; i < s_num_results; i++) {
+        const Result *r = &s_results[i];
+        char held[24] = "-";
+        if (r->held_kb >= 0) snprintf(held, sizeof(held), "%ld", r->held_kb);
+        printf("%-16s %-12s %10ld %14.1f %10.1f %12ld %10s\n",
+               r->bench, r->corpus, r->ops, r->ns_per_op, r->mb_per_s, r->peak_rss_kb, held);
+    }
+}
+
+static void print_json(int quick) {
+    printf("{\n  \"suite\": \"buffer\",\n  \"quick\": %s,\n  \"results\": [\n",
+           quick ? "true" : "false");
+    for (int i = 0; i < s_num_results; i++) {
+        const Result *r = &s_results[i];
+        printf("    {\"benchmark\": \"%s\", \"corpus\": \"%s\", \"ops\": %ld, "
+               "\"ns_per_op\": %.1f, \"mb_per_s\": %.2f, \"peak_rss_kb\": %ld",
+               r->bench, r->corpus, r->ops, r->ns_per_op, r->mb_per_s, r->peak_rss_kb);
+        if (r->held_kb >= 0) printf(", \"held_kb\": %ld", r->held_kb);
+        printf("}%s\n", i + 1 < s_num_results ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+    int json = 0, quick = 0;
+    char **filters = malloc(sizeof(char *) * (size_t)argc);
+    int nfilters = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) json = 1;
+        else if (strcmp(argv[i], "--quick") == 0) quick = 1;
+        else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [--json] [--quick] [filter...]\n", argv[0]);
+            return 2;
+        } else filters[nfilters++] = argv[i];
+    }
+
+    Corpus corpora[3];
+    corpus_init(&corpora[0], "long-lines", gen_long_lines);
+    corpus_init(&corpora[1], "many-lines", gen_many_lines);
+    corpus_init(&corpora[2], "log", gen_log);
+
+    double min_ns = quick ? 20e6 : 300e6;
+    for (int b = 0; b < NUM_BENCHES; b++) {
+        for (int k = 0; k < 3; k++) {
+            if (!selected(s_benches[b].name, corpora[k].name, filters, nfilters)) continue;
+            run(b, &corpora[k], min_ns);
+            if (!json) {
+                /* progress on stderr so the table can be piped */
+                fprintf(stderr, "  %s/%s done\n", s_benches[b].name, corpora[k].name);
+            }
+        }
+    }
+
+    if (json) print_json(quick);
+    else print_table();
+
+    for (int k = 0; k < 3; k++) {
+        unlink(corpora[k].path);
+        free(corpora[k].text);
+    }
+    free(filters);
+    return 0;
+}
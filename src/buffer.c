@@ -1,23 +1,240 @@
 #include "buffer.h"
+#include "diff.h"
+#include "utf8.h"
+#include "wrap.h"
+#include "syntax.h"
+#include "stats.h"
+#include "trace.h"
+#include "lz.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <malloc.h>
+#include <sys/stat.h>
 
 #define INITIAL_LINES 64
 #define INITIAL_LINE_CAP 16
-#define MAX_LINE_LENGTH 4096
+#define READ_CHUNK 65536
+#define COL_CACHE_SIZE 64       /* lines, direct-mapped by line number */
+#define MALLOC_CHUNK_HEADER sizeof(size_t)  /* glibc's size word per chunk */
+#define PACK_BLOCK_SIZE 65536   /* text per compressed block, the LZ window */
+
+/*
+ * Display columns of one line, computed once per edit: stops[k] is the
+ * byte offset and screen column of the k-th character, and a final stop
+ * holds the line length and width.  Lines of printable ASCII need no
+ * table (column == byte) and are only flagged `plain`.
+ */
+typedef struct ColStop {
+    int byte;
+    int col;
+} ColStop;
+
+typedef struct LineCols {
+    const char *line;       /* buf->lines[ln] when computed; NULL = empty */
+    int ln;
+    unsigned long seq;      /* buf->edit_seq when computed */
+    int len;
+    int plain;
+    ColStop *stops;
+    int num_stops;
+    int cap;
+} LineCols;
+
+/* Allocations made for a buffer, counted in buf->allocs (M-x editor-stats) */
+static void *buf_malloc(Buffer *buf, size_t size) {
+    buf->allocs++;
+    return malloc(size);
+}
+
+static void *buf_calloc(Buffer *buf, size_t n, size_t size) {
+    buf->allocs++;
+    return calloc(n, size);
+}
+
+static void *buf_realloc(Buffer *buf, void *p, size_t size) {
+    buf->allocs++;
+    return realloc(p, size);
+}
+
+static char *buf_strdup(Buffer *buf, const char *s) {
+    buf->allocs++;
+    return strdup(s);
+}
+
+/* Heap taken by one line's allocation */
+static size_t line_heap(char *line) {
+    return malloc_usable_size(line) + MALLOC_CHUNK_HEADER;
+}
+
+/*
+ * Memory accounting: add (sign 1) or take out (sign -1) lines [start,
+ * start + n).  An edit takes out the lines it is about to change and
+ * buffer_lines_changed() adds what they became, so only touched lines are
+ * measured.  Edits within one line use line_edited() instead, which is
+ * told the length change rather than measuring the line twice.
+ */
+static void account_lines(Buffer *buf, int start, int n, int sign) {
+    size_t text = 0, heap = 0;
+    for (int i = start; i < start + n; i++) {
+        text += strlen(buf->lines[i]);
+        heap += line_heap(buf->lines[i]);
+    }
+    if (sign > 0) {
+        buf->text_bytes += text;
+        buf->line_heap_bytes += heap;
+    } else {
+        buf->text_bytes -= text;
+        buf->line_heap_bytes -= heap;
+    }
+}
+
+void buffer_lines_will_change(Buffer *buf, int start, int n) {
+    account_lines(buf, start, n, -1);
+}
+
+void buffer_mem_stats(Buffer *buf, BufferMemStats *st) {
+    st->text = buf->text_bytes + (size_t)buf->num_lines;
+    if (buf->packed) {
+        st->line_array = st->overhead = 0;
+        st->packed = st->total = malloc_usable_size(buf->packed) + MALLOC_CHUNK_HEADER;
+        return;
+    }
+    st->packed = 0;
+    st->line_array = sizeof(char *) * (size_t)buf->capacity;
+    st->overhead = buf->line_heap_bytes - st->text +
+                   malloc_usable_size(buf->lines) + MALLOC_CHUNK_HEADER - st->line_array;
+    st->total = st->text + st->line_array + st->overhead;
+}
+
+/*
+ * Packed text is a run of blocks, each a raw and a compressed length
+ * (size_t) followed by the compressed bytes.  A block holds whole lines,
+ * each ending in '\n', so it unpacks into lines on its own.
+ */
+#define PACK_HEADER (2 * sizeof(size_t))
+
+int buffer_pack(Buffer *buf) {
+    if (buf->packed) return 0;
+    size_t raw_cap = PACK_BLOCK_SIZE, out_cap = 0, out_len = 0;
+    char *raw = malloc(raw_cap), *out = NULL;
+    if (!raw) return -1;
+
+    for (int ln = 0; ln < buf->num_lines; ) {
+        size_t raw_len = 0;
+        do {
+            size_t len = strlen(buf->lines[ln]);
+            if (raw_len + len + 1 > raw_cap) {
+                size_t cap = raw_len + len + 1 > raw_cap * 2 ? raw_len + len + 1 : raw_cap * 2;
+                char *grown = realloc(raw, cap);
+                if (!grown) goto fail;
+                raw = grown;
+                raw_cap = cap;
+            }
+            memcpy(raw + raw_len, buf->lines[ln], len);
+            raw[raw_len + len] = '\n';
+            raw_len += len + 1;
+        } while (++ln < buf->num_lines && raw_len < PACK_BLOCK_SIZE);
+
+        size_t need = out_len + PACK_HEADER + lz_bound(raw_len);
+        if (need > out_cap) {
+            size_t cap = need > out_cap * 2 ? need : out_cap * 2;
+            char *grown = buf_realloc(buf, out, cap);
+            if (!grown) goto fail;
+            out = grown;
+            out_cap = cap;
+        }
+        size_t comp = lz_compress(raw, raw_len, out + out_len + PACK_HEADER);
+        memcpy(out + out_len, &raw_len, sizeof(size_t));
+        memcpy(out + out_len + sizeof(size_t), &comp, sizeof(size_t));
+        out_len += PACK_HEADER + comp;
+    }
+    free(raw);
+    raw = NULL;
+    if (out_len >= buf->line_heap_bytes + sizeof(char *) * (size_t)buf->capacity)
+        goto fail;
+    char *fit = realloc(out, out_len);
+    if (fit) out = fit;
+
+    for (int i = 0; i < buf->num_lines; i++) free(buf->lines[i]);
+    free(buf->lines);
+    buf->lines = NULL;
+    buf->capacity = 0;
+    buf->line_heap_bytes = 0;
+    buf->packed = out;
+    buf->packed_size = out_len;
+    return 0;
+
+fail:
+    free(raw);
+    free(out);
+    return -1;
+}
+
+int buffer_unpack(Buffer *buf) {
+    if (!buf->packed) return 0;
+    char **lines = buf_malloc(buf, sizeof(char *) * (size_t)buf->num_lines);
+    char *raw = NULL;
+    size_t raw_cap = 0, heap = 0;
+    int n = 0;
+    if (!lines) return -1;
+
+    const char *p = buf->packed, *end = buf->packed + buf->packed_size;
+    while (p < end) {
+        size_t raw_len, comp;
+        memcpy(&raw_len, p, sizeof(size_t));
+        memcpy(&comp, p + sizeof(size_t), sizeof(size_t));
+        p += PACK_HEADER;
+        if (raw_len > raw_cap) {
+            char *grown = realloc(raw, raw_len);
+            if (!grown) goto fail;
+            raw = grown;
+            raw_cap = raw_len;
+        }
+        if (comp > (size_t)(end - p) || lz_decompress(p, comp, raw, raw_len) != 0)
+            goto fail;
+        p += comp;
+        for (char *s = raw, *nl; s < raw + raw_len; s = nl + 1) {
+            nl = memchr(s, '\n', (size_t)(raw + raw_len - s));
+            if (!nl || n == buf->num_lines) goto fail;
+            char *line = buf_malloc(buf, (size_t)(nl - s) + 1);
+            if (!line) goto fail;
+            memcpy(line, s, (size_t)(nl - s));
+            line[nl - s] = '\0';
+            heap += line_heap(line);
+            lines[n++] = line;
+        }
+    }
+    if (n != buf->num_lines) goto fail;
+    free(raw);
+    free(buf->packed);
+    buf->packed = NULL;
+    buf->packed_size = 0;
+    buf->lines = lines;
+    buf->capacity = buf->num_lines;
+    buf->line_heap_bytes = heap;
+    return 0;
+
+fail:
+    while (n > 0) free(lines[--n]);
+    free(lines);
+    free(raw);
+    return -1;
+}
 
 Buffer *buffer_create(const char *name) {
     Buffer *buf = calloc(1, sizeof(Buffer));
     if (!buf) return NULL;
+    buf->allocs = 1;
 
-    buf->name = strdup(name);
+    buf->name = buf_strdup(buf, name);
     buf->capacity = INITIAL_LINES;
-    buf->lines = malloc(sizeof(char *) * buf->capacity);
+    buf->lines = buf_malloc(buf, sizeof(char *) * buf->capacity);
     if (!buf->lines) { free(buf->name); free(buf); return NULL; }
 
-    buf->lines[0] = strdup("");
+    buf->lines[0] = buf_strdup(buf, "");
     buf->num_lines = 1;
+    account_lines(buf, 0, 1, 1);
     buf->cursor_line = 0;
     buf->cursor_col = 0;
     buf->top_line = 0;
@@ -27,23 +244,35 @@ Buffer *buffer_create(const char *name) {
     buf->shell_pid = -1;
     buf->filename = NULL;
     buf->kill_ring_entry = NULL;
+    buf->watch_wd = -1;
+    buf->goal_line = -1;
     return buf;
 }
 
 void buffer_destroy(Buffer *buf) {
     if (!buf) return;
-    for (int i = 0; i < buf->num_lines; i++) free(buf->lines[i]);
+    if (buf->col_cache) {
+        for (int i = 0; i < COL_CACHE_SIZE; i++) free(buf->col_cache[i].stops);
+        free(buf->col_cache);
+    }
+    for (int i = 0; buf->lines && i < buf->num_lines; i++) free(buf->lines[i]);
     free(buf->lines);
+    free(buf->packed);
     free(buf->name);
     free(buf->filename);
     free(buf->kill_ring_entry);
+    wrap_disable(buf);
+    syntax_detach(buf);
+    stats_retire_buffer_allocs(buf->allocs);
     free(buf);
 }
 
-static int buffer_grow(Buffer *buf) {
-    if (buf->num_lines >= buf->capacity) {
+/* Make sure the line array can hold at least `need` lines. */
+static int buffer_reserve(Buffer *buf, int need) {
+    if (need > buf->capacity) {
         int new_cap = buf->capacity * 2;
-        char **tmp = realloc(buf->lines, sizeof(char *) * new_cap);
+        while (new_cap < need) new_cap *= 2;
+        char **tmp = buf_realloc(buf, buf->lines, sizeof(char *) * new_cap);
         if (!tmp) return -1;
         buf->lines = tmp;
         buf->capacity = new_cap;
@@ -51,33 +280,262 @@ static int buffer_grow(Buffer *buf) {
     return 0;
 }
 
-void buffer_ensure_line(Buffer *buf, int line) {
-    while (buf->num_lines <= line) {
-        if (buffer_grow(buf) != 0) return;
-        buf->lines[buf->num_lines++] = strdup("");
+static int buffer_grow(Buffer *buf) {
+    return buffer_reserve(buf, buf->num_lines + 1);
+}
+
+/* Remember which file (and how much of it) the buffer now reflects. */
+static void buffer_record_file(Buffer *buf, const struct stat *st,
+                               off_t size, int eof_newline) {
+    buf->has_file_id = 1;
+    buf->file_dev    = st->st_dev;
+    buf->file_ino    = st->st_ino;
+    buf->file_size   = size;
+    buf->file_mtime  = st->st_mtim;
+    buf->eof_newline = eof_newline;
+}
+
+/* Read the rest of `f` into one malloc'd block; `hint` is the expected size. */
+static char *read_file_data(Buffer *buf, FILE *f, off_t hint, size_t *len_out) {
+    size_t cap = hint > 0 ? (size_t)hint + 1 : READ_CHUNK, len = 0;
+    char *data = buf_malloc(buf, cap + 1);
+    if (!data) return NULL;
+    size_t n;
+    while ((n = fread(data + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if (len == cap) {
+            char *tmp = buf_realloc(buf, data, cap * 2 + 1);
+            if (!tmp) { free(data); return NULL; }
+            data = tmp;
+            cap *= 2;
+        }
     }
+    data[len] = '\0';
+    *len_out = len;
+    return data;
+}
+
+/*
+ * Split file data into lines in place, turning each '\n' into a NUL.  A
+ * final newline does not start an extra line and empty data yields one
+ * empty line.  The returned array points into `data`.
+ */
+static char **split_lines(Buffer *buf, char *data, size_t len, int *nlines) {
+    if (len > 0 && data[len - 1] == '\n') data[--len] = '\0';
+    int count = 1;
+    for (const char *p = data; (p = memchr(p, '\n', len - (size_t)(p - data))); p++)
+        count++;
+    char **lines = buf_malloc(buf, sizeof(char *) * count);
+    if (!lines) return NULL;
+
+    char *p = data;
+    for (int i = 0; i < count; i++) {
+        lines[i] = p;
+        char *nl = memchr(p, '\n', len - (size_t)(p - data));
+        if (!nl) break;
+        *nl = '\0';
+        p = nl + 1;
+    }
+    *nlines = count;
+    return lines;
+}
+
+/* Copy `n` lines of file data into separately owned strings. */
+static int own_lines(Buffer *buf, char **lines, int n) {
+    for (int i = 0; i < n; i++) {
+        char *copy = buf_strdup(buf, lines[i]);
+        if (!copy) {
+            while (i-- > 0) free(lines[i]);
+            return -1;
+        }
+        lines[i] = copy;
+    }
+    return 0;
+}
+
+/*
+ * Record that the text changed: views and caches keyed on change_gen go
+ * stale.  Inside a transaction the edit is only counted and change_gen
+ * moves once, when the outermost transaction ends.
+ */
+void buffer_mark_changed(Buffer *buf) {
+    buf->modified = 1;
+    buf->edit_seq++;
+    if (buf->batch_depth > 0) {
+        buf->batch_edits++;
+        return;
+    }
+    buf->change_gen++;
+}
+
+/* Tell line-level indexes that lines [start, start + old_n) became
+ * [start, start + new_n). */
+static void update_line_indexes(Buffer *buf, int start, int old_n, int new_n) {
+    if (buf->wrap) wrap_lines_changed(buf, start, old_n, new_n);
+    if (buf->syntax) syntax_lines_changed(buf, start, old_n, new_n);
+}
+
+/*
+ * Record that lines [start, start + old_n) became [start, start + new_n),
+ * so line-level indexes (visual line wrap, highlighting) update only
+ * those lines, and mark the text changed.
+ */
+void buffer_lines_changed(Buffer *buf, int start, int old_n, int new_n) {
+    account_lines(buf, start, new_n, 1);
+    update_line_indexes(buf, start, old_n, new_n);
+    buffer_mark_changed(buf);
+}
+
+/* Line `ln` was edited in place: its text grew by `text_delta` bytes and
+ * its allocation took `old_heap` bytes before the edit. */
+static void line_edited(Buffer *buf, int ln, long text_delta, size_t old_heap) {
+    buf->text_bytes += text_delta;
+    buf->line_heap_bytes += line_heap(buf->lines[ln]) - old_heap;
+    update_line_indexes(buf, ln, 1, 1);
+    buffer_mark_changed(buf);
+}
+
+void buffer_begin_batch(Buffer *buf) {
+    if (buf->batch_depth++ == 0) buf->batch_edits = 0;
+}
+
+/* Close a transaction; returns the number of edits it collected. */
+int buffer_end_batch(Buffer *buf) {
+    if (buf->batch_depth == 0 || --buf->batch_depth > 0) return 0;
+    int edits = buf->batch_edits;
+    buf->batch_edits = 0;
+    if (edits > 0) buf->change_gen++;
+    buffer_clamp_cursor(buf);
+    return edits;
+}
+
+/* Start of the character containing byte `pos` of line[0..len). */
+static int char_start(const char *line, int len, int pos) {
+    if (pos >= len || !UTF8_IS_CONT(line[pos])) return pos;
+    int start = pos;
+    while (start > 0 && pos - start < 3 && UTF8_IS_CONT(line[start])) start--;
+    int cp;
+    if (start + utf8_decode(line + start, (size_t)(len - start), &cp) > pos)
+        return start;
+    return pos;     /* a stray continuation byte is a character by itself */
 }
 
 void buffer_clamp_cursor(Buffer *buf) {
     if (buf->cursor_line < 0) buf->cursor_line = 0;
     if (buf->cursor_line >= buf->num_lines) buf->cursor_line = buf->num_lines - 1;
-    int linelen = (int)strlen(buf->lines[buf->cursor_line]);
+    const char *line = buf->lines[buf->cursor_line];
+    int linelen = (int)strlen(line);
     if (buf->cursor_col < 0) buf->cursor_col = 0;
     if (buf->cursor_col > linelen) buf->cursor_col = linelen;
+    buf->cursor_col = char_start(line, linelen, buf->cursor_col);
+}
+
+static void compute_line_cols(LineCols *lc, const char *line) {
+    int len = (int)strlen(line);
+    lc->len = len;
+    lc->plain = 1;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)line[i];
+        if (c < 0x20 || c >= 0x7F) { lc->plain = 0; break; }
+    }
+    lc->num_stops = 0;
+    if (lc->plain) return;
+
+    /* Every character takes at least one byte: len + 1 stops suffice */
+    if (lc->cap < len + 1) {
+        ColStop *stops = realloc(lc->stops, sizeof(ColStop) * (len + 1));
+        if (!stops) { lc->line = NULL; return; }
+        lc->stops = stops;
+        lc->cap = len + 1;
+    }
+    int col = 0;
+    for (int i = 0; i < len; ) {
+        int cp;
+        int n = utf8_decode(line + i, (size_t)(len - i), &cp);
+        lc->stops[lc->num_stops].byte = i;
+        lc->stops[lc->num_stops].col = col;
+        lc->num_stops++;
+        col += utf8_width(cp, col);
+        i += n;
+    }
+    lc->stops[lc->num_stops].byte = len;
+    lc->stops[lc->num_stops].col = col;
+    lc->num_stops++;
+}
+
+/* Column table of line ln (num_stops == 0 for a plain line). */
+static const LineCols *line_cols(Buffer *buf, int ln) {
+    if (!buf->col_cache) {
+        buf->col_cache = buf_calloc(buf, COL_CACHE_SIZE, sizeof(LineCols));
+        if (!buf->col_cache) return NULL;
+    }
+    LineCols *lc = &buf->col_cache[ln % COL_CACHE_SIZE];
+    const char *line = buf->lines[ln];
+    if (lc->line != line || lc->ln != ln || lc->seq != buf->edit_seq) {
+        lc->line = line;
+        lc->ln = ln;
+        lc->seq = buf->edit_seq;
+        compute_line_cols(lc, line);
+        if (!lc->line) return NULL;
+    }
+    return lc;
+}
+
+/* Screen column of byte offset `byte` in line ln (binary search). */
+int buffer_display_col(Buffer *buf, int ln, int byte) {
+    if (ln < 0 || ln >= buf->num_lines) return 0;
+    const LineCols *lc = line_cols(buf, ln);
+    if (!lc) return byte;
+    if (lc->num_stops == 0) return byte < lc->len ? byte : lc->len;
+    int lo = 0, hi = lc->num_stops - 1;
+    while (lo < hi) {       /* last stop with stops[k].byte <= byte */
+        int mid = (lo + hi + 1) / 2;
+        if (lc->stops[mid].byte <= byte) lo = mid;
+        else hi = mid - 1;
+    }
+    return lc->stops[lo].col;
+}
+
+/*
+ * Byte offset of the character shown at screen column `col` of line ln
+ * (the line's end past its last column).  Also how the display finds
+ * the first visible byte of a horizontally scrolled line.
+ */
+int buffer_col_to_byte(Buffer *buf, int ln, int col) {
+    if (ln < 0 || ln >= buf->num_lines) return 0;
+    const LineCols *lc = line_cols(buf, ln);
+    if (!lc) {
+        int len = (int)strlen(buf->lines[ln]);
+        return col < len ? col : len;
+    }
+    if (lc->num_stops == 0) return col < lc->len ? col : lc->len;
+    int lo = 0, hi = lc->num_stops - 1;
+    while (lo < hi) {       /* last stop with stops[k].col <= col */
+        int mid = (lo + hi + 1) / 2;
+        if (lc->stops[mid].col <= col) lo = mid;
+        else hi = mid - 1;
+    }
+    return lc->stops[lo].byte;
 }
 
 void buffer_insert_char(Buffer *buf, char c) {
     buffer_clamp_cursor(buf);
+    int cl = buf->cursor_line;
 
     if (c == '\n') {
         /* Split line at cursor */
+        buffer_lines_will_change(buf, cl, 1);
         char *cur_line = buf->lines[buf->cursor_line];
         int col = buf->cursor_col;
-        char *rest = strdup(cur_line + col);
+        char *rest = buf_strdup(buf, cur_line + col);
         cur_line[col] = '\0';
 
         /* Make room for new line */
-        if (buffer_grow(buf) != 0) { free(rest); return; }
+        if (buffer_grow(buf) != 0) {
+            free(rest);
+            account_lines(buf, cl, 1, 1);
+            return;
+        }
         /* Shift lines down */
         memmove(&buf->lines[buf->cursor_line + 2],
                 &buf->lines[buf->cursor_line + 1],
@@ -86,10 +544,12 @@ void buffer_insert_char(Buffer *buf, char c) {
         buf->lines[buf->cursor_line + 1] = rest;
         buf->cursor_line++;
         buf->cursor_col = 0;
+        buffer_lines_changed(buf, cl, 1, 2);
     } else {
         char *line = buf->lines[buf->cursor_line];
         int len = (int)strlen(line);
-        char *newline = malloc(len + 2);
+        size_t old_heap = line_heap(line);
+        char *newline = buf_malloc(buf, len + 2);
         memcpy(newline, line, buf->cursor_col);
         newline[buf->cursor_col] = c;
         memcpy(newline + buf->cursor_col + 1, line + buf->cursor_col,
@@ -97,8 +557,92 @@ void buffer_insert_char(Buffer *buf, char c) {
         free(buf->lines[buf->cursor_line]);
         buf->lines[buf->cursor_line] = newline;
         buf->cursor_col++;
+        line_edited(buf, cl, 1, old_heap);
     }
-    buf->modified = 1;
+}
+
+/*
+ * Insert `len` bytes at the cursor and leave the cursor after them.  The
+ * line array is shifted once and every new line allocated once, however
+ * many newlines the text holds.
+ */
+void buffer_insert_text(Buffer *buf, const char *text, size_t len) {
+    if (!text || len == 0) return;
+    buffer_clamp_cursor(buf);
+    const char *end = text + len;
+    int cl = buf->cursor_line;
+    size_t col = (size_t)buf->cursor_col;
+    char *line = buf->lines[cl];
+    size_t line_len = strlen(line);
+
+    int newlines = 0;
+    const char *last_nl = NULL;
+    for (const char *p = text; (p = memchr(p, '\n', (size_t)(end - p))); p++) {
+        newlines++;
+        last_nl = p;
+    }
+
+    if (newlines == 0) {
+        size_t old_heap = line_heap(line);
+        char *grown = buf_realloc(buf, line, line_len + len + 1);
+        if (!grown) return;
+        memmove(grown + col + len, grown + col, line_len - col + 1);
+        memcpy(grown + col, text, len);
+        buf->lines[cl] = grown;
+        buf->cursor_col += (int)len;
+        line_edited(buf, cl, (long)len, old_heap);
+        return;
+    }
+
+    buffer_lines_will_change(buf, cl, 1);
+
+    /* Build the new lines before touching the buffer */
+    if (buffer_reserve(buf, buf->num_lines + newlines) != 0) goto fail;
+    char **fresh = buf_malloc(buf, sizeof(char *) * newlines);
+    if (!fresh) goto fail;
+    const char *p = memchr(text, '\n', len) + 1;
+    int k = 0;
+    for (; k < newlines - 1; k++) {
+        const char *stop = memchr(p, '\n', (size_t)(end - p));
+        fresh[k] = buf_malloc(buf, (size_t)(stop - p) + 1);
+        if (!fresh[k]) break;
+        memcpy(fresh[k], p, (size_t)(stop - p));
+        fresh[k][stop - p] = '\0';
+        p = stop + 1;
+    }
+    /* Last segment carries the rest of the cursor line */
+    size_t last_len = (size_t)(end - (last_nl + 1));
+    if (k == newlines - 1) {
+        fresh[k] = buf_malloc(buf, last_len + line_len - col + 1);
+        if (fresh[k]) {
+            memcpy(fresh[k], last_nl + 1, last_len);
+            memcpy(fresh[k] + last_len, line + col, line_len - col + 1);
+            k++;
+        }
+    }
+    size_t first_len = (size_t)((const char *)memchr(text, '\n', len) - text);
+    char *first = k == newlines ? buf_realloc(buf, line, col + first_len + 1) : NULL;
+    if (!first) {
+        while (k-- > 0) free(fresh[k]);
+        free(fresh);
+        goto fail;
+    }
+    memcpy(first + col, text, first_len);
+    first[col + first_len] = '\0';
+    buf->lines[cl] = first;
+
+    memmove(&buf->lines[cl + 1 + newlines], &buf->lines[cl + 1],
+            sizeof(char *) * (size_t)(buf->num_lines - cl - 1));
+    memcpy(&buf->lines[cl + 1], fresh, sizeof(char *) * newlines);
+    free(fresh);
+    buf->num_lines  += newlines;
+    buf->cursor_line = cl + newlines;
+    buf->cursor_col  = (int)last_len;
+    buffer_lines_changed(buf, cl, 1, 1 + newlines);
+    return;
+
+fail:
+    account_lines(buf, cl, 1, 1);
 }
 
 void buffer_delete_char(Buffer *buf) {
@@ -107,18 +651,20 @@ void buffer_delete_char(Buffer *buf) {
     if (buf->cursor_col > 0) {
         char *line = buf->lines[buf->cursor_line];
         int len = (int)strlen(line);
-        memmove(line + buf->cursor_col - 1,
+        int start = (int)utf8_prev(line, (size_t)buf->cursor_col);
+        memmove(line + start,
                 line + buf->cursor_col,
                 len - buf->cursor_col + 1);
-        buf->cursor_col--;
-        buf->modified = 1;
+        line_edited(buf, buf->cursor_line, start - buf->cursor_col, line_heap(line));
+        buf->cursor_col = start;
     } else if (buf->cursor_line > 0) {
         /* Merge with previous line */
+        buffer_lines_will_change(buf, buf->cursor_line - 1, 2);
         char *prev = buf->lines[buf->cursor_line - 1];
         char *cur  = buf->lines[buf->cursor_line];
         int prev_len = (int)strlen(prev);
         int cur_len  = (int)strlen(cur);
-        char *merged = malloc(prev_len + cur_len + 1);
+        char *merged = buf_malloc(buf, prev_len + cur_len + 1);
         memcpy(merged, prev, prev_len);
         memcpy(merged + prev_len, cur, cur_len + 1);
         free(buf->lines[buf->cursor_line - 1]);
@@ -130,7 +676,7 @@ void buffer_delete_char(Buffer *buf) {
         buf->num_lines--;
         buf->cursor_line--;
         buf->cursor_col = prev_len;
-        buf->modified = 1;
+        buffer_lines_changed(buf, buf->cursor_line, 2, 1);
     }
 }
 
@@ -140,17 +686,19 @@ void buffer_delete_forward(Buffer *buf) {
     char *line = buf->lines[buf->cursor_line];
     int len = (int)strlen(line);
     if (buf->cursor_col < len) {
+        int end = (int)utf8_next(line, (size_t)len, (size_t)buf->cursor_col);
         memmove(line + buf->cursor_col,
-                line + buf->cursor_col + 1,
-                len - buf->cursor_col);
-        buf->modified = 1;
+                line + end,
+                len - end + 1);
+        line_edited(buf, buf->cursor_line, buf->cursor_col - end, line_heap(line));
     } else if (buf->cursor_line < buf->num_lines - 1) {
         /* Merge with next line */
+        buffer_lines_will_change(buf, buf->cursor_line, 2);
         char *cur  = buf->lines[buf->cursor_line];
         char *next = buf->lines[buf->cursor_line + 1];
         int cur_len  = (int)strlen(cur);
         int next_len = (int)strlen(next);
-        char *merged = malloc(cur_len + next_len + 1);
+        char *merged = buf_malloc(buf, cur_len + next_len + 1);
         memcpy(merged, cur, cur_len);
         memcpy(merged + cur_len, next, next_len + 1);
         free(buf->lines[buf->cursor_line]);
@@ -160,35 +708,36 @@ void buffer_delete_forward(Buffer *buf) {
                 &buf->lines[buf->cursor_line + 2],
                 sizeof(char *) * (buf->num_lines - buf->cursor_line - 2));
         buf->num_lines--;
-        buf->modified = 1;
+        buffer_lines_changed(buf, buf->cursor_line, 2, 1);
     }
 }
 
-void buffer_kill_line(Buffer *buf, char **kill_ring) {
+/* Put `len` bytes of `text` on the kill ring */
+static void kill_text(KillRing *ring, const char *text, size_t len, int append) {
+    char *dst = ring ? kill_ring_reserve(ring, len, append) : NULL;
+    if (dst) memcpy(dst, text, len);
+}
+
+void buffer_kill_line(Buffer *buf, KillRing *ring, int append) {
     buffer_clamp_cursor(buf);
     char *line = buf->lines[buf->cursor_line];
     int len = (int)strlen(line);
 
     if (buf->cursor_col < len) {
         /* Kill to end of line */
-        if (kill_ring) {
-            free(*kill_ring);
-            *kill_ring = strdup(line + buf->cursor_col);
-        }
+        kill_text(ring, line + buf->cursor_col, (size_t)(len - buf->cursor_col), append);
         line[buf->cursor_col] = '\0';
-        buf->modified = 1;
+        line_edited(buf, buf->cursor_line, buf->cursor_col - len, line_heap(line));
     } else if (buf->cursor_line < buf->num_lines - 1) {
         /* Kill the newline */
-        if (kill_ring) {
-            free(*kill_ring);
-            *kill_ring = strdup("\n");
-        }
+        kill_text(ring, "\n", 1, append);
         /* Merge with next line */
+        buffer_lines_will_change(buf, buf->cursor_line, 2);
         char *cur  = buf->lines[buf->cursor_line];
         char *next = buf->lines[buf->cursor_line + 1];
         int cur_len  = (int)strlen(cur);
         int next_len = (int)strlen(next);
-        char *merged = malloc(cur_len + next_len + 1);
+        char *merged = buf_malloc(buf, cur_len + next_len + 1);
         memcpy(merged, cur, cur_len);
         memcpy(merged + cur_len, next, next_len + 1);
         free(buf->lines[buf->cursor_line]);
@@ -198,21 +747,78 @@ void buffer_kill_line(Buffer *buf, char **kill_ring) {
                 &buf->lines[buf->cursor_line + 2],
                 sizeof(char *) * (buf->num_lines - buf->cursor_line - 2));
         buf->num_lines--;
-        buf->modified = 1;
+        buffer_lines_changed(buf, buf->cursor_line, 2, 1);
     }
 }
 
-void buffer_yank(Buffer *buf, const char *kill_ring) {
-    if (!kill_ring) return;
-    for (const char *p = kill_ring; *p; p++) {
-        buffer_insert_char(buf, *p);
-    }
+void buffer_yank(Buffer *buf, const KillEntry *k) {
+    if (k) buffer_insert_text(buf, k->text, k->len);
 }
 
+/*
+ * Move dline lines, keeping the screen column (the goal column survives
+ * consecutive vertical moves through shorter lines), then dcol characters.
+ */
 void buffer_move_cursor(Buffer *buf, int dline, int dcol) {
-    buf->cursor_line += dline;
-    buf->cursor_col  += dcol;
     buffer_clamp_cursor(buf);
+    if (dline != 0) {
+        if (buf->goal_line != buf->cursor_line || buf->goal_byte != buf->cursor_col)
+            buf->goal_col = buffer_display_col(buf, buf->cursor_line, buf->cursor_col);
+        buf->cursor_line += dline;
+        if (buf->cursor_line < 0) buf->cursor_line = 0;
+        if (buf->cursor_line >= buf->num_lines) buf->cursor_line = buf->num_lines - 1;
+        buf->cursor_col = buffer_col_to_byte(buf, buf->cursor_line, buf->goal_col);
+        buf->goal_line = buf->cursor_line;
+        buf->goal_byte = buf->cursor_col;
+    }
+    for (; dcol > 0; dcol--) buffer_forward_char(buf);
+    for (; dcol < 0; dcol++) buffer_backward_char(buf);
+}
+
+/* One character right, skipping combining marks; wraps to the next line. */
+void buffer_forward_char(Buffer *buf) {
+    buffer_clamp_cursor(buf);
+    const char *line = buf->lines[buf->cursor_line];
+    size_t len = strlen(line);
+    size_t pos = (size_t)buf->cursor_col;
+    if (pos >= len) {
+        if (buf->cursor_line < buf->num_lines - 1) {
+            buf->cursor_line++;
+            buf->cursor_col = 0;
+        }
+        return;
+    }
+    pos = utf8_next(line, len, pos);
+    while (pos < len) {
+        int cp;
+        int n = utf8_decode(line + pos, len - pos, &cp);
+        if (cp <= 0x7F || utf8_width(cp, 0) != 0) break;
+        pos += (size_t)n;
+    }
+    buf->cursor_col = (int)pos;
+}
+
+/* One character left, onto the base of a combining sequence. */
+void buffer_backward_char(Buffer *buf) {
+    buffer_clamp_cursor(buf);
+    const char *line = buf->lines[buf->cursor_line];
+    size_t len = strlen(line);
+    size_t pos = (size_t)buf->cursor_col;
+    if (pos == 0) {
+        if (buf->cursor_line > 0) {
+            buf->cursor_line--;
+            buffer_move_eol(buf);
+        }
+        return;
+    }
+    pos = utf8_prev(line, pos);
+    while (pos > 0) {
+        int cp;
+        utf8_decode(line + pos, len - pos, &cp);
+        if (cp <= 0x7F || utf8_width(cp, 0) != 0) break;
+        pos = utf8_prev(line, pos);
+    }
+    buf->cursor_col = (int)pos;
 }
 
 void buffer_move_bol(Buffer *buf) {
@@ -224,63 +830,181 @@ void buffer_move_eol(Buffer *buf) {
     buf->cursor_col = (int)strlen(buf->lines[buf->cursor_line]);
 }
 
-int buffer_load_file(Buffer *buf, const char *filename) {
+static int load_file(Buffer *buf, const char *filename) {
     FILE *f = fopen(filename, "r");
     if (!f) return -1;
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) { fclose(f); return -1; }
 
-    /* Clear existing content */
-    for (int i = 0; i < buf->num_lines; i++) free(buf->lines[i]);
-    buf->num_lines = 0;
-
-    char linebuf[MAX_LINE_LENGTH];
-    while (fgets(linebuf, sizeof(linebuf), f)) {
-        /* Strip trailing newline */
-        int len = (int)strlen(linebuf);
-        if (len > 0 && linebuf[len - 1] == '\n') {
-            linebuf[len - 1] = '\0';
-        }
-        /* Grow lines array if needed */
-        if (buf->num_lines >= buf->capacity) {
-            int new_cap = buf->capacity * 2;
-            char **tmp = realloc(buf->lines, sizeof(char *) * new_cap);
-            if (!tmp) { fclose(f); return -1; }
-            buf->lines = tmp;
-            buf->capacity = new_cap;
-        }
-        buf->lines[buf->num_lines++] = strdup(linebuf);
+    size_t len;
+    char *data = read_file_data(buf, f, st.st_size, &len);
+    fclose(f);
+    if (!data) return -1;
+    int eof_newline = len == 0 || data[len - 1] == '\n';
+    int nlines;
+    char **lines = split_lines(buf, data, len, &nlines);
+    if (!lines || own_lines(buf, lines, nlines) != 0) {
+        free(lines);
+        free(data);
+        return -1;
     }
+    free(data);
 
-    if (buf->num_lines == 0) {
-        buf->lines[0] = strdup("");
-        buf->num_lines = 1;
+    /* Replace existing content */
+    int old_lines = buf->num_lines;
+    if (buf->packed) {
+        /* Nothing to unpack for text that is about to go */
+        free(buf->packed);
+        buf->packed = NULL;
+        buf->packed_size = 0;
+        buf->text_bytes = 0;
+    } else {
+        buffer_lines_will_change(buf, 0, old_lines);
+        for (int i = 0; i < buf->num_lines; i++) free(buf->lines[i]);
     }
-
-    fclose(f);
+    free(buf->lines);
+    buf->lines     = lines;
+    buf->num_lines = nlines;
+    buf->capacity  = nlines;
+    buffer_record_file(buf, &st, (off_t)len, eof_newline);
 
     free(buf->filename);
-    buf->filename = strdup(filename);
+    buf->filename = buf_strdup(buf, filename);
     buf->cursor_line = 0;
     buf->cursor_col  = 0;
     buf->top_line    = 0;
     buf->modified    = 0;
+    buf->edit_seq++;
+    account_lines(buf, 0, nlines, 1);
+    update_line_indexes(buf, 0, old_lines, nlines);
     return 0;
 }
 
-int buffer_save_file(Buffer *buf) {
-    if (!buf->filename) return -1;
+int buffer_load_file(Buffer *buf, const char *filename) {
+    TRACE_BEGIN("buffer_load_file");
+    int rc = load_file(buf, filename);
+    TRACE_END_N("buffer_load_file", buf->num_lines);
+    return rc;
+}
+
+static int save_file(Buffer *buf) {
+    if (!buf->filename || buffer_unpack(buf) != 0) return -1;
     FILE *f = fopen(buf->filename, "w");
     if (!f) return -1;
     for (int i = 0; i < buf->num_lines; i++) {
         fputs(buf->lines[i], f);
         fputc('\n', f);
     }
+    fflush(f);
+    off_t size = ftello(f);
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0) buffer_record_file(buf, &st, size, 1);
     fclose(f);
     buf->modified = 0;
     return 0;
 }
 
+int buffer_save_file(Buffer *buf) {
+    TRACE_BEGIN("buffer_save_file");
+    int rc = save_file(buf);
+    TRACE_END_N("buffer_save_file", buf->num_lines);
+    return rc;
+}
+
+/* Where line `ln` ends up after [start, start + count) became n lines. */
+static int replaced_line(int ln, int start, int count, int n) {
+    if (ln >= start + count) return ln + n - count;
+    if (ln >= start) return start + (ln - start < n ? ln - start : n - 1);
+    return ln;
+}
+
+/*
+ * Replace lines [start, start + count) with the n strings in `lines`,
+ * taking ownership of the strings (not of the array).  Cursor, mark and
+ * top line keep pointing at the same text wherever it still exists.
+ */
+void buffer_replace_lines(Buffer *buf, int start, int count,
+                          char **lines, int n) {
+    if (start < 0 || count < 0 || start + count > buf->num_lines) return;
+    if (buffer_unpack(buf) != 0) return;
+    if (buffer_reserve(buf, buf->num_lines - count + n) != 0) return;
+
+    buffer_lines_will_change(buf, start, count);
+    for (int i = start; i < start + count; i++) free(buf->lines[i]);
+    memmove(&buf->lines[start + n], &buf->lines[start + count],
+            sizeof(char *) * (size_t)(buf->num_lines - start - count));
+    memcpy(&buf->lines[start], lines, sizeof(char *) * (size_t)n);
+    buf->num_lines += n - count;
+    int new_n = n;
+
+    buf->cursor_line = replaced_line(buf->cursor_line, start, count, n);
+    buf->mark_line   = replaced_line(buf->mark_line, start, count, n);
+    buf->top_line    = replaced_line(buf->top_line, start, count, n);
+
+    if (buf->num_lines == 0) {
+        buf->lines[0] = buf_strdup(buf, "");
+        buf->num_lines = 1;
+        new_n = 1;
+    }
+    if (buf->top_line < 0) buf->top_line = 0;
+    if (buf->mark_line < 0) buf->mark_line = 0;
+    if (buf->mark_line >= buf->num_lines) buf->mark_line = buf->num_lines - 1;
+    int mark_len = (int)strlen(buf->lines[buf->mark_line]);
+    if (buf->mark_col > mark_len) buf->mark_col = mark_len;
+    buffer_clamp_cursor(buf);
+    buffer_lines_changed(buf, start, count, new_n);
+}
+
+/*
+ * Re-read the visited file and apply only the lines that differ, so
+ * cursor, mark and scroll position survive.  Returns the number of
+ * changed hunks, or -1 on error.
+ */
+int buffer_revert_file(Buffer *buf) {
+    if (!buf->filename || buffer_unpack(buf) != 0) return -1;
+    FILE *f = fopen(buf->filename, "r");
+    if (!f) return -1;
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) { fclose(f); return -1; }
+    size_t len;
+    char *data = read_file_data(buf, f, st.st_size, &len);
+    fclose(f);
+    if (!data) return -1;
+    int eof_newline = len == 0 || data[len - 1] == '\n';
+    int nlines;
+    char **lines = split_lines(buf, data, len, &nlines);
+    if (!lines) { free(data); return -1; }
+
+    DiffHunk *hunks;
+    int nhunks = diff_lines(buf->lines, buf->num_lines, lines, nlines, &hunks);
+    if (nhunks >= 0) {
+        /* Bottom-up, so earlier hunks' line numbers stay valid.  Only the
+         * lines that actually changed are copied out of the file data. */
+        for (int k = nhunks - 1; k >= 0; k--) {
+            DiffHunk *h = &hunks[k];
+            if (own_lines(buf, lines + h->b_start, h->b_count) != 0) {
+                nhunks = -1;
+                break;
+            }
+            buffer_replace_lines(buf, h->a_start, h->a_count,
+                                 lines + h->b_start, h->b_count);
+        }
+        free(hunks);
+    }
+    if (nhunks >= 0) {
+        buffer_record_file(buf, &st, (off_t)len, eof_newline);
+        buf->modified = 0;
+    }
+
+    free(lines);
+    free(data);
+    return nhunks;
+}
+
 void buffer_append_string(Buffer *buf, const char *str) {
-    if (!str || !*str) return;
+    if (!str || !*str || buffer_unpack(buf) != 0) return;
+    int first = buf->num_lines - 1;
+    buffer_lines_will_change(buf, first, 1);
 
     /* Process character by character, handling \r\n */
     for (const char *p = str; *p; p++) {
@@ -291,12 +1015,15 @@ void buffer_append_string(Buffer *buf, const char *str) {
             buf->cursor_line = buf->num_lines;
             if (buf->num_lines >= buf->capacity) {
                 int new_cap = buf->capacity * 2;
-                char **tmp = realloc(buf->lines, sizeof(char *) * new_cap);
-                if (!tmp) return;
+                char **tmp = buf_realloc(buf, buf->lines, sizeof(char *) * new_cap);
+                if (!tmp) {
+                    account_lines(buf, first, buf->num_lines - first, 1);
+                    return;
+                }
                 buf->lines = tmp;
                 buf->capacity = new_cap;
             }
-            buf->lines[buf->num_lines++] = strdup("");
+            buf->lines[buf->num_lines++] = buf_strdup(buf, "");
             buf->cursor_col = 0;
         } else if (c == '\b' || c == 127) {
             /* Backspace in shell output */
@@ -309,7 +1036,7 @@ void buffer_append_string(Buffer *buf, const char *str) {
             /* Append char to last line */
             char *line = buf->lines[buf->num_lines - 1];
             int len = (int)strlen(line);
-            char *newline = malloc(len + 2);
+            char *newline = buf_malloc(buf, len + 2);
             memcpy(newline, line, len);
             newline[len] = c;
             newline[len + 1] = '\0';
@@ -319,7 +1046,59 @@ void buffer_append_string(Buffer *buf, const char *str) {
     }
     buf->cursor_line = buf->num_lines - 1;
     buf->cursor_col  = (int)strlen(buf->lines[buf->cursor_line]);
-    buf->modified = 1;
+    buffer_lines_changed(buf, first, 1, buf->num_lines - first);
+}
+
+/*
+ * Append raw bytes to the end of the buffer.  Text up to the first '\n'
+ * extends the last line and every '\n' starts a new one.  Unlike
+ * buffer_append_string() nothing is interpreted, the line array grows at
+ * most once and every line is allocated exactly once, so this is the path
+ * for bulk data such as a followed file's new tail.  The cursor is left
+ * where it was.
+ */
+void buffer_append_text(Buffer *buf, const char *text, size_t len) {
+    if (!text || len == 0 || buffer_unpack(buf) != 0) return;
+    const char *end = text + len;
+
+    int newlines = 0;
+    for (const char *p = text; (p = memchr(p, '\n', (size_t)(end - p))); p++)
+        newlines++;
+    if (buffer_reserve(buf, buf->num_lines + newlines) != 0) return;
+    int first = buf->num_lines - 1;
+    buffer_lines_will_change(buf, first, 1);
+
+    /* First segment extends the current last line */
+    const char *seg_end = memchr(text, '\n', len);
+    if (!seg_end) seg_end = end;
+    if (seg_end > text) {
+        char *last = buf->lines[buf->num_lines - 1];
+        size_t last_len = strlen(last);
+        size_t seg_len  = (size_t)(seg_end - text);
+        char *joined = buf_realloc(buf, last, last_len + seg_len + 1);
+        if (!joined) {
+            account_lines(buf, first, 1, 1);
+            return;
+        }
+        memcpy(joined + last_len, text, seg_len);
+        joined[last_len + seg_len] = '\0';
+        buf->lines[buf->num_lines - 1] = joined;
+    }
+
+    /* Every newline opens a fresh line */
+    for (const char *p = seg_end; p < end; ) {
+        const char *start = p + 1;
+        const char *stop  = memchr(start, '\n', (size_t)(end - start));
+        if (!stop) stop = end;
+        size_t llen = (size_t)(stop - start);
+        char *line = buf_malloc(buf, llen + 1);
+        if (!line) break;
+        memcpy(line, start, llen);
+        line[llen] = '\0';
+        buf->lines[buf->num_lines++] = line;
+        p = stop;
+    }
+    buffer_lines_changed(buf, first, 1, buf->num_lines - first);
 }
 
 void buffer_scroll_to_end(Buffer *buf) {
@@ -349,80 +1128,84 @@ static void region_bounds(Buffer *buf,
     }
 }
 
-/* Return a newly-allocated string containing the region text, or NULL. */
-char *buffer_get_region(Buffer *buf) {
-    if (!buf->mark_active) return NULL;
+/* Number of bytes in the active region (lines joined with '\n'). */
+size_t buffer_region_size(Buffer *buf) {
+    if (!buf->mark_active) return 0;
     int sl, sc, el, ec;
     region_bounds(buf, &sl, &sc, &el, &ec);
 
-    size_t total = 0;
-    if (sl == el) {
-        total = (size_t)(ec - sc);
-    } else {
-        total = strlen(buf->lines[sl]) - sc + 1; /* +1 for newline */
-        for (int i = sl + 1; i < el; i++)
-            total += strlen(buf->lines[i]) + 1;
-        total += (size_t)ec;
-    }
+    if (sl == el) return (size_t)(ec - sc);
+    size_t total = strlen(buf->lines[sl]) - sc + 1; /* +1 for newline */
+    for (int i = sl + 1; i < el; i++)
+        total += strlen(buf->lines[i]) + 1;
+    return total + (size_t)ec;
+}
 
-    char *out = malloc(total + 1);
-    if (!out) return NULL;
+/* Copy the region text into `out`, which holds buffer_region_size() bytes. */
+void buffer_region_read(Buffer *buf, char *out) {
+    if (!buf->mark_active) return;
+    int sl, sc, el, ec;
+    region_bounds(buf, &sl, &sc, &el, &ec);
 
-    size_t pos = 0;
     if (sl == el) {
         memcpy(out, buf->lines[sl] + sc, (size_t)(ec - sc));
-        pos = (size_t)(ec - sc);
-    } else {
-        int flen = (int)strlen(buf->lines[sl]) - sc;
-        memcpy(out, buf->lines[sl] + sc, (size_t)flen);
-        pos += (size_t)flen;
+        return;
+    }
+    size_t pos = 0;
+    int flen = (int)strlen(buf->lines[sl]) - sc;
+    memcpy(out, buf->lines[sl] + sc, (size_t)flen);
+    pos += (size_t)flen;
+    out[pos++] = '\n';
+    for (int i = sl + 1; i < el; i++) {
+        int len = (int)strlen(buf->lines[i]);
+        memcpy(out + pos, buf->lines[i], (size_t)len);
+        pos += (size_t)len;
         out[pos++] = '\n';
-        for (int i = sl + 1; i < el; i++) {
-            int len = (int)strlen(buf->lines[i]);
-            memcpy(out + pos, buf->lines[i], (size_t)len);
-            pos += (size_t)len;
-            out[pos++] = '\n';
-        }
-        memcpy(out + pos, buf->lines[el], (size_t)ec);
-        pos += (size_t)ec;
     }
-    out[pos] = '\0';
+    memcpy(out + pos, buf->lines[el], (size_t)ec);
+}
+
+/* Return a newly-allocated string containing the region text, or NULL. */
+char *buffer_get_region(Buffer *buf) {
+    if (!buf->mark_active) return NULL;
+    size_t total = buffer_region_size(buf);
+    char *out = malloc(total + 1);
+    if (!out) return NULL;
+    buffer_region_read(buf, out);
+    out[total] = '\0';
     return out;
 }
 
+/* Read the region straight into a kill ring entry */
+static void kill_region_text(Buffer *buf, KillRing *ring, int append) {
+    if (!ring) return;
+    size_t len = buffer_region_size(buf);
+    char *dst = kill_ring_reserve(ring, len, append);
+    if (dst) buffer_region_read(buf, dst);
+}
+
 /* Copy region into kill ring without modifying the buffer. */
-void buffer_copy_region(Buffer *buf, char **kill_ring) {
+void buffer_copy_region(Buffer *buf, KillRing *ring, int append) {
     if (!buf->mark_active) return;
-    char *region = buffer_get_region(buf);
-    if (!region) return;
-    if (kill_ring) {
-        free(*kill_ring);
-        *kill_ring = region;
-    } else {
-        free(region);
-    }
+    kill_region_text(buf, ring, append);
     buf->mark_active = 0;
 }
 
 /* Cut region into kill ring, removing the text from the buffer. */
-void buffer_kill_region(Buffer *buf, char **kill_ring) {
+void buffer_kill_region(Buffer *buf, KillRing *ring, int append) {
     if (!buf->mark_active) return;
-    char *region = buffer_get_region(buf);
-    if (!region) return;
-    if (kill_ring) {
-        free(*kill_ring);
-        *kill_ring = region;
-    } else {
-        free(region);
-    }
-
+    kill_region_text(buf, ring, append);
     int sl, sc, el, ec;
     region_bounds(buf, &sl, &sc, &el, &ec);
+    buf->mark_active = 0;
+    buffer_delete_range(buf, sl, sc, el, ec);
+}
 
+void buffer_delete_range(Buffer *buf, int sl, int sc, int el, int ec) {
     buf->cursor_line = sl;
     buf->cursor_col  = sc;
-    buf->mark_active = 0;
 
+    buffer_lines_will_change(buf, sl, el - sl + 1);
     if (sl == el) {
         char *line = buf->lines[sl];
         int len = (int)strlen(line);
@@ -432,8 +1215,11 @@ void buffer_kill_region(Buffer *buf, char **kill_ring) {
         char *last  = buf->lines[el];
         int   first_prefix   = sc;
         int   last_suffix_len = (int)strlen(last) - ec;
-        char *merged = malloc((size_t)(first_prefix + last_suffix_len + 1));
-        if (!merged) return;
+        char *merged = buf_malloc(buf, (size_t)(first_prefix + last_suffix_len + 1));
+        if (!merged) {
+            account_lines(buf, sl, el - sl + 1, 1);
+            return;
+        }
         memcpy(merged, first, (size_t)first_prefix);
         memcpy(merged + first_prefix, last + ec, (size_t)(last_suffix_len + 1));
         free(buf->lines[sl]);
@@ -445,7 +1231,7 @@ void buffer_kill_region(Buffer *buf, char **kill_ring) {
                 sizeof(char *) * (size_t)(buf->num_lines - el - 1));
         buf->num_lines -= remove;
     }
-    buf->modified = 1;
+    buffer_lines_changed(buf, sl, el - sl + 1, 1);
 }
 
 /* --- Search and replace --- */
@@ -457,8 +1243,10 @@ void buffer_kill_region(Buffer *buf, char **kill_ring) {
  */
 int buffer_search_forward(Buffer *buf, const char *query) {
     if (!query || !*query) return 0;
+    long start = stats_now_ns();
+    int hit = 0;
     int nlines = buf->num_lines;
-    for (int i = 0; i < nlines; i++) {
+    for (int i = 0; i < nlines && !hit; i++) {
         int ln = (buf->cursor_line + i) % nlines;
         char *line = buf->lines[ln];
         int start_col = (i == 0) ? buf->cursor_col + 1 : 0;
@@ -468,10 +1256,11 @@ int buffer_search_forward(Buffer *buf, const char *query) {
         if (found) {
             buf->cursor_line = ln;
             buf->cursor_col  = (int)(found - line);
-            return 1;
+            hit = 1;
         }
     }
-    return 0;
+    stats_record(STAT_SEARCH, stats_now_ns() - start);
+    return hit;
 }
 
 /*
@@ -481,6 +1270,7 @@ int buffer_search_forward(Buffer *buf, const char *query) {
 int buffer_replace_all(Buffer *buf, const char *search,
                         const char *replace_str) {
     if (!search || !*search) return 0;
+    long start = stats_now_ns();
     int slen = (int)strlen(search);
     int rlen = replace_str ? (int)strlen(replace_str) : 0;
     int count = 0;
@@ -496,7 +1286,7 @@ int buffer_replace_all(Buffer *buf, const char *search,
 
         int old_len = (int)strlen(line);
         int new_len = old_len + occ * (rlen - slen);
-        char *newline = malloc((size_t)(new_len + 1));
+        char *newline = buf_malloc(buf, (size_t)(new_len + 1));
         if (!newline) continue;
 
         char *src = line;
@@ -516,9 +1306,13 @@ int buffer_replace_all(Buffer *buf, const char *search,
         int rem = old_len - (int)(src - line);
         memcpy(dst, src, (size_t)(rem + 1)); /* +1 for NUL */
 
+        buf->text_bytes += (size_t)new_len - (size_t)old_len;
+        buf->line_heap_bytes += line_heap(newline) - line_heap(line);
         free(buf->lines[ln]);
         buf->lines[ln] = newline;
+        update_line_indexes(buf, ln, 1, 1);
     }
-    if (count > 0) buf->modified = 1;
+    if (count > 0) buffer_mark_changed(buf);
+    stats_record(STAT_REPLACE, stats_now_ns() - start);
     return count;
 }
@@ -2,6 +2,9 @@
 #define BUFFER_H
 
 #include <sys/types.h>
+#include <stddef.h>
+#include <time.h>
+#include "kill_ring.h"
 
 typedef struct Buffer {
     char **lines;
@@ -13,6 +16,10 @@ typedef struct Buffer {
     int cursor_line;
     int cursor_col;
     int top_line;
+    int left_col;         /* first screen column shown (horizontal scroll) */
+    struct WrapIndex *wrap;   /* visual-line-mode index, NULL when off */
+    int top_row;          /* with wrap: first row of top_line shown */
+    struct Syntax *syntax;    /* highlighting state, NULL when off */
     int is_shell;
     int pty_fd;
     pid_t shell_pid;
@@ -20,30 +27,114 @@ typedef struct Buffer {
     int mark_line;
     int mark_col;
     int mark_active;
+    unsigned long change_gen;   /* bumped on every text change */
+    int batch_depth;            /* open edit transactions */
+    int batch_edits;            /* edits folded into the open transaction */
+    unsigned long edit_seq;     /* bumped on every edit, even inside a batch */
+    unsigned long allocs;       /* heap allocations made for this buffer */
+    unsigned long long pty_bytes;   /* bytes read from the shell's PTY */
+    size_t text_bytes;          /* line text, without terminators */
+    size_t line_heap_bytes;     /* heap chunks holding the line strings */
+
+    /* While packed (buffer_pack), lines is NULL and the text is held in
+     * compressed blocks; num_lines and text_bytes stay valid */
+    char *packed;
+    size_t packed_size;
+    unsigned long idle_seq;     /* edit_seq when idle_since_ms was taken */
+    double idle_since_ms;       /* last shown or edited (editor clock) */
+
+    /* Display columns of recently used lines (see buffer_display_col) */
+    struct LineCols *col_cache;
+    /* Column kept across consecutive C-n/C-p, valid while the cursor
+     * stays at goal_line:goal_byte */
+    int goal_col;
+    int goal_line;
+    int goal_byte;
+
+    /* Identity of `filename` on disk as of the last load/save */
+    int has_file_id;
+    dev_t file_dev;
+    ino_t file_ino;
+    off_t file_size;      /* bytes of the file reflected in the buffer */
+    struct timespec file_mtime;
+    int eof_newline;      /* file ended with '\n' at file_size */
+
+    /* follow-file (tail) mode */
+    int follow;
+    int watch_wd;         /* inotify watch descriptor, -1 if none */
+
+    /* Editor registry bookkeeping */
+    int index;            /* position in Editor.buffers */
+    int file_indexed;     /* listed under indexed_dev/ino */
+    dev_t indexed_dev;
+    ino_t indexed_ino;
 } Buffer;
 
+/* Memory held by a buffer's text (buffer_mem_stats) */
+typedef struct BufferMemStats {
+    size_t text;            /* bytes of text, one newline per line */
+    size_t line_array;      /* line pointer array, at its capacity */
+    size_t overhead;        /* allocator headers and slack */
+    size_t packed;          /* compressed text of a packed buffer */
+    size_t total;
+} BufferMemStats;
+
 Buffer *buffer_create(const char *name);
 void buffer_destroy(Buffer *buf);
 void buffer_insert_char(Buffer *buf, char c);
+void buffer_insert_text(Buffer *buf, const char *text, size_t len);
 void buffer_delete_char(Buffer *buf);
 void buffer_delete_forward(Buffer *buf);
-void buffer_kill_line(Buffer *buf, char **kill_ring);
-void buffer_yank(Buffer *buf, const char *kill_ring);
+/* Kills go to `ring` (NULL: nowhere); with `append` they extend its newest
+ * entry, as consecutive kills do */
+void buffer_kill_line(Buffer *buf, KillRing *ring, int append);
+void buffer_yank(Buffer *buf, const KillEntry *k);
 void buffer_move_cursor(Buffer *buf, int dline, int dcol);
+void buffer_forward_char(Buffer *buf);
+void buffer_backward_char(Buffer *buf);
 void buffer_move_bol(Buffer *buf);
 void buffer_move_eol(Buffer *buf);
 int buffer_load_file(Buffer *buf, const char *filename);
 int buffer_save_file(Buffer *buf);
+int buffer_revert_file(Buffer *buf);
+void buffer_replace_lines(Buffer *buf, int start, int count,
+                          char **lines, int n);
 void buffer_append_string(Buffer *buf, const char *str);
+void buffer_append_text(Buffer *buf, const char *text, size_t len);
 void buffer_scroll_to_end(Buffer *buf);
 void buffer_ensure_line(Buffer *buf, int line);
 void buffer_clamp_cursor(Buffer *buf);
+void buffer_mark_changed(Buffer *buf);
+/* Call before changing lines [start, start + n) in place, then
+ * buffer_lines_changed() once done. */
+void buffer_lines_will_change(Buffer *buf, int start, int n);
+void buffer_lines_changed(Buffer *buf, int start, int old_n, int new_n);
+/* Kept up to date by every edit: O(1), no walk over the lines */
+void buffer_mem_stats(Buffer *buf, BufferMemStats *st);
+/* Compress the text of an idle buffer and free its lines; returns 0, or
+ * -1 (buffer unchanged) if out of memory or packing would not save any. */
+int buffer_pack(Buffer *buf);
+/* Restore the lines of a packed buffer.  Anything that reads or edits
+ * lines must do this first; the editor's current buffer, buffers being
+ * switched to and the buffer functions that may be given any buffer
+ * (replace_lines, append, save, revert) do it themselves.  Returns 0, or
+ * -1 if out of memory (the buffer stays packed). */
+int buffer_unpack(Buffer *buf);
+/* UTF-8 aware mapping between byte offsets and screen columns of line ln */
+int buffer_display_col(Buffer *buf, int ln, int byte);
+int buffer_col_to_byte(Buffer *buf, int ln, int col);
+void buffer_begin_batch(Buffer *buf);
+int buffer_end_batch(Buffer *buf);
 
 /* Mark / region operations */
 void buffer_set_mark(Buffer *buf);
 char *buffer_get_region(Buffer *buf);
-void buffer_copy_region(Buffer *buf, char **kill_ring);
-void buffer_kill_region(Buffer *buf, char **kill_ring);
+size_t buffer_region_size(Buffer *buf);
+void buffer_region_read(Buffer *buf, char *out);
+void buffer_copy_region(Buffer *buf, KillRing *ring, int append);
+void buffer_kill_region(Buffer *buf, KillRing *ring, int append);
+/* Delete sl:sc up to el:ec, leaving the cursor at sl:sc */
+void buffer_delete_range(Buffer *buf, int sl, int sc, int el, int ec);
 
 /* Search and replace */
 int buffer_search_forward(Buffer *buf, const char *query);
@@ -0,0 +1,287 @@
+#include "diff.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+typedef struct DiffCtx {
+    const int *a;           /* line equivalence-class ids */
+    const int *b;
+    char *a_changed;
+    char *b_changed;
+    int *fd;                /* forward furthest-x per diagonal */
+    int *bd;                /* backward furthest-x per diagonal */
+    int too_expensive;
+} DiffCtx;
+
+/* --- Line interning: equal lines get equal ids --- */
+
+static uint64_t hash_line(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+typedef struct InternSlot {
+    uint64_t hash;
+    const char *line;
+    int id;
+} InternSlot;
+
+/* Returns the number of distinct lines, or -1 on allocation failure. */
+static int intern_lines(char *const *a, int na, char *const *b, int nb,
+                        int *a_ids, int *b_ids) {
+    size_t cap = 16;
+    while (cap < (size_t)(na + nb) * 2) cap <<= 1;
+    InternSlot *slots = calloc(cap, sizeof(InternSlot));
+    if (!slots) return -1;
+
+    int next_id = 0;
+    for (int side = 0; side < 2; side++) {
+        char *const *lines = side ? b : a;
+        int n   = side ? nb : na;
+        int *ids = side ? b_ids : a_ids;
+        for (int i = 0; i < n; i++) {
+            uint64_t h = hash_line(lines[i]);
+            size_t pos = (size_t)h & (cap - 1);
+            while (slots[pos].line &&
+                   (slots[pos].hash != h || strcmp(slots[pos].line, lines[i])))
+                pos = (pos + 1) & (cap - 1);
+            if (!slots[pos].line) {
+                slots[pos].hash = h;
+                slots[pos].line = lines[i];
+                slots[pos].id   = next_id++;
+            }
+            ids[i] = slots[pos].id;
+        }
+    }
+    free(slots);
+    return next_id;
+}
+
+/* --- Myers middle snake, linear space --- */
+
+/*
+ * Find a point (xmid, ymid) on an optimal path through
+ * a[xoff, xlim) x b[yoff, ylim).  Past `too_expensive` steps settle for
+ * the furthest-reaching diagonal so pathological inputs stay near-linear.
+ */
+static void find_midpoint(DiffCtx *c, int xoff, int xlim, int yoff, int ylim,
+                          int *xmid, int *ymid) {
+    const int *a = c->a, *b = c->b;
+    int *fd = c->fd, *bd = c->bd;
+    int dmin = xoff - ylim, dmax = xlim - yoff;
+    int fmid = xoff - yoff, bmid = xlim - ylim;
+    int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    int odd = (fmid - bmid) & 1;
+
+    fd[fmid] = xoff;
+    bd[bmid] = xlim;
+
+    for (int cost = 1;; cost++) {
+        /* Extend the forward search by one edit */
+        if (fmin > dmin) fd[--fmin - 1] = -1; else fmin++;
+        if (fmax < dmax) fd[++fmax + 1] = -1; else fmax--;
+        for (int d = fmax; d >= fmin; d -= 2) {
+            int tlo = fd[d - 1], thi = fd[d + 1];
+            int x = tlo >= thi ? tlo + 1 : thi;
+            int y = x - d;
+            while (x < xlim && y < ylim && a[x] == b[y]) { x++; y++; }
+            fd[d] = x;
+            if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+                *xmid = x; *ymid = y;
+                return;
+            }
+        }
+
+        /* Extend the backward search by one edit */
+        if (bmin > dmin) bd[--bmin - 1] = INT_MAX; else bmin++;
+        if (bmax < dmax) bd[++bmax + 1] = INT_MAX; else bmax--;
+        for (int d = bmax; d >= bmin; d -= 2) {
+            int tlo = bd[d - 1], thi = bd[d + 1];
+            int x = tlo < thi ? tlo : thi - 1;
+            int y = x - d;
+            while (x > xoff && y > yoff && a[x - 1] == b[y - 1]) { x--; y--; }
+            bd[d] = x;
+            if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+                *xmid = x; *ymid = y;
+                return;
+            }
+        }
+
+        if (cost < c->too_expensive) continue;
+
+        /* Too costly: take whichever frontier got furthest */
+        int fxybest = -1, fxbest = xoff;
+        for (int d = fmax; d >= fmin; d -= 2) {
+            int x = fd[d] < xlim ? fd[d] : xlim;
+            int y = x - d;
+            if (ylim < y) { x = ylim + d; y = ylim; }
+            if (fxybest < x + y) { fxybest = x + y; fxbest = x; }
+        }
+        int bxybest = INT_MAX, bxbest = xlim;
+        for (int d = bmax; d >= bmin; d -= 2) {
+            int x = bd[d] > xoff ? bd[d] : xoff;
+            int y = x - d;
+            if (y < yoff) { x = yoff + d; y = yoff; }
+            if (x + y < bxybest) { bxybest = x + y; bxbest = x; }
+        }
+        if ((xlim + ylim) - bxybest < fxybest - (xoff + yoff)) {
+            *xmid = fxbest; *ymid = fxybest - fxbest;
+        } else {
+            *xmid = bxbest; *ymid = bxybest - bxbest;
+        }
+        return;
+    }
+}
+
+static void compare_seq(DiffCtx *c, int xoff, int xlim, int yoff, int ylim) {
+    for (;;) {
+        /* Common prefix and suffix never need the search */
+        while (xoff < xlim && yoff < ylim && c->a[xoff] == c->b[yoff]) {
+            xoff++; yoff++;
+        }
+        while (xlim > xoff && ylim > yoff &&
+               c->a[xlim - 1] == c->b[ylim - 1]) {
+            xlim--; ylim--;
+        }
+
+        if (xoff == xlim) {
+            while (yoff < ylim) c->b_changed[yoff++] = 1;
+            return;
+        }
+        if (yoff == ylim) {
+            while (xoff < xlim) c->a_changed[xoff++] = 1;
+            return;
+        }
+
+        int xmid, ymid;
+        find_midpoint(c, xoff, xlim, yoff, ylim, &xmid, &ymid);
+
+        /* Recurse into the smaller half, loop on the larger */
+        if ((xmid - xoff) + (ymid - yoff) < (xlim - xmid) + (ylim - ymid)) {
+            compare_seq(c, xoff, xmid, yoff, ymid);
+            xoff = xmid; yoff = ymid;
+        } else {
+            compare_seq(c, xmid, xlim, ymid, ylim);
+            xlim = xmid; ylim = ymid;
+        }
+    }
+}
+
+/*
+ * Diff the middle parts a[0, na) and b[0, nb) that differ at both ends,
+ * marking changed lines.  Lines that occur on only one side can never
+ * match, so they are marked up front and the search only runs over the
+ * rest; a rewritten file then costs linear time instead of O(ND).
+ */
+static int diff_core(char *const *a, int na, char *const *b, int nb,
+                     char *a_changed, char *b_changed) {
+    int *ids = malloc(sizeof(int) * ((size_t)na + nb + 1) * 2);
+    if (!ids) return -1;
+    int *a_ids = ids, *b_ids = ids + na;
+    int *map = ids + na + nb;      /* compacted index -> original index */
+
+    int nids = intern_lines(a, na, b, nb, a_ids, b_ids);
+    unsigned char *seen = nids >= 0 ? calloc((size_t)nids + 1, 1) : NULL;
+    if (!seen) { free(ids); return -1; }
+    for (int i = 0; i < na; i++) seen[a_ids[i]] |= 1;
+    for (int j = 0; j < nb; j++) seen[b_ids[j]] |= 2;
+
+    /* Compact both sides in place, keeping only lines found on both */
+    int ka = 0, kb = 0;
+    for (int i = 0; i < na; i++) {
+        if (seen[a_ids[i]] == 3) { map[ka] = i; a_ids[ka++] = a_ids[i]; }
+        else a_changed[i] = 1;
+    }
+    for (int j = 0; j < nb; j++) {
+        if (seen[b_ids[j]] == 3) { map[na + kb] = j; b_ids[kb++] = b_ids[j]; }
+        else b_changed[j] = 1;
+    }
+    free(seen);
+
+    size_t diags = (size_t)ka + (size_t)kb + 3;
+    int  *diag    = malloc(sizeof(int) * diags * 2);
+    char *changed = calloc((size_t)ka + kb + 1, 1);
+    if (!diag || !changed) {
+        free(ids); free(diag); free(changed);
+        return -1;
+    }
+
+    DiffCtx c;
+    c.a = a_ids;
+    c.b = b_ids;
+    c.a_changed = changed;
+    c.b_changed = changed + ka;
+    c.fd = diag + kb + 1;
+    c.bd = diag + diags + kb + 1;
+    c.too_expensive = 1;
+    for (size_t d = diags; d != 0; d >>= 2) c.too_expensive <<= 1;
+    if (c.too_expensive < 4096) c.too_expensive = 4096;
+
+    compare_seq(&c, 0, ka, 0, kb);
+    for (int i = 0; i < ka; i++)
+        if (c.a_changed[i]) a_changed[map[i]] = 1;
+    for (int j = 0; j < kb; j++)
+        if (c.b_changed[j]) b_changed[map[na + j]] = 1;
+
+    free(ids); free(diag); free(changed);
+    return 0;
+}
+
+int diff_lines(char *const *a, int na, char *const *b, int nb,
+               DiffHunk **hunks) {
+    *hunks = NULL;
+
+    /* Unchanged head and tail are compared directly, without hashing */
+    int pre = 0;
+    while (pre < na && pre < nb && strcmp(a[pre], b[pre]) == 0) pre++;
+    int suf = 0;
+    while (suf < na - pre && suf < nb - pre &&
+           strcmp(a[na - 1 - suf], b[nb - 1 - suf]) == 0) suf++;
+
+    int ma = na - pre - suf, mb = nb - pre - suf;
+    char *changed = calloc((size_t)ma + mb + 1, 1);
+    if (!changed) return -1;
+    char *a_changed = changed, *b_changed = changed + ma;
+    if (ma > 0 && mb > 0) {
+        if (diff_core(a + pre, ma, b + pre, mb, a_changed, b_changed) != 0) {
+            free(changed);
+            return -1;
+        }
+    } else {
+        memset(changed, 1, (size_t)ma + mb);
+    }
+
+    /* Collapse the change marks into hunks */
+    int cap = 16, nhunks = 0;
+    DiffHunk *out = malloc(sizeof(DiffHunk) * cap);
+    if (!out) { free(changed); return -1; }
+    int i = 0, j = 0;
+    while (i < ma || j < mb) {
+        if (i < ma && j < mb && !a_changed[i] && !b_changed[j]) {
+            i++; j++;
+            continue;
+        }
+        DiffHunk h = { pre + i, 0, pre + j, 0 };
+        while (i < ma && a_changed[i]) i++;
+        while (j < mb && b_changed[j]) j++;
+        h.a_count = pre + i - h.a_start;
+        h.b_count = pre + j - h.b_start;
+        if (h.a_count == 0 && h.b_count == 0) break;  /* inconsistent marks */
+        if (nhunks == cap) {
+            DiffHunk *tmp = realloc(out, sizeof(DiffHunk) * cap * 2);
+            if (!tmp) { free(out); free(changed); return -1; }
+            out = tmp;
+            cap *= 2;
+        }
+        out[nhunks++] = h;
+    }
+
+    free(changed);
+    *hunks = out;
+    return nhunks;
+}
@@ -0,0 +1,21 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+/* One changed region: a[a_start, a_start + a_count) became
+ * b[b_start, b_start + b_count). */
+typedef struct DiffHunk {
+    int a_start;
+    int a_count;
+    int b_start;
+    int b_count;
+} DiffHunk;
+
+/*
+ * Line-level diff of two line arrays (Myers' O(ND) algorithm in linear
+ * space).  Stores a malloc'd array of hunks in ascending order in *hunks
+ * and returns their number, or -1 on allocation failure.
+ */
+int diff_lines(char *const *a, int na, char *const *b, int nb,
+               DiffHunk **hunks);
+
+#endif /* DIFF_H */
@@ -1,24 +1,130 @@
 #include "editor.h"
 #include "buffer.h"
 #include "script.h"
+#include "file_watch.h"
+#include "syntax.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define INITIAL_BUFFERS 16
+#define INITIAL_TABLE_CAP 32
+#define PACK_DELAY_SECS 300         /* default idle time before packing */
+#define PACK_MIN_BYTES  65536       /* smaller buffers are not worth it */
 
 Editor *g_editor = NULL;
 
+/* --- Buffer registry --- */
+
+static uint64_t hash_name(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t hash_file_id(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ULL;
+    h ^= (uint64_t)dev + 0x7f4a7c159e3779b9ULL + (h << 6) + (h >> 2);
+    return h ^ (h >> 31);
+}
+
+static uint64_t name_key(const Buffer *buf) {
+    return hash_name(buf->name);
+}
+
+static uint64_t file_key(const Buffer *buf) {
+    return hash_file_id(buf->indexed_dev, buf->indexed_ino);
+}
+
+static void table_put(BufferTable *t, Buffer *buf,
+                      uint64_t (*key)(const Buffer *)) {
+    size_t mask = t->cap - 1;
+    size_t pos = (size_t)key(buf) & mask;
+    while (t->slots[pos]) pos = (pos + 1) & mask;
+    t->slots[pos] = buf;
+    t->count++;
+}
+
+static int table_insert(BufferTable *t, Buffer *buf,
+                        uint64_t (*key)(const Buffer *)) {
+    if ((t->count + 1) * 2 > t->cap) {
+        size_t new_cap = t->cap ? t->cap * 2 : INITIAL_TABLE_CAP;
+        Buffer **slots = calloc(new_cap, sizeof(Buffer *));
+        if (!slots) return -1;
+        BufferTable old = *t;
+        t->slots = slots;
+        t->cap   = new_cap;
+        t->count = 0;
+        for (size_t i = 0; i < old.cap; i++)
+            if (old.slots[i]) table_put(t, old.slots[i], key);
+        free(old.slots);
+    }
+    table_put(t, buf, key);
+    return 0;
+}
+
+/* Remove `buf`, shifting later probe-chain entries back (no tombstones). */
+static void table_remove(BufferTable *t, Buffer *buf,
+                         uint64_t (*key)(const Buffer *)) {
+    if (!t->cap) return;
+    size_t mask = t->cap - 1;
+    size_t i = (size_t)key(buf) & mask;
+    while (t->slots[i] != buf) {
+        if (!t->slots[i]) return;
+        i = (i + 1) & mask;
+    }
+    for (size_t j = i;;) {
+        j = (j + 1) & mask;
+        if (!t->slots[j]) break;
+        size_t home = (size_t)key(t->slots[j]) & mask;
+        /* Move slots[j] into the hole unless its home lies in (i, j] */
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i] = NULL;
+    t->count--;
+}
+
+static int editor_add_buffer(Editor *e, Buffer *buf) {
+    if (e->num_buffers >= e->buffers_cap) {
+        int new_cap = e->buffers_cap ? e->buffers_cap * 2 : INITIAL_BUFFERS;
+        Buffer **tmp = realloc(e->buffers, sizeof(Buffer *) * new_cap);
+        if (!tmp) return -1;
+        e->buffers = tmp;
+        e->buffers_cap = new_cap;
+    }
+    if (table_insert(&e->by_name, buf, name_key) != 0) return -1;
+    buf->index = e->num_buffers;
+    e->buffers[e->num_buffers++] = buf;
+    return 0;
+}
+
 Editor *editor_create(void) {
     Editor *e = calloc(1, sizeof(Editor));
     if (!e) return NULL;
 
     e->running = 1;
-    e->kill_ring = NULL;
-    e->pending_ctrl_x = 0;
-    e->pending_meta = 0;
+    kill_ring_init(&e->kill_ring);
+    e->pending_keymap = NULL;
+    e->pending_keys[0] = '\0';
     e->minibuf_active = 0;
     e->minibuf_len = 0;
     e->show_help = 0;
+    e->watch_fd = -1;
+    e->auto_revert = 1;
+    e->pack_delay_secs = PACK_DELAY_SECS;
+    e->js_time_limit_ms = 5000;
+    clock_gettime(CLOCK_MONOTONIC, &e->start_time);
 
     /* Create scratch buffer */
     Buffer *scratch = buffer_create("*scratch*");
@@ -29,77 +135,223 @@ Editor *editor_create(void) {
             ";; C-x C-c: quit       C-x s: shell   M-x: execute command\n"
             ";; F1: help\n");
         scratch->modified = 0;
-        e->buffers[e->num_buffers++] = scratch;
+        if (editor_add_buffer(e, scratch) != 0) buffer_destroy(scratch);
     }
 
     e->current_buffer = 0;
-    e->js_ctx = script_init(e);
+    /* The scripting heap is created lazily, see editor_script_ctx() */
 
     return e;
 }
 
+double editor_elapsed_ms(Editor *e) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - e->start_time.tv_sec) * 1e3 +
+           (double)(now.tv_nsec - e->start_time.tv_nsec) / 1e6;
+}
+
+/*
+ * The Duktape heap, created on first use: by eval-js/load-js, or by the
+ * main loop's first idle tick after the first frame.  Creating it runs
+ * init.js.  Only one attempt is made; NULL means scripting is unavailable.
+ */
+duk_context *editor_script_ctx(Editor *e) {
+    if (e->js_ctx || e->js_init_tried) return e->js_ctx;
+    e->js_init_tried = 1;
+    e->js_ctx = script_init(e);
+    if (!e->js_ctx) return NULL;
+    editor_load_script(e, NULL);
+    e->js_ready_ms = editor_elapsed_ms(e);
+    return e->js_ctx;
+}
+
+/*
+ * Run a script file (init.js when path is NULL) and report the result with
+ * its load time, which shows whether the bytecode cache was hit.
+ */
+void editor_load_script(Editor *e, const char *path) {
+    char result[256] = {0};
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    duk_context *ctx = editor_script_ctx(e);
+    if (!ctx) {
+        if (path) editor_set_message(e, "Scripting unavailable");
+        return;
+    }
+    int rc = path ? script_load_file(ctx, path, result, sizeof(result))
+                  : script_load_init(ctx, result, sizeof(result));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (rc == -2) return;   /* no init.js */
+
+    const char *name = path ? path : "init.js";
+    if (rc < 0) {
+        editor_set_message(e, "%s: %s", name, result);
+        return;
+    }
+    double ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 +
+                (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+    editor_set_message(e, "Loaded %s in %.1f ms (%s)", name, ms,
+                       rc == 1 ? "cached bytecode" : "compiled");
+}
+
 void editor_destroy(Editor *e) {
     if (!e) return;
     for (int i = 0; i < e->num_buffers; i++) {
         buffer_destroy(e->buffers[i]);
     }
-    free(e->kill_ring);
+    free(e->buffers);
+    free(e->by_name.slots);
+    free(e->by_file.slots);
+    kill_ring_free(&e->kill_ring);
+    free(e->kmacro);
+    free(e->input);
+    file_watch_shutdown(e);
     if (e->js_ctx) script_destroy(e->js_ctx);
     free(e);
 }
 
 Buffer *editor_current_buffer(Editor *e) {
     if (e->num_buffers == 0) return NULL;
-    return e->buffers[e->current_buffer];
+    Buffer *buf = e->buffers[e->current_buffer];
+    if (buf->packed && buffer_unpack(buf) != 0) {
+        editor_set_message(e, "Out of memory unpacking %s", buf->name);
+        return NULL;
+    }
+    return buf;
 }
 
 Buffer *editor_find_buffer(Editor *e, const char *name) {
-    for (int i = 0; i < e->num_buffers; i++) {
-        if (strcmp(e->buffers[i]->name, name) == 0)
-            return e->buffers[i];
+    BufferTable *t = &e->by_name;
+    if (!t->cap) return NULL;
+    size_t mask = t->cap - 1;
+    for (size_t i = (size_t)hash_name(name) & mask; t->slots[i];
+         i = (i + 1) & mask) {
+        if (strcmp(t->slots[i]->name, name) == 0) return t->slots[i];
+    }
+    return NULL;
+}
+
+Buffer *editor_find_file_buffer(Editor *e, dev_t dev, ino_t ino) {
+    BufferTable *t = &e->by_file;
+    if (!t->cap) return NULL;
+    size_t mask = t->cap - 1;
+    for (size_t i = (size_t)hash_file_id(dev, ino) & mask; t->slots[i];
+         i = (i + 1) & mask) {
+        Buffer *buf = t->slots[i];
+        if (buf->indexed_dev == dev && buf->indexed_ino == ino) return buf;
     }
     return NULL;
 }
 
+/* Re-key `buf` in the file-identity index after a load, save or rotation. */
+void editor_update_file_id(Editor *e, Buffer *buf) {
+    if (buf->file_indexed) {
+        if (buf->has_file_id && buf->indexed_dev == buf->file_dev &&
+            buf->indexed_ino == buf->file_ino)
+            return;
+        table_remove(&e->by_file, buf, file_key);
+        buf->file_indexed = 0;
+    }
+    if (!buf->has_file_id) return;
+    buf->indexed_dev = buf->file_dev;
+    buf->indexed_ino = buf->file_ino;
+    if (table_insert(&e->by_file, buf, file_key) == 0) buf->file_indexed = 1;
+}
+
+/* Names are unique: a taken name gets a "<2>", "<3>", ... suffix. */
 Buffer *editor_new_buffer(Editor *e, const char *name) {
-    if (e->num_buffers >= MAX_BUFFERS) return NULL;
+    char *unique = NULL;
+    if (editor_find_buffer(e, name)) {
+        size_t len = strlen(name) + 16;
+        unique = malloc(len);
+        if (!unique) return NULL;
+        for (int n = 2;; n++) {
+            snprintf(unique, len, "%s<%d>", name, n);
+            if (!editor_find_buffer(e, unique)) break;
+        }
+        name = unique;
+    }
     Buffer *buf = buffer_create(name);
+    free(unique);
     if (!buf) return NULL;
-    e->buffers[e->num_buffers++] = buf;
+    if (editor_add_buffer(e, buf) != 0) {
+        buffer_destroy(buf);
+        return NULL;
+    }
     return buf;
 }
 
+/* The last buffer takes the freed slot, so removal is O(1). */
 void editor_kill_buffer(Editor *e, int idx) {
     if (idx < 0 || idx >= e->num_buffers) return;
-    buffer_destroy(e->buffers[idx]);
-    memmove(&e->buffers[idx], &e->buffers[idx + 1],
-            sizeof(Buffer *) * (e->num_buffers - idx - 1));
-    e->num_buffers--;
+    Buffer *victim = e->buffers[idx];
+    file_watch_remove(e, victim);
+    table_remove(&e->by_name, victim, name_key);
+    if (victim->file_indexed) table_remove(&e->by_file, victim, file_key);
+    if (e->yank_buf == victim) e->yank_buf = NULL;
+    script_buffer_killed(e, victim);
+    buffer_destroy(victim);
+
+    int last = --e->num_buffers;
+    if (idx != last) {
+        e->buffers[idx] = e->buffers[last];
+        e->buffers[idx]->index = idx;
+        if (e->current_buffer == last) e->current_buffer = idx;
+    }
     if (e->num_buffers == 0) {
-        e->buffers[0] = buffer_create("*scratch*");
-        e->num_buffers = 1;
+        Buffer *scratch = buffer_create("*scratch*");
+        if (scratch && editor_add_buffer(e, scratch) != 0)
+            buffer_destroy(scratch);
     }
     if (e->current_buffer >= e->num_buffers)
         e->current_buffer = e->num_buffers - 1;
 }
 
 void editor_switch_to_buffer(Editor *e, const char *name) {
-    for (int i = 0; i < e->num_buffers; i++) {
-        if (strcmp(e->buffers[i]->name, name) == 0) {
-            e->current_buffer = i;
-            editor_set_message(e, "Switched to buffer: %s", name);
+    Buffer *buf = editor_find_buffer(e, name);
+    if (buf) {
+        if (buffer_unpack(buf) != 0) {
+            editor_set_message(e, "Out of memory unpacking %s", name);
             return;
         }
+        e->current_buffer = buf->index;
+        editor_set_message(e, "Switched to buffer: %s", name);
+        return;
     }
     /* Create new buffer */
-    Buffer *buf = editor_new_buffer(e, name);
+    buf = editor_new_buffer(e, name);
     if (buf) {
-        e->current_buffer = e->num_buffers - 1;
+        e->current_buffer = buf->index;
         editor_set_message(e, "Created new buffer: %s", name);
     }
 }
 
+/*
+ * A buffer's idle time starts over whenever a call finds it current or
+ * edited since the last call, so the main loop's idle ticks keep it.
+ */
+int editor_pack_buffers(Editor *e, double idle_ms, int max) {
+    double now = editor_elapsed_ms(e);
+    int packed = 0;
+    for (int i = 0; i < e->num_buffers; i++) {
+        Buffer *b = e->buffers[i];
+        if (i == e->current_buffer || b->edit_seq != b->idle_seq) {
+            b->idle_seq = b->edit_seq;
+            b->idle_since_ms = now;
+            if (i == e->current_buffer) continue;
+        }
+        if (packed == max || b->packed || b->is_shell || b->follow || b->batch_depth ||
+            b->text_bytes < PACK_MIN_BYTES || now - b->idle_since_ms < idle_ms)
+            continue;
+        if (buffer_pack(b) == 0) packed++;
+        else b->idle_since_ms = now;    /* does not pay; not again for a while */
+    }
+    return packed;
+}
+
 void editor_set_message(Editor *e, const char *fmt, ...) {
+    if (e->kmacro_replaying) return;
     va_list ap;
     va_start(ap, fmt);
     vsnprintf(e->message, sizeof(e->message), fmt, ap);
@@ -109,15 +361,24 @@ void editor_set_message(Editor *e, const char *fmt, ...) {
 void editor_open_file(Editor *e, const char *filename) {
     if (!filename || !*filename) return;
 
-    /* Check if buffer for this file already open */
-    for (int i = 0; i < e->num_buffers; i++) {
-        if (e->buffers[i]->filename &&
-            strcmp(e->buffers[i]->filename, filename) == 0) {
-            e->current_buffer = i;
-            editor_set_message(e, "Switched to existing buffer for %s", filename);
-            return;
+    /* Check if buffer for this file already open: by inode for files on
+     * disk, so "./a.c" and "a.c" are the same; by name for new files. */
+    Buffer *existing = NULL;
+    struct stat st;
+    if (stat(filename, &st) == 0) {
+        existing = editor_find_file_buffer(e, st.st_dev, st.st_ino);
+    } else {
+        for (int i = 0; i < e->num_buffers && !existing; i++) {
+            if (e->buffers[i]->filename &&
+                strcmp(e->buffers[i]->filename, filename) == 0)
+                existing = e->buffers[i];
         }
     }
+    if (existing) {
+        e->current_buffer = existing->index;
+        editor_set_message(e, "Switched to existing buffer for %s", filename);
+        return;
+    }
 
     /* Create new buffer */
     const char *bname = strrchr(filename, '/');
@@ -125,18 +386,20 @@ void editor_open_file(Editor *e, const char *filename) {
 
     Buffer *buf = editor_new_buffer(e, bname);
     if (!buf) {
-        editor_set_message(e, "Too many buffers open");
+        editor_set_message(e, "Out of memory opening %s", filename);
         return;
     }
+    e->current_buffer = buf->index;
     if (buffer_load_file(buf, filename) == 0) {
-        e->current_buffer = e->num_buffers - 1;
+        editor_update_file_id(e, buf);
         editor_set_message(e, "Opened %s", filename);
     } else {
         /* New file */
         buf->filename = strdup(filename);
-        e->current_buffer = e->num_buffers - 1;
         editor_set_message(e, "New file: %s", filename);
     }
+    syntax_attach(buf, NULL);
+    file_watch_add(e, buf);
 }
 
 void editor_save_current(Editor *e) {
@@ -151,6 +414,7 @@ void editor_save_current(Editor *e) {
         return;
     }
     if (buffer_save_file(buf) == 0) {
+        editor_update_file_id(e, buf);
         editor_set_message(e, "Wrote %s", buf->filename);
     } else {
         editor_set_message(e, "Error saving %s", buf->filename);
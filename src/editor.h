@@ -4,15 +4,28 @@
 #include <ncurses.h>
 #include <duktape.h>
 #include "buffer.h"
-
-#define MAX_BUFFERS 32
+#include <time.h>
 
 typedef struct Editor Editor;
 
+/* What a command did, so the next one can build on it */
+#define CMD_KILL 1          /* killed text: a following kill appends */
+#define CMD_YANK 2          /* yanked text: M-y may replace it */
+
+/* Open-addressing hash set of buffers (power-of-two capacity). */
+typedef struct BufferTable {
+    Buffer **slots;
+    size_t cap;
+    size_t count;
+} BufferTable;
+
 struct Editor {
-    Buffer *buffers[MAX_BUFFERS];
+    Buffer **buffers;       /* unordered; Buffer.index is the position */
     int num_buffers;
+    int buffers_cap;
     int current_buffer;
+    BufferTable by_name;    /* keyed by Buffer.name */
+    BufferTable by_file;    /* keyed by (indexed_dev, indexed_ino) */
     int running;
 
     WINDOW *edit_win;
@@ -21,10 +34,27 @@ struct Editor {
     int edit_height;
     int edit_width;
 
-    char *kill_ring;
+    KillRing kill_ring;
+    int cmd_flags;          /* CMD_* set by the command running now */
+    int last_cmd_flags;     /* ... and by the one before it */
+    Buffer *yank_buf;       /* where the last yank started, for M-y */
+    int yank_line;
+    int yank_col;
+
+    struct Keymap *pending_keymap;  /* prefix map awaiting its next key */
+    char pending_keys[64];          /* the prefix typed so far, e.g. "C-x " */
 
-    int pending_ctrl_x;
-    int pending_meta;
+    int *input;             /* keys read ahead while looking for C-g */
+    int input_head;         /* next key to hand out */
+    int input_len;
+    int input_cap;
+
+    int *kmacro;            /* last keyboard macro (C-x ( ... C-x )) */
+    int kmacro_len;
+    int kmacro_cap;
+    int kmacro_seq_start;   /* kmacro_len when the current key sequence began */
+    int kmacro_recording;
+    int kmacro_replaying;   /* nesting depth; messages are suppressed */
 
     char minibuf_input[512];
     int minibuf_len;
@@ -32,7 +62,17 @@ struct Editor {
     int minibuf_active;
     void (*minibuf_done_cb)(Editor *, const char *);
 
-    duk_context *js_ctx;
+    duk_context *js_ctx;    /* created on first use: editor_script_ctx() */
+    int js_init_tried;
+    long js_time_limit_ms;  /* per-eval budget, 0 = unlimited */
+
+    struct timespec start_time;
+    double first_frame_ms;  /* startup to first drawn frame */
+    double js_ready_ms;     /* startup to scripting heap ready */
+
+    int watch_fd;           /* inotify fd for visited files, -1 if none */
+    int auto_revert;        /* re-read unmodified buffers changed on disk */
+    int pack_delay_secs;    /* pack buffers idle this long, 0 = never */
 
     int show_help;
 
@@ -41,14 +81,25 @@ struct Editor {
 
 Editor *editor_create(void);
 void editor_destroy(Editor *e);
+/* The current buffer, unpacked; NULL if there is none or it cannot be */
 Buffer *editor_current_buffer(Editor *e);
+/* Lookups only: a buffer found may be packed, see buffer_unpack() */
 Buffer *editor_find_buffer(Editor *e, const char *name);
+Buffer *editor_find_file_buffer(Editor *e, dev_t dev, ino_t ino);
+void editor_update_file_id(Editor *e, Buffer *buf);
 Buffer *editor_new_buffer(Editor *e, const char *name);
 void editor_kill_buffer(Editor *e, int idx);
 void editor_switch_to_buffer(Editor *e, const char *name);
+/* Pack up to `max` buffers that have been neither current nor edited for
+ * `idle_ms` (shells, followed files and small buffers are never packed).
+ * Returns the number packed. */
+int editor_pack_buffers(Editor *e, double idle_ms, int max);
 void editor_set_message(Editor *e, const char *fmt, ...);
 void editor_open_file(Editor *e, const char *filename);
 void editor_save_current(Editor *e);
+void editor_load_script(Editor *e, const char *path);
+duk_context *editor_script_ctx(Editor *e);
+double editor_elapsed_ms(Editor *e);
 void editor_start_minibuf(Editor *e, const char *prompt,
                           void (*done_cb)(Editor *, const char *));
 
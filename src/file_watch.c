@@ -0,0 +1,207 @@
+#include "file_watch.h"
+#include "editor.h"
+#include "buffer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                     IN_MOVE_SELF | IN_DELETE_SELF)
+#define FOLLOW_CHUNK 65536
+#define EVENT_BUF_SIZE 4096
+
+int file_watch_init(Editor *e) {
+    e->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return e->watch_fd >= 0 ? 0 : -1;
+}
+
+void file_watch_shutdown(Editor *e) {
+    if (e->watch_fd >= 0) close(e->watch_fd);
+    e->watch_fd = -1;
+}
+
+static void watch_arm(Editor *e, Buffer *buf) {
+    if (e->watch_fd < 0 || buf->watch_wd >= 0) return;
+    buf->watch_wd = inotify_add_watch(e->watch_fd, buf->filename, WATCH_MASK);
+}
+
+static void watch_disarm(Editor *e, Buffer *buf) {
+    if (e->watch_fd >= 0 && buf->watch_wd >= 0)
+        inotify_rm_watch(e->watch_fd, buf->watch_wd);
+    buf->watch_wd = -1;
+}
+
+/*
+ * Append bytes [from, to) of the open file to the buffer.  A newline that
+ * ended the previously read data only becomes a line break once more text
+ * follows it, so the buffer never grows a spurious empty last line.
+ */
+static void follow_append(Buffer *buf, int fd, off_t from, off_t to) {
+    char *chunk = malloc(FOLLOW_CHUNK);
+    if (!chunk) return;
+
+    off_t pos = from;
+    while (pos < to) {
+        size_t want = (size_t)(to - pos) < FOLLOW_CHUNK ?
+                      (size_t)(to - pos) : FOLLOW_CHUNK;
+        ssize_t n = pread(fd, chunk, want, pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        if (buf->eof_newline && buf->file_size > 0)
+            buffer_append_text(buf, "\n", 1);
+        size_t len = (size_t)n;
+        buf->eof_newline = chunk[len - 1] == '\n';
+        if (buf->eof_newline) len--;
+        buffer_append_text(buf, chunk, len);
+
+        pos += n;
+        buf->file_size = pos;
+    }
+    free(chunk);
+}
+
+/* Read the file from the start again, beginning on a fresh line. */
+static void follow_restart(Buffer *buf) {
+    buf->file_size   = 0;
+    buf->eof_newline = 1;
+    if (buf->lines[buf->num_lines - 1][0])
+        buffer_append_text(buf, "\n", 1);
+}
+
+/* Bring a followed buffer up to date with the file on disk. */
+static void follow_update(Editor *e, Buffer *buf) {
+    int fd = open(buf->filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;   /* rotated away; file_watch_tick re-arms */
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return; }
+    int at_end       = buf->cursor_line >= buf->num_lines - 1;
+    int was_modified = buf->modified;
+
+    if (st.st_dev != buf->file_dev || st.st_ino != buf->file_ino) {
+        /* Log rotation: keep what we have, continue with the new file */
+        buf->file_dev = st.st_dev;
+        buf->file_ino = st.st_ino;
+        editor_update_file_id(e, buf);
+        follow_restart(buf);
+        editor_set_message(e, "%s: file replaced, following new file",
+                           buf->name);
+    } else if (st.st_size < buf->file_size) {
+        follow_restart(buf);
+        editor_set_message(e, "%s: file truncated", buf->name);
+    }
+
+    if (st.st_size > buf->file_size)
+        follow_append(buf, fd, buf->file_size, st.st_size);
+    buf->modified = was_modified;
+    if (at_end) buffer_scroll_to_end(buf);
+    close(fd);
+}
+
+/*
+ * Auto-revert: if the file no longer matches what the buffer was loaded
+ * from, re-read it and apply the differing lines.  Unsaved edits are never
+ * overwritten.
+ */
+static void revert_update(Editor *e, Buffer *buf) {
+    struct stat st;
+    if (stat(buf->filename, &st) != 0) return;
+    if (st.st_dev == buf->file_dev && st.st_ino == buf->file_ino &&
+        st.st_size == buf->file_size &&
+        st.st_mtim.tv_sec  == buf->file_mtime.tv_sec &&
+        st.st_mtim.tv_nsec == buf->file_mtime.tv_nsec)
+        return;
+    if (!e->auto_revert) return;
+    if (buf->modified) {
+        editor_set_message(e, "%s changed on disk; buffer has unsaved changes",
+                           buf->name);
+        return;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int hunks = buffer_revert_file(buf);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    editor_update_file_id(e, buf);
+    if (hunks < 0) {
+        editor_set_message(e, "Error reverting %s", buf->filename);
+    } else if (hunks > 0) {
+        double ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 +
+                    (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+        editor_set_message(e, "Reverted %s (%d hunk%s, %.1f ms)", buf->name,
+                           hunks, hunks == 1 ? "" : "s", ms);
+    }
+}
+
+/* Watch `buf`'s file for changes on disk. */
+int file_watch_add(Editor *e, Buffer *buf) {
+    if (!buf->filename || buf->is_shell) return -1;
+    if (e->watch_fd < 0 && file_watch_init(e) != 0) return -1;
+    watch_arm(e, buf);
+    return buf->watch_wd >= 0 ? 0 : -1;
+}
+
+void file_watch_remove(Editor *e, Buffer *buf) {
+    watch_disarm(e, buf);
+    buf->follow = 0;
+}
+
+/* Start following `buf`'s file: pick up anything written since loading. */
+int file_watch_follow(Editor *e, Buffer *buf) {
+    if (file_watch_add(e, buf) != 0) return -1;
+    buf->follow = 1;
+    follow_update(e, buf);
+    buffer_scroll_to_end(buf);
+    return 0;
+}
+
+void file_watch_unfollow(Editor *e, Buffer *buf) {
+    (void)e;
+    buf->follow = 0;
+}
+
+/* Drain pending inotify events and update the buffers they refer to. */
+void file_watch_process(Editor *e) {
+    if (e->watch_fd < 0) return;
+    char events[EVENT_BUF_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while ((n = read(e->watch_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            for (int i = 0; i < e->num_buffers; i++) {
+                Buffer *buf = e->buffers[i];
+                if (buf->watch_wd != ev->wd) continue;
+                /* The watched inode left this path; file_watch_tick re-arms */
+                if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))
+                    watch_disarm(e, buf);
+                if (buf->follow)
+                    follow_update(e, buf);
+                else if (ev->mask != IN_MODIFY)   /* wait for the writer */
+                    revert_update(e, buf);
+            }
+        }
+    }
+}
+
+/* Re-arm watches lost to rotation or atomic saves once the path exists. */
+void file_watch_tick(Editor *e) {
+    if (e->watch_fd < 0) return;
+    for (int i = 0; i < e->num_buffers; i++) {
+        Buffer *buf = e->buffers[i];
+        if (!buf->filename || buf->is_shell || buf->watch_wd >= 0) continue;
+        watch_arm(e, buf);
+        if (buf->watch_wd < 0) continue;
+        if (buf->follow) follow_update(e, buf);
+        else revert_update(e, buf);
+    }
+}
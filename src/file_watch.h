@@ -0,0 +1,16 @@
+#ifndef FILE_WATCH_H
+#define FILE_WATCH_H
+
+#include "editor.h"
+#include "buffer.h"
+
+int  file_watch_init(Editor *e);
+void file_watch_shutdown(Editor *e);
+int  file_watch_add(Editor *e, Buffer *buf);
+void file_watch_remove(Editor *e, Buffer *buf);
+int  file_watch_follow(Editor *e, Buffer *buf);
+void file_watch_unfollow(Editor *e, Buffer *buf);
+void file_watch_process(Editor *e);
+void file_watch_tick(Editor *e);
+
+#endif /* FILE_WATCH_H */
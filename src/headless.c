@@ -0,0 +1,203 @@
+#include "headless.h"
+#include "ui.h"
+#include "keys.h"
+#include "script.h"
+#include "syntax.h"
+#include "worker.h"
+#include "lex_worker.h"
+#include "stats.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KEYLOG_LINE_SIZE 256
+
+void keylog_write(FILE *f, double ms, int key) {
+    char name[32];
+    keys_describe(key, name, sizeof(name));
+    fprintf(f, "%.1f %s\n", ms, name);
+    fflush(f);
+}
+
+typedef struct KeyEvent {
+    double ms;
+    int key;
+} KeyEvent;
+
+/* Read a key log; returns the event count or -1. */
+static int keylog_read(const char *path, KeyEvent **out) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    KeyEvent *ev = NULL;
+    int n = 0, cap = 0, lineno = 0;
+    char line[KEYLOG_LINE_SIZE];
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || !*p) continue;
+        char *rest;
+        double ms = strtod(p, &rest);
+        int keys[KEYLOG_LINE_SIZE / 2];
+        int nk = rest == p ? -1 : keys_parse(rest, keys, KEYLOG_LINE_SIZE / 2);
+        if (nk <= 0) {
+            fprintf(stderr, "%s:%d: bad key log line\n", path, lineno);
+            free(ev);
+            fclose(f);
+            return -1;
+        }
+        for (int i = 0; i < nk; i++) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 256;
+                KeyEvent *grown = realloc(ev, sizeof(KeyEvent) * cap);
+                if (!grown) {
+                    free(ev);
+                    fclose(f);
+                    return -1;
+                }
+                ev = grown;
+            }
+            ev[n++] = (KeyEvent){ ms, keys[i] };
+        }
+    }
+    fclose(f);
+    *out = ev;
+    return n;
+}
+
+/*
+ * The off-screen terminal is a scratch file: ncurses write()s to its fd,
+ * so the offset counts the bytes, and truncating keeps it small.
+ */
+static unsigned long long s_term_bytes;
+
+static void count_output(FILE *out) {
+    int fd = fileno(out);
+    off_t n = lseek(fd, 0, SEEK_CUR);
+    if (n > 0) {
+        s_term_bytes += (unsigned long long)n;
+        if (ftruncate(fd, 0) == 0) lseek(fd, 0, SEEK_SET);
+    }
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted v[0..n) */
+static double percentile(const double *v, int n, double p) {
+    if (n == 0) return 0;
+    int i = (int)(p / 100.0 * n + 0.5) - 1;
+    if (i < 0) i = 0;
+    if (i >= n) i = n - 1;
+    return v[i];
+}
+
+int headless_run(Editor *e, const HeadlessOptions *opt) {
+    KeyEvent *ev = NULL;
+    int nev = keylog_read(opt->replay, &ev);
+    if (nev < 0) {
+        fprintf(stderr, "Cannot read key log %s\n", opt->replay);
+        return 1;
+    }
+    double *lat = malloc(sizeof(double) * (nev ? nev : 1));
+    if (!lat) {
+        free(ev);
+        return 1;
+    }
+
+    FILE *out = tmpfile();
+    FILE *in = fopen("/dev/null", "r");
+    /* With no terminal to ask, ncurses takes the size from the environment */
+    char num[16];
+    snprintf(num, sizeof(num), "%d", opt->rows);
+    setenv("LINES", num, 1);
+    snprintf(num, sizeof(num), "%d", opt->cols);
+    setenv("COLUMNS", num, 1);
+    const char *term = getenv("TERM");
+    if (!out || !in ||
+        (ui_init_term(e, term && *term ? term : "xterm", out, in) != 0 &&
+         ui_init_term(e, "xterm", out, in) != 0)) {
+        fprintf(stderr, "Cannot set up the headless terminal\n");
+        if (out) fclose(out);
+        if (in) fclose(in);
+        free(lat);
+        free(ev);
+        return 1;
+    }
+
+    /* First frame and scripting, as the main loop does before any key */
+    ui_refresh(e);
+    count_output(out);
+    unsigned long long first_frame_bytes = s_term_bytes;
+    if (!e->js_ctx) editor_script_ctx(e);
+
+    unsigned long long max_bytes = 0;
+    int done = 0;
+    double start = now_us();
+    for (; done < nev && e->running; done++) {
+        if (opt->realtime) {
+            /* Keep the recorded pacing, so background work between keys
+             * happens as it did */
+            double wait = (ev[done].ms - ev[0].ms) * 1e3 - (now_us() - start);
+            if (wait > 0) {
+                struct timespec ts = { (time_t)(wait / 1e6), (long)((long long)wait % 1000000) * 1000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+        /* What ui_get_key() would have picked up while waiting */
+        if (worker_pending()) script_worker_results(e);
+        if (lex_worker_pending()) syntax_bg_results(e->buffers, e->num_buffers);
+        unsigned long long before = s_term_bytes;
+        double t0 = now_us();
+        TRACE_BEGIN("handle_key");
+        handle_key(e, ev[done].key);
+        TRACE_END_N("handle_key", ev[done].key);
+        stats_record(STAT_KEY, (long)((now_us() - t0) * 1e3));
+        ui_refresh(e);
+        lat[done] = now_us() - t0;
+        count_output(out);
+        if (s_term_bytes - before > max_bytes) max_bytes = s_term_bytes - before;
+    }
+    double elapsed = now_us() - start;
+
+    ui_cleanup();
+    fclose(out);
+    fclose(in);
+
+    unsigned long long key_bytes = s_term_bytes - first_frame_bytes;
+    double sum = 0;
+    for (int i = 0; i < done; i++) sum += lat[i];
+    qsort(lat, (size_t)done, sizeof(double), cmp_double);
+    double mean = done ? sum / done : 0;
+    double p50 = percentile(lat, done, 50), p90 = percentile(lat, done, 90);
+    double p99 = percentile(lat, done, 99), max = done ? lat[done - 1] : 0;
+
+    if (opt->json) {
+        printf("{\"keys\": %d, \"elapsed_ms\": %.1f, \"latency_us\": {\"mean\": %.1f, "
+               "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}, "
+               "\"terminal_bytes\": {\"first_frame\": %llu, \"keys\": %llu, "
+               "\"per_key\": %.1f, \"max_key\": %llu}}\n",
+               done, elapsed / 1e3, mean, p50, p90, p99, max,
+               first_frame_bytes, key_bytes, done ? (double)key_bytes / done : 0, max_bytes);
+    } else {
+        printf("keys replayed:  %d of %d in %.1f ms (%dx%d, %s)\n", done, nev, elapsed / 1e3,
+               opt->cols, opt->rows, opt->realtime ? "recorded pacing" : "back to back");
+        printf("latency (us):   mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+               mean, p50, p90, p99, max);
+        printf("terminal bytes: %llu first frame, %llu for keys (%.1f per key, max %llu)\n",
+               first_frame_bytes, key_bytes, done ? (double)key_bytes / done : 0, max_bytes);
+    }
+    free(lat);
+    free(ev);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include "editor.h"
+#include <stdio.h>
+
+/*
+ * Key logs: one line per read key, "<ms> <key>", the time in ms since
+ * startup and the key in keys_parse() syntax ("C-x", "ESC", "<up>").
+ * Lines starting with '#' are comments.
+ */
+void keylog_write(FILE *f, double ms, int key);
+
+typedef struct HeadlessOptions {
+    const char *replay;     /* key log to feed */
+    int cols, rows;         /* screen size */
+    int realtime;           /* wait for each key's timestamp */
+    int json;               /* report as JSON */
+} HeadlessOptions;
+
+/*
+ * Run the editor against an off-screen terminal: replay a key log
+ * through handle_key() and a full redraw per key, then print per-key
+ * latency percentiles and the bytes that would have gone to the
+ * terminal to stdout.  Returns the process exit status.
+ */
+int headless_run(Editor *e, const HeadlessOptions *opt);
+
+#endif /* HEADLESS_H */
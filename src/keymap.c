@@ -0,0 +1,182 @@
+#include "keymap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define INITIAL_KEYMAP_CAP 16
+#define INITIAL_COMMAND_CAP 64
+
+/* Command registry: open-addressing hash on the name, never shrinks. */
+static Command **s_commands;
+static size_t s_commands_cap;
+static size_t s_commands_count;
+
+static Keymap *s_keymaps;
+
+static uint64_t hash_str(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t command_slot(Command **slots, size_t cap, const char *name) {
+    size_t i = (size_t)hash_str(name) & (cap - 1);
+    while (slots[i] && strcmp(slots[i]->name, name) != 0)
+        i = (i + 1) & (cap - 1);
+    return i;
+}
+
+Command *command_find(const char *name) {
+    if (!s_commands) return NULL;
+    return s_commands[command_slot(s_commands, s_commands_cap, name)];
+}
+
+/* Find or add the command `name`; redefining keeps existing bindings. */
+static Command *command_intern(const char *name) {
+    Command *cmd = command_find(name);
+    if (cmd) return cmd;
+
+    if ((s_commands_count + 1) * 2 > s_commands_cap) {
+        size_t new_cap = s_commands_cap ? s_commands_cap * 2 : INITIAL_COMMAND_CAP;
+        Command **slots = calloc(new_cap, sizeof(Command *));
+        if (!slots) return NULL;
+        for (size_t i = 0; i < s_commands_cap; i++)
+            if (s_commands[i])
+                slots[command_slot(slots, new_cap, s_commands[i]->name)] = s_commands[i];
+        free(s_commands);
+        s_commands = slots;
+        s_commands_cap = new_cap;
+    }
+    cmd = calloc(1, sizeof(Command));
+    if (!cmd) return NULL;
+    cmd->name = strdup(name);
+    if (!cmd->name) { free(cmd); return NULL; }
+    cmd->js_id = -1;
+    s_commands[command_slot(s_commands, s_commands_cap, name)] = cmd;
+    s_commands_count++;
+    return cmd;
+}
+
+Command *command_define(const char *name, CommandFn fn) {
+    Command *cmd = command_intern(name);
+    if (cmd) {
+        cmd->fn = fn;
+        cmd->js_id = -1;
+    }
+    return cmd;
+}
+
+Command *command_define_js(const char *name, int js_id) {
+    Command *cmd = command_intern(name);
+    if (cmd) {
+        cmd->fn = NULL;
+        cmd->js_id = js_id;
+    }
+    return cmd;
+}
+
+Keymap *keymap_new(const char *name) {
+    Keymap *map = calloc(1, sizeof(Keymap));
+    if (!map) return NULL;
+    map->name = name ? strdup(name) : NULL;
+    map->next = s_keymaps;
+    s_keymaps = map;
+    return map;
+}
+
+Keymap *keymap_find(const char *name) {
+    for (Keymap *m = s_keymaps; m; m = m->next)
+        if (m->name && strcmp(m->name, name) == 0) return m;
+    return NULL;
+}
+
+static size_t key_slot(const KeyBinding *slots, size_t cap, int key) {
+    size_t i = ((uint32_t)key * 2654435761U) & (cap - 1);
+    while (slots[i].key != KEYMAP_EMPTY && slots[i].key != key)
+        i = (i + 1) & (cap - 1);
+    return i;
+}
+
+KeyBinding *keymap_lookup(const Keymap *map, int key) {
+    if (!map || !map->slots) return NULL;
+    KeyBinding *kb = &map->slots[key_slot(map->slots, map->cap, key)];
+    return kb->key == key ? kb : NULL;
+}
+
+/* Find or add the slot for `key`. */
+static KeyBinding *keymap_slot(Keymap *map, int key) {
+    KeyBinding *kb = keymap_lookup(map, key);
+    if (kb) return kb;
+
+    if ((map->count + 1) * 2 > map->cap) {
+        size_t new_cap = map->cap ? map->cap * 2 : INITIAL_KEYMAP_CAP;
+        KeyBinding *slots = malloc(sizeof(KeyBinding) * new_cap);
+        if (!slots) return NULL;
+        for (size_t i = 0; i < new_cap; i++) slots[i].key = KEYMAP_EMPTY;
+        for (size_t i = 0; i < map->cap; i++)
+            if (map->slots[i].key != KEYMAP_EMPTY)
+                slots[key_slot(slots, new_cap, map->slots[i].key)] = map->slots[i];
+        free(map->slots);
+        map->slots = slots;
+        map->cap = new_cap;
+    }
+    kb = &map->slots[key_slot(map->slots, map->cap, key)];
+    kb->key = key;
+    kb->cmd = NULL;
+    kb->prefix = NULL;
+    map->count++;
+    return kb;
+}
+
+int keymap_bind_prefix(Keymap *map, int key, Keymap *prefix) {
+    KeyBinding *kb = keymap_slot(map, key);
+    if (!kb) return -1;
+    kb->cmd = NULL;
+    kb->prefix = prefix;
+    return 0;
+}
+
+/*
+ * Bind the sequence keys[0..n) to `cmd`, creating prefix maps on the way.
+ * A key bound to a command where a prefix is needed becomes a prefix.
+ */
+int keymap_bind(Keymap *map, const int *keys, int n, Command *cmd) {
+    if (n < 1) return -1;
+    for (int i = 0; i < n - 1; i++) {
+        KeyBinding *kb = keymap_slot(map, keys[i]);
+        if (!kb) return -1;
+        if (!kb->prefix) {
+            Keymap *sub = keymap_new(NULL);
+            if (!sub) return -1;
+            kb->cmd = NULL;
+            kb->prefix = sub;
+        }
+        map = kb->prefix;
+    }
+    KeyBinding *kb = keymap_slot(map, keys[n - 1]);
+    if (!kb) return -1;
+    kb->cmd = cmd;
+    kb->prefix = NULL;
+    return 0;
+}
+
+void keymap_free_all(void) {
+    while (s_keymaps) {
+        Keymap *m = s_keymaps;
+        s_keymaps = m->next;
+        free(m->name);
+        free(m->slots);
+        free(m);
+    }
+    for (size_t i = 0; i < s_commands_cap; i++) {
+        if (!s_commands[i]) continue;
+        free(s_commands[i]->name);
+        free(s_commands[i]);
+    }
+    free(s_commands);
+    s_commands = NULL;
+    s_commands_cap = s_commands_count = 0;
+}
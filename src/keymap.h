@@ -0,0 +1,48 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include "editor.h"
+
+/* A command runs with the M-x argument (text after the name), or NULL. */
+typedef void (*CommandFn)(Editor *e, const char *arg);
+
+typedef struct Command {
+    char *name;
+    CommandFn fn;           /* built-in command, or NULL when ... */
+    int js_id;              /* ... it is a JS function (stash "commands") */
+} Command;
+
+typedef struct Keymap Keymap;
+
+typedef struct KeyBinding {
+    int key;                /* KEYMAP_EMPTY marks a free slot */
+    Command *cmd;           /* bound command, or */
+    Keymap *prefix;         /* keymap consulted for the next key */
+} KeyBinding;
+
+/*
+ * Keymaps form a prefix trie: each level is an open-addressing hash of
+ * keys, so dispatching a key is one lookup whatever the map size.
+ */
+struct Keymap {
+    char *name;
+    KeyBinding *slots;
+    size_t cap;
+    size_t count;
+    Keymap *next;           /* registry of named keymaps */
+};
+
+#define KEYMAP_EMPTY (-1)
+
+Command *command_define(const char *name, CommandFn fn);
+Command *command_define_js(const char *name, int js_id);
+Command *command_find(const char *name);
+
+Keymap *keymap_new(const char *name);
+Keymap *keymap_find(const char *name);
+KeyBinding *keymap_lookup(const Keymap *map, int key);
+int keymap_bind(Keymap *map, const int *keys, int n, Command *cmd);
+int keymap_bind_prefix(Keymap *map, int key, Keymap *prefix);
+void keymap_free_all(void);
+
+#endif /* KEYMAP_H */
@@ -4,14 +4,202 @@
 #include "ui.h"
 #include "shell_buf.h"
 #include "script.h"
+#include "file_watch.h"
+#include "keymap.h"
+#include "wrap.h"
+#include "syntax.h"
+#include "stats.h"
+#include "trace.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <time.h>
 
 /* Escape-sequence raw buffer: up to 3 bytes + null terminator */
 #define RAW_KEY_BUF_SIZE 4
 
+/*
+ * Key names, as in Emacs' kbd syntax: "C-x C-s", "M-x", "RET", "<up>".
+ * Used by keyboard macro export and editor.sendKeys().
+ */
+static const struct { const char *name; int key; } s_key_names[] = {
+    { "C-SPC", 0 },           { "TAB", '\t' },           { "RET", '\n' },
+    { "ESC", 27 },            { "SPC", ' ' },            { "DEL", 127 },
+    { "<up>", KEY_UP },       { "<down>", KEY_DOWN },
+    { "<left>", KEY_LEFT },   { "<right>", KEY_RIGHT },
+    { "<home>", KEY_HOME },   { "<end>", KEY_END },
+    { "<prior>", KEY_PPAGE }, { "<next>", KEY_NPAGE },
+    { "<delete>", KEY_DC },   { "<backspace>", KEY_BACKSPACE },
+    { "<enter>", KEY_ENTER },
+    { NULL, 0 }
+};
+
+void keys_describe(int key, char *out, size_t len) {
+    for (int i = 0; s_key_names[i].name; i++) {
+        if (s_key_names[i].key == key) {
+            snprintf(out, len, "%s", s_key_names[i].name);
+            return;
+        }
+    }
+    if (key > 0 && key < 32)
+        snprintf(out, len, "C-%c", key < 27 ? 'a' + key - 1 : key + 64);
+    else if (key > 32 && key < 127)
+        snprintf(out, len, "%c", key);
+    else if (key >= KEY_F(1) && key <= KEY_F(12))
+        snprintf(out, len, "<f%d>", key - KEY_F0);
+    else
+        snprintf(out, len, "#%d", key);
+}
+
+/* Parse one token (no M- prefix); -1 if it is not a key name. */
+static int parse_key_token(const char *tok) {
+    for (int i = 0; s_key_names[i].name; i++)
+        if (strcmp(tok, s_key_names[i].name) == 0) return s_key_names[i].key;
+    size_t n = strlen(tok);
+    if (n == 1) return (unsigned char)tok[0];
+    if (n == 3 && tok[0] == 'C' && tok[1] == '-') {
+        int c = (unsigned char)tok[2];
+        if (isalpha(c)) return tolower(c) & 0x1f;
+        if (c == '?') return 127;
+        if (strchr("@[\\]^_", c)) return c & 0x1f;
+        return -1;
+    }
+    int f;
+    if (sscanf(tok, "<f%d>", &f) == 1 && f >= 1 && f <= 12) return KEY_F(f);
+    if (tok[0] == '#' && isdigit((unsigned char)tok[1])) return atoi(tok + 1);
+    return -1;
+}
+
+/* Parse a space-separated key sequence; returns the key count or -1. */
+int keys_parse(const char *seq, int *keys, int max) {
+    int n = 0;
+    char tok[32];
+    while (*seq) {
+        while (isspace((unsigned char)*seq)) seq++;
+        if (!*seq) break;
+        size_t len = strcspn(seq, " \t\n");
+        if (len >= sizeof(tok)) return -1;
+        memcpy(tok, seq, len);
+        tok[len] = '\0';
+        seq += len;
+
+        const char *t = tok;
+        if (len > 2 && t[0] == 'M' && t[1] == '-') {
+            if (n >= max) return -1;
+            keys[n++] = 27;
+            t += 2;
+        }
+        int key = parse_key_token(t);
+        if (key < 0 || n >= max) return -1;
+        keys[n++] = key;
+    }
+    return n;
+}
+
+/*
+ * Feed `keys` through handle_key `times` times.  Nothing is drawn while
+ * this runs and messages are suppressed, so a replay costs only the
+ * editing itself.  C-g, or the editor quitting, stops it early.  Returns
+ * the number of complete runs.
+ */
+int keys_execute(Editor *e, const int *keys, int n, int times) {
+    int done = 0;
+    e->kmacro_replaying++;
+    for (; done < times && e->running; done++) {
+        if (ui_interrupt_pending(e)) break;
+        for (int i = 0; i < n; i++) handle_key(e, keys[i]);
+    }
+    e->kmacro_replaying--;
+    return done;
+}
+
+static void kmacro_record(Editor *e, int key) {
+    if (e->kmacro_len == e->kmacro_cap) {
+        int new_cap = e->kmacro_cap ? e->kmacro_cap * 2 : 64;
+        int *tmp = realloc(e->kmacro, sizeof(int) * new_cap);
+        if (!tmp) return;
+        e->kmacro = tmp;
+        e->kmacro_cap = new_cap;
+    }
+    e->kmacro[e->kmacro_len++] = key;
+}
+
+/* Replay the last macro `times` times and report how long it took. */
+static void kmacro_run(Editor *e, int times) {
+    if (e->kmacro_replaying) return;
+    if (e->kmacro_recording) {
+        editor_set_message(e, "Can't execute macro while defining it");
+        return;
+    }
+    if (e->kmacro_len == 0) {
+        editor_set_message(e, "No keyboard macro defined");
+        return;
+    }
+    /* Copy: the replay may record a new macro */
+    int n = e->kmacro_len;
+    int *keys = malloc(sizeof(int) * n);
+    if (!keys) return;
+    memcpy(keys, e->kmacro, sizeof(int) * n);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int done = keys_execute(e, keys, n, times);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(keys);
+    double ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 +
+                (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+    editor_set_message(e, "Executed keyboard macro %d time%s (%d keys, %.1f ms)%s",
+                       done, done == 1 ? "" : "s", n, ms,
+                       done < times ? " -- interrupted" : "");
+}
+
+/* Write the last macro as JavaScript into *kmacro-js*. */
+static void kmacro_to_js(Editor *e) {
+    if (e->kmacro_len == 0) {
+        editor_set_message(e, "No keyboard macro defined");
+        return;
+    }
+    int per_line = 16;
+    int nrows = 1 + (e->kmacro_len + per_line - 1) / per_line;
+    char **rows = malloc(sizeof(char *) * nrows);
+    if (!rows) return;
+    rows[0] = strdup("// Keyboard macro; run with M-x load-js or eval-js");
+    int r = 1, k = 0;
+    while (k < e->kmacro_len) {
+        char line[1024];
+        int n = snprintf(line, sizeof(line), "editor.sendKeys(\"");
+        for (int t = 0; t < per_line && k < e->kmacro_len; t++) {
+            char name[20] = "";
+            /* ESC followed by a key reads better as M-<key> */
+            if (e->kmacro[k] == 27 && k + 1 < e->kmacro_len) {
+                strcpy(name, "M-");
+                k++;
+            }
+            keys_describe(e->kmacro[k++], name + strlen(name), sizeof(name) - strlen(name));
+            if (t > 0) line[n++] = ' ';
+            for (const char *p = name; *p; p++) {
+                if (*p == '"' || *p == '\\') line[n++] = '\\';
+                line[n++] = *p;
+            }
+        }
+        snprintf(line + n, sizeof(line) - n, "\");");
+        rows[r++] = strdup(line);
+    }
+    nrows = r;
+    Buffer *jb = editor_find_buffer(e, "*kmacro-js*");
+    if (!jb) jb = editor_new_buffer(e, "*kmacro-js*");
+    if (jb) {
+        buffer_replace_lines(jb, 0, jb->num_lines, rows, nrows);
+        jb->modified = 0;
+        e->current_buffer = jb->index;
+    } else {
+        while (nrows > 0) free(rows[--nrows]);
+    }
+    free(rows);
+}
+
 /* Forward declarations for minibuf callbacks */
 static void cb_find_file(Editor *e, const char *input);
 static void cb_switch_buffer(Editor *e, const char *input);
@@ -30,12 +218,11 @@ static void cb_switch_buffer(Editor *e, const char *input) {
 }
 
 static void cb_kill_buffer(Editor *e, const char *input) {
-    for (int i = 0; i < e->num_buffers; i++) {
-        if (strcmp(e->buffers[i]->name, input) == 0) {
-            editor_kill_buffer(e, i);
-            editor_set_message(e, "Killed buffer: %s", input);
-            return;
-        }
+    Buffer *buf = editor_find_buffer(e, input);
+    if (buf) {
+        editor_kill_buffer(e, buf->index);
+        editor_set_message(e, "Killed buffer: %s", input);
+        return;
     }
     editor_set_message(e, "No buffer named: %s", input);
 }
@@ -70,76 +257,803 @@ static void cb_find_for_replace(Editor *e, const char *input) {
     editor_start_minibuf(e, "Replace with: ", cb_replace_with);
 }
 
-static void cb_mx_command(Editor *e, const char *input) {
-    Buffer *buf = editor_current_buffer(e);
-    if (strcmp(input, "eval-js") == 0) {
+/* --- commands --- */
+
+/*
+ * Built-in commands.  Each runs on the current buffer, with `arg` holding
+ * the M-x argument text (NULL when run from a key binding).
+ */
+#define CURRENT_BUFFER_OR_RETURN(buf) \
+    Buffer *buf = editor_current_buffer(e); \
+    if (!buf) return
+
+static void cmd_previous_line(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    if (buf->wrap) wrap_move_rows(buf, -1);
+    else buffer_move_cursor(buf, -1, 0);
+}
+
+static void cmd_next_line(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    if (buf->wrap) wrap_move_rows(buf, 1);
+    else buffer_move_cursor(buf, 1, 0);
+}
+
+static void cmd_backward_char(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buffer_backward_char(buf);
+}
+
+static void cmd_forward_char(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buffer_forward_char(buf);
+}
+
+static void cmd_beginning_of_line(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buffer_move_bol(buf);
+}
+
+static void cmd_end_of_line(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buffer_move_eol(buf);
+}
+
+/* With visual line wrap, paging moves view and cursor by screen rows. */
+static void scroll_rows(Buffer *buf, int n) {
+    long top = wrap_vrow(buf, buf->top_line) + buf->top_row + n;
+    long total = wrap_total_rows(buf);
+    if (top >= total) top = total - 1;
+    if (top < 0) top = 0;
+    wrap_locate(buf, top, &buf->top_line, &buf->top_row);
+    wrap_move_rows(buf, n);
+}
+
+static void cmd_scroll_down(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    if (buf->wrap) {
+        scroll_rows(buf, -e->edit_height);
+        return;
+    }
+    buf->cursor_line -= e->edit_height;
+    buf->top_line    -= e->edit_height;
+    if (buf->top_line < 0) buf->top_line = 0;
+    buffer_clamp_cursor(buf);
+}
+
+static void cmd_scroll_up(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    if (buf->wrap) {
+        scroll_rows(buf, e->edit_height);
+        return;
+    }
+    buf->cursor_line += e->edit_height;
+    buf->top_line    += e->edit_height;
+    if (buf->top_line >= buf->num_lines)
+        buf->top_line = buf->num_lines - 1;
+    buffer_clamp_cursor(buf);
+}
+
+static void cmd_forward_word(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    char *line = buf->lines[buf->cursor_line];
+    int len = (int)strlen(line);
+    /* Skip non-word chars then word chars */
+    while (buf->cursor_col < len && line[buf->cursor_col] == ' ')
+        buf->cursor_col++;
+    while (buf->cursor_col < len && line[buf->cursor_col] != ' ')
+        buf->cursor_col++;
+}
+
+static void cmd_backward_word(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    char *line = buf->lines[buf->cursor_line];
+    if (buf->cursor_col > 0) buf->cursor_col--;
+    while (buf->cursor_col > 0 && line[buf->cursor_col] == ' ')
+        buf->cursor_col--;
+    while (buf->cursor_col > 0 && line[buf->cursor_col - 1] != ' ')
+        buf->cursor_col--;
+}
+
+static void cmd_beginning_of_buffer(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buf->cursor_line = 0;
+    buf->cursor_col  = 0;
+    buf->top_line    = 0;
+}
+
+static void cmd_end_of_buffer(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buf->cursor_line = buf->num_lines - 1;
+    buf->cursor_col  = (int)strlen(buf->lines[buf->cursor_line]);
+}
+
+static void cmd_delete_backward_char(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buffer_delete_char(buf);
+}
+
+static void cmd_delete_char(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buffer_delete_forward(buf);
+}
+
+static void cmd_kill_word(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    char *line = buf->lines[buf->cursor_line];
+    int len = (int)strlen(line);
+    int start = buf->cursor_col;
+    while (buf->cursor_col < len && line[buf->cursor_col] == ' ')
+        buf->cursor_col++;
+    while (buf->cursor_col < len && line[buf->cursor_col] != ' ')
+        buf->cursor_col++;
+    if (buf->cursor_col == start) return;
+    char *dst = kill_ring_reserve(&e->kill_ring, (size_t)(buf->cursor_col - start),
+                                  e->last_cmd_flags & CMD_KILL);
+    if (dst) memcpy(dst, line + start, (size_t)(buf->cursor_col - start));
+    e->cmd_flags |= CMD_KILL;
+    /* Delete from start to cursor_col */
+    buffer_lines_will_change(buf, buf->cursor_line, 1);
+    memmove(line + start, line + buf->cursor_col, len - buf->cursor_col + 1);
+    buf->cursor_col = start;
+    buffer_lines_changed(buf, buf->cursor_line, 1, 1);
+}
+
+static void cmd_kill_line(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buffer_kill_line(buf, &e->kill_ring, e->last_cmd_flags & CMD_KILL);
+    e->cmd_flags |= CMD_KILL;
+}
+
+static void cmd_yank(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    KillEntry *k = kill_ring_current(&e->kill_ring);
+    if (!k) {
+        editor_set_message(e, "Kill ring is empty");
+        return;
+    }
+    buffer_clamp_cursor(buf);
+    e->yank_buf  = buf;
+    e->yank_line = buf->cursor_line;
+    e->yank_col  = buf->cursor_col;
+    buffer_yank(buf, k);
+    e->cmd_flags |= CMD_YANK;
+}
+
+/* M-y: replace the text just yanked with the next older kill */
+static void cmd_yank_pop(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    if (!(e->last_cmd_flags & CMD_YANK) || e->yank_buf != buf) {
+        editor_set_message(e, "Previous command was not a yank");
+        return;
+    }
+    KillEntry *k = kill_ring_rotate(&e->kill_ring);
+    buffer_delete_range(buf, e->yank_line, e->yank_col, buf->cursor_line, buf->cursor_col);
+    buffer_yank(buf, k);
+    e->cmd_flags |= CMD_YANK;
+    editor_set_message(e, "Kill %d of %d", e->kill_ring.yank + 1, e->kill_ring.count);
+}
+
+static void cmd_kill_region(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    if (buf->mark_active) {
+        buffer_kill_region(buf, &e->kill_ring, e->last_cmd_flags & CMD_KILL);
+        e->cmd_flags |= CMD_KILL;
+        editor_set_message(e, "Killed region");
+    } else {
+        editor_set_message(e, "No mark set");
+    }
+}
+
+static void cmd_copy_region(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    if (buf->mark_active) {
+        buffer_copy_region(buf, &e->kill_ring, e->last_cmd_flags & CMD_KILL);
+        e->cmd_flags |= CMD_KILL;
+        editor_set_message(e, "Region copied");
+    } else {
+        editor_set_message(e, "No mark set");
+    }
+}
+
+static void cmd_set_mark(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buffer_set_mark(buf);
+    editor_set_message(e, "Mark set");
+}
+
+static void cmd_insert_tab(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buffer_insert_char(buf, '\t');
+}
+
+static void cmd_newline(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    buffer_insert_char(buf, '\n');
+}
+
+static void cmd_find(Editor *e, const char *arg) {
+    (void)arg;
+    editor_start_minibuf(e, "Find: ", cb_find);
+}
+
+static void cmd_replace(Editor *e, const char *arg) {
+    (void)arg;
+    editor_start_minibuf(e, "Find: ", cb_find_for_replace);
+}
+
+static void cmd_keyboard_quit(Editor *e, const char *arg) {
+    (void)arg;
+    editor_set_message(e, "Quit");
+}
+
+static void cmd_redraw(Editor *e, const char *arg) {
+    (void)arg;
+    clearok(e->edit_win, TRUE);
+    editor_set_message(e, "");
+}
+
+static void cmd_toggle_help(Editor *e, const char *arg) {
+    (void)arg;
+    e->show_help = !e->show_help;
+}
+
+static void cmd_execute_extended_command(Editor *e, const char *arg) {
+    (void)arg;
+    editor_start_minibuf(e, "M-x ", cb_mx_command);
+}
+
+static void cmd_save_buffer(Editor *e, const char *arg) {
+    (void)arg;
+    editor_save_current(e);
+}
+
+static void cmd_find_file(Editor *e, const char *arg) {
+    if (arg) editor_open_file(e, arg);
+    else editor_start_minibuf(e, "Find file: ", cb_find_file);
+}
+
+static void cmd_quit(Editor *e, const char *arg) {
+    (void)arg;
+    e->running = 0;
+}
+
+static void cmd_switch_buffer(Editor *e, const char *arg) {
+    if (arg) editor_switch_to_buffer(e, arg);
+    else editor_start_minibuf(e, "Switch to buffer: ", cb_switch_buffer);
+}
+
+static void cmd_kill_buffer(Editor *e, const char *arg) {
+    if (arg) cb_kill_buffer(e, arg);
+    else editor_start_minibuf(e, "Kill buffer: ", cb_kill_buffer);
+}
+
+static void cmd_open_shell(Editor *e, const char *arg) {
+    (void)arg;
+    shell_buf_create(e, "/bin/bash");
+    editor_set_message(e, "Opened shell buffer");
+}
+
+static void cmd_split_window(Editor *e, const char *arg) {
+    (void)arg;
+    editor_set_message(e, "Window splitting not yet implemented");
+}
+
+static void cmd_kmacro_start(Editor *e, const char *arg) {
+    (void)arg;
+    if (e->kmacro_replaying) return;
+    e->kmacro_recording = 1;
+    e->kmacro_len = 0;
+    e->kmacro_seq_start = 0;
+    editor_set_message(e, "Defining keyboard macro...");
+}
+
+static void cmd_kmacro_end(Editor *e, const char *arg) {
+    (void)arg;
+    if (!e->kmacro_recording) {
+        editor_set_message(e, "Not defining keyboard macro");
+        return;
+    }
+    e->kmacro_recording = 0;
+    if (!e->kmacro_replaying)
+        e->kmacro_len = e->kmacro_seq_start;    /* the keys that ran this */
+    editor_set_message(e, "Keyboard macro defined (%d keys)", e->kmacro_len);
+}
+
+static void cmd_kmacro_execute(Editor *e, const char *arg) {
+    (void)arg;
+    if (e->kmacro_recording && !e->kmacro_replaying)
+        e->kmacro_len = e->kmacro_seq_start;    /* keep C-x e out of the macro */
+    kmacro_run(e, 1);
+}
+
+static void cmd_kmacro_repeat(Editor *e, const char *arg) {
+    int times = arg ? atoi(arg) : 1;
+    kmacro_run(e, times > 0 ? times : 1);
+}
+
+static void cmd_kmacro_to_js(Editor *e, const char *arg) {
+    (void)arg;
+    kmacro_to_js(e);
+}
+
+/* Byte count as "512B", "1.5K", "12.0M", "3.2G" */
+static void format_size(size_t bytes, char *out, size_t len) {
+    if (bytes < 1024) snprintf(out, len, "%zuB", bytes);
+    else if (bytes < 1024 * 1024) snprintf(out, len, "%.1fK", bytes / 1024.0);
+    else if (bytes < 1024UL * 1024 * 1024) snprintf(out, len, "%.1fM", bytes / (1024.0 * 1024));
+    else snprintf(out, len, "%.1fG", bytes / (1024.0 * 1024 * 1024));
+}
+
+/* One *Buffer List* row: label columns, then the sizes in `st` */
+static char *buffer_list_row(const char *idx, const char *name, const char *lines,
+                             const BufferMemStats *st, const char *tail) {
+    char text[16], array[16], overhead[16], total[16], line[512];
+    format_size(st->text, text, sizeof(text));
+    format_size(st->line_array, array, sizeof(array));
+    format_size(st->overhead, overhead, sizeof(overhead));
+    format_size(st->total, total, sizeof(total));
+    snprintf(line, sizeof(line), "  %-4s %-24s %9s %8s %8s %8s %8s%s%s",
+             idx, name, lines, text, array, overhead, total, *tail ? "  " : "", tail);
+    return strdup(line);
+}
+
+static void cmd_list_buffers(Editor *e, const char *arg) {
+    (void)arg;
+    Buffer *lb = editor_find_buffer(e, "*Buffer List*");
+    if (!lb) lb = editor_new_buffer(e, "*Buffer List*");
+    char **rows = lb ? malloc(sizeof(char *) * (e->num_buffers + 3)) : NULL;
+    if (!rows) return;
+    /* Rebuild */
+    int nrows = 0;
+    char line[256];
+    rows[nrows++] = strdup("Buffer List:");
+    snprintf(line, sizeof(line), "  %-4s %-24s %9s %8s %8s %8s %8s  %s",
+             "", "Buffer", "Lines", "Text", "Array", "Overhd", "Total", "File");
+    rows[nrows++] = strdup(line);
+    BufferMemStats sum = { 0, 0, 0, 0, 0 };
+    for (int i = 0; i < e->num_buffers; i++) {
+        Buffer *b = e->buffers[i];
+        BufferMemStats st;
+        buffer_mem_stats(b, &st);
+        sum.text += st.text;
+        sum.line_array += st.line_array;
+        sum.overhead += st.overhead;
+        sum.packed += st.packed;
+        sum.total += st.total;
+        char idx[16], lines[16];
+        snprintf(idx, sizeof(idx), "[%d]", i + 1);
+        snprintf(lines, sizeof(lines), "%d", b->num_lines);
+        snprintf(line, sizeof(line), "%s%s%s%s", b->modified ? "(modified) " : "",
+                 b->packed ? "(packed) " : "", b->is_shell ? "(shell)" : "",
+                 b->filename ? b->filename : "");
+        rows[nrows++] = buffer_list_row(idx, b->name, lines, &st, line);
+    }
+    rows[nrows++] = buffer_list_row("", "(all buffers)", "", &sum, "");
+    buffer_replace_lines(lb, 0, lb->num_lines, rows, nrows);
+    free(rows);
+    lb->modified = 0;
+    /* Switch to buffer list */
+    e->current_buffer = lb->index;
+}
+
+static void cmd_eval_js(Editor *e, const char *arg) {
+    if (!arg) {
         /* Bare "eval-js" with no code: show usage hint */
         editor_set_message(e, "Usage: M-x eval-js <js-code>  e.g.: eval-js 1+2");
-    } else if (strcmp(input, "open-shell") == 0) {
-        shell_buf_create(e, "/bin/bash");
-        editor_set_message(e, "Opened shell buffer");
-    } else if (strcmp(input, "list-buffers") == 0) {
-        Buffer *lb = editor_find_buffer(e, "*Buffer List*");
-        if (!lb) lb = editor_new_buffer(e, "*Buffer List*");
-        if (lb) {
-            /* Clear and rebuild */
-            for (int i = 0; i < lb->num_lines; i++) free(lb->lines[i]);
-            lb->num_lines = 0;
-            lb->lines[0] = strdup("Buffer List:");
-            lb->num_lines = 1;
-            for (int i = 0; i < e->num_buffers; i++) {
-                char line[256];
-                int n = snprintf(line, sizeof(line), "  [%d] %s%s",
-                         i + 1, e->buffers[i]->name,
-                         e->buffers[i]->modified ? " (modified)" : "");
-                if (e->buffers[i]->filename && n < (int)sizeof(line) - 1) {
-                    snprintf(line + n, sizeof(line) - n, " -- %s",
-                             e->buffers[i]->filename);
-                }
-                if (lb->num_lines >= lb->capacity) {
-                    int new_cap = lb->capacity * 2;
-                    char **tmp = realloc(lb->lines, sizeof(char *) * new_cap);
-                    if (!tmp) break;
-                    lb->lines = tmp;
-                    lb->capacity = new_cap;
-                }
-                lb->lines[lb->num_lines++] = strdup(line);
-            }
-            lb->modified = 0;
-            /* Switch to buffer list */
-            for (int i = 0; i < e->num_buffers; i++) {
-                if (e->buffers[i] == lb) { e->current_buffer = i; break; }
-            }
-        }
-    } else if (strncmp(input, "eval-js ", 8) == 0) {
-        char result[512] = {0};
-        script_eval(e->js_ctx, input + 8, result, sizeof(result));
+        return;
+    }
+    char result[512] = {0};
+    script_eval(editor_script_ctx(e), arg, result, sizeof(result));
+    editor_set_message(e, "JS: %s", result);
+}
+
+static void cmd_js_profile(Editor *e, const char *arg) {
+    if (!arg) {
+        editor_set_message(e, "Usage: M-x js-profile <js-code>");
+        return;
+    }
+    char result[512] = {0};
+    if (script_profile(e, editor_script_ctx(e), arg, result, sizeof(result)) < 0)
         editor_set_message(e, "JS: %s", result);
-    } else if (strcmp(input, "set-mark") == 0) {
-        if (buf) { buffer_set_mark(buf); editor_set_message(e, "Mark set"); }
-    } else if (strcmp(input, "kill-region") == 0) {
-        if (buf && buf->mark_active) {
-            buffer_kill_region(buf, &e->kill_ring);
-            editor_set_message(e, "Killed region");
-        } else {
-            editor_set_message(e, "No mark set");
+    else
+        editor_set_message(e, "Profile written to *js-profile*");
+}
+
+static void cmd_load_js(Editor *e, const char *arg) {
+    if (!arg) {
+        editor_set_message(e, "Usage: M-x load-js <file>");
+        return;
+    }
+    editor_load_script(e, arg);
+}
+
+static void cmd_js_time_limit(Editor *e, const char *arg) {
+    if (arg) e->js_time_limit_ms = strtol(arg, NULL, 10);
+    if (e->js_time_limit_ms > 0)
+        editor_set_message(e, "JS time limit: %ld ms", e->js_time_limit_ms);
+    else
+        editor_set_message(e, "JS time limit: none");
+}
+
+static void cmd_pack_delay(Editor *e, const char *arg) {
+    if (arg) e->pack_delay_secs = atoi(arg);
+    if (e->pack_delay_secs > 0)
+        editor_set_message(e, "Packing buffers idle for %d s", e->pack_delay_secs);
+    else
+        editor_set_message(e, "Buffer packing: off");
+}
+
+/* Pack every buffer but the current one now, whatever the delay */
+static void cmd_pack_buffers(Editor *e, const char *arg) {
+    (void)arg;
+    size_t before = 0, after = 0;
+    BufferMemStats st;
+    for (int i = 0; i < e->num_buffers; i++) {
+        buffer_mem_stats(e->buffers[i], &st);
+        before += st.total;
+    }
+    int n = editor_pack_buffers(e, 0, e->num_buffers);
+    for (int i = 0; i < e->num_buffers; i++) {
+        buffer_mem_stats(e->buffers[i], &st);
+        after += st.total;
+    }
+    char from[16], to[16];
+    format_size(before, from, sizeof(from));
+    format_size(after, to, sizeof(to));
+    editor_set_message(e, "Packed %d buffer%s: %s -> %s", n, n == 1 ? "" : "s", from, to);
+}
+
+static void cmd_startup_time(Editor *e, const char *arg) {
+    (void)arg;
+    if (e->js_ctx)
+        editor_set_message(e, "First frame after %.1f ms, scripting ready after %.1f ms",
+                           e->first_frame_ms, e->js_ready_ms);
+    else
+        editor_set_message(e, "First frame after %.1f ms, scripting not started",
+                           e->first_frame_ms);
+}
+
+/* editor-stats [reset]: timers and counters into *stats* */
+static void cmd_editor_stats(Editor *e, const char *arg) {
+    if (arg && strcmp(arg, "reset") == 0) {
+        stats_reset();
+        for (int i = 0; i < e->num_buffers; i++) {
+            e->buffers[i]->allocs = 0;
+            e->buffers[i]->pty_bytes = 0;
         }
-    } else if (strcmp(input, "copy-region") == 0) {
-        if (buf && buf->mark_active) {
-            buffer_copy_region(buf, &e->kill_ring);
-            editor_set_message(e, "Region copied");
-        } else {
-            editor_set_message(e, "No mark set");
+        editor_set_message(e, "Stats reset");
+        return;
+    }
+    int max_rows = STAT_NUM_TIMERS + e->num_buffers + 8;
+    char **rows = malloc(sizeof(char *) * max_rows);
+    if (!rows) return;
+    int nrows = 0;
+    char line[256];
+    snprintf(line, sizeof(line), "  %-10s %10s %10s %10s %10s %10s %10s %10s",
+             "timer", "count", "mean us", "p50 us", "p90 us", "p99 us", "max us", "total ms");
+    rows[nrows++] = strdup(line);
+    for (int t = 0; t < STAT_NUM_TIMERS; t++) {
+        StatSummary st;
+        stats_summary(t, &st);
+        snprintf(line, sizeof(line), "  %-10s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f",
+                 stats_timer_name(t), st.count, st.mean_us, st.p50_us, st.p90_us,
+                 st.p99_us, st.max_us, st.total_ms);
+        rows[nrows++] = strdup(line);
+    }
+    rows[nrows++] = strdup("");
+    snprintf(line, sizeof(line), "  %-24s %10s %12s %12s", "buffer", "lines", "allocs", "pty bytes");
+    rows[nrows++] = strdup(line);
+    unsigned long long allocs = stats_retired_allocs();
+    for (int i = 0; i < e->num_buffers; i++) {
+        Buffer *b = e->buffers[i];
+        allocs += b->allocs;
+        snprintf(line, sizeof(line), "  %-24s %10d %12lu %12llu",
+                 b->name, b->num_lines, b->allocs, b->pty_bytes);
+        rows[nrows++] = strdup(line);
+    }
+    snprintf(line, sizeof(line), "  %-24s %10s %12llu %12llu", "total (incl. killed)", "",
+             allocs, stats_pty_bytes());
+    rows[nrows++] = strdup(line);
+
+    Buffer *sb = editor_find_buffer(e, "*stats*");
+    if (!sb) sb = editor_new_buffer(e, "*stats*");
+    if (sb) {
+        buffer_replace_lines(sb, 0, sb->num_lines, rows, nrows);
+        sb->modified = 0;
+        sb->cursor_line = sb->cursor_col = sb->top_line = 0;
+        e->current_buffer = sb->index;
+    } else {
+        while (nrows > 0) free(rows[--nrows]);
+    }
+    free(rows);
+}
+
+static void cmd_trace_start(Editor *e, const char *arg) {
+    (void)arg;
+    trace_start();
+    editor_set_message(e, "Tracing; M-x trace-stop [file] writes the trace");
+}
+
+static void cmd_trace_stop(Editor *e, const char *arg) {
+    if (!TRACE_ON()) {
+        editor_set_message(e, "Not tracing");
+        return;
+    }
+    const char *path = arg && *arg ? arg : trace_default_path();
+    int n = trace_stop(path);
+    if (n < 0) editor_set_message(e, "Cannot write %s", path);
+    else editor_set_message(e, "Wrote %d trace events to %s", n, path);
+}
+
+static void cmd_visual_line_mode(Editor *e, const char *arg) {
+    (void)arg;
+    CURRENT_BUFFER_OR_RETURN(buf);
+    if (buf->wrap) wrap_disable(buf);
+    else wrap_enable(buf, e->edit_width - 1);
+    editor_set_message(e, "Visual line mode %s", buf->wrap ? "on" : "off");
+}
+
+/* syntax-mode [c|js|sh|log|off]: no argument toggles, guessing the
+ * language from the file name */
+static void cmd_syntax_mode(Editor *e, const char *arg) {
+    CURRENT_BUFFER_OR_RETURN(buf);
+    const char *lang = NULL;
+    if (arg && *arg && strcmp(arg, "off") != 0) {
+        lang = syntax_attach(buf, arg);
+        if (!lang) {
+            editor_set_message(e, "No syntax named %s", arg);
+            return;
         }
-    } else if (strcmp(input, "yank") == 0) {
-        if (buf) buffer_yank(buf, e->kill_ring);
-    } else if (strcmp(input, "find") == 0) {
-        editor_start_minibuf(e, "Find: ", cb_find);
-    } else if (strcmp(input, "replace") == 0) {
-        editor_start_minibuf(e, "Find: ", cb_find_for_replace);
+    } else if (!buf->syntax && !(arg && *arg)) {
+        lang = syntax_attach(buf, NULL);
+    } else {
+        syntax_detach(buf);
+    }
+    if (lang) editor_set_message(e, "Highlighting as %s", lang);
+    else editor_set_message(e, "Highlighting off");
+}
+
+static void cmd_follow_file(Editor *e, const char *arg) {
+    (void)arg;
+    Buffer *buf = editor_current_buffer(e);
+    if (!buf || !buf->filename || buf->is_shell) {
+        editor_set_message(e, "Not visiting a file");
+    } else if (buf->follow) {
+        file_watch_unfollow(e, buf);
+        editor_set_message(e, "Stopped following %s", buf->filename);
+    } else if (file_watch_follow(e, buf) == 0) {
+        editor_set_message(e, "Following %s", buf->filename);
     } else {
-        editor_set_message(e, "Unknown command: %s", input);
+        editor_set_message(e, "Cannot watch %s", buf->filename);
+    }
+}
+
+static void cmd_auto_revert_mode(Editor *e, const char *arg) {
+    (void)arg;
+    e->auto_revert = !e->auto_revert;
+    editor_set_message(e, "Auto-revert %s", e->auto_revert ? "on" : "off");
+}
+
+static void cmd_revert_buffer(Editor *e, const char *arg) {
+    (void)arg;
+    Buffer *buf = editor_current_buffer(e);
+    if (!buf || !buf->filename || buf->is_shell) {
+        editor_set_message(e, "Not visiting a file");
+        return;
     }
+    int hunks = buffer_revert_file(buf);
+    editor_update_file_id(e, buf);
+    if (hunks < 0)
+        editor_set_message(e, "Error reverting %s", buf->filename);
+    else
+        editor_set_message(e, "Reverted %s (%d hunk%s)", buf->name,
+                           hunks, hunks == 1 ? "" : "s");
+}
+
+static const struct { const char *name; CommandFn fn; } s_commands[] = {
+    { "previous-line",            cmd_previous_line },
+    { "next-line",                cmd_next_line },
+    { "backward-char",            cmd_backward_char },
+    { "forward-char",             cmd_forward_char },
+    { "move-beginning-of-line",   cmd_beginning_of_line },
+    { "move-end-of-line",         cmd_end_of_line },
+    { "scroll-down",              cmd_scroll_down },
+    { "scroll-up",                cmd_scroll_up },
+    { "forward-word",             cmd_forward_word },
+    { "backward-word",            cmd_backward_word },
+    { "beginning-of-buffer",      cmd_beginning_of_buffer },
+    { "end-of-buffer",            cmd_end_of_buffer },
+    { "delete-backward-char",     cmd_delete_backward_char },
+    { "delete-char",              cmd_delete_char },
+    { "kill-word",                cmd_kill_word },
+    { "kill-line",                cmd_kill_line },
+    { "yank",                     cmd_yank },
+    { "yank-pop",                 cmd_yank_pop },
+    { "kill-region",              cmd_kill_region },
+    { "copy-region",              cmd_copy_region },
+    { "set-mark",                 cmd_set_mark },
+    { "insert-tab",               cmd_insert_tab },
+    { "newline",                  cmd_newline },
+    { "find",                     cmd_find },
+    { "replace",                  cmd_replace },
+    { "keyboard-quit",            cmd_keyboard_quit },
+    { "redraw-display",           cmd_redraw },
+    { "toggle-help",              cmd_toggle_help },
+    { "execute-extended-command", cmd_execute_extended_command },
+    { "save-buffer",              cmd_save_buffer },
+    { "find-file",                cmd_find_file },
+    { "quit",                     cmd_quit },
+    { "switch-to-buffer",         cmd_switch_buffer },
+    { "kill-buffer",              cmd_kill_buffer },
+    { "open-shell",               cmd_open_shell },
+    { "split-window",             cmd_split_window },
+    { "kmacro-start",             cmd_kmacro_start },
+    { "kmacro-end",               cmd_kmacro_end },
+    { "kmacro-execute",           cmd_kmacro_execute },
+    { "kmacro-repeat",            cmd_kmacro_repeat },
+    { "kmacro-to-js",             cmd_kmacro_to_js },
+    { "list-buffers",             cmd_list_buffers },
+    { "eval-js",                  cmd_eval_js },
+    { "js-profile",               cmd_js_profile },
+    { "load-js",                  cmd_load_js },
+    { "js-time-limit",            cmd_js_time_limit },
+    { "pack-delay",               cmd_pack_delay },
+    { "pack-buffers",             cmd_pack_buffers },
+    { "startup-time",             cmd_startup_time },
+    { "editor-stats",             cmd_editor_stats },
+    { "trace-start",              cmd_trace_start },
+    { "trace-stop",               cmd_trace_stop },
+    { "visual-line-mode",         cmd_visual_line_mode },
+    { "syntax-mode",              cmd_syntax_mode },
+    { "follow-file",              cmd_follow_file },
+    { "auto-revert-mode",         cmd_auto_revert_mode },
+    { "revert-buffer",            cmd_revert_buffer },
+    { NULL, NULL }
+};
+
+/* Default bindings, as key sequences in keys_parse() syntax. */
+static const struct { const char *map; const char *seq; const char *cmd; } s_default_bindings[] = {
+    { "global", "<up>",        "previous-line" },
+    { "global", "C-p",         "previous-line" },
+    { "global", "<down>",      "next-line" },
+    { "global", "C-n",         "next-line" },
+    { "global", "<left>",      "backward-char" },
+    { "global", "C-b",         "backward-char" },
+    { "global", "<right>",     "forward-char" },
+    { "global", "C-f",         "forward-char" },
+    { "global", "C-a",         "move-beginning-of-line" },
+    { "global", "<home>",      "move-beginning-of-line" },
+    { "global", "C-e",         "move-end-of-line" },
+    { "global", "<end>",       "move-end-of-line" },
+    { "global", "<prior>",     "scroll-down" },
+    { "global", "<next>",      "scroll-up" },
+    { "global", "<backspace>", "delete-backward-char" },
+    { "global", "DEL",         "delete-backward-char" },
+    { "global", "C-h",         "delete-backward-char" },
+    { "global", "C-d",         "delete-char" },
+    { "global", "<delete>",    "delete-char" },
+    { "global", "C-k",         "kill-line" },
+    { "global", "C-y",         "yank" },
+    { "global", "M-y",         "yank-pop" },
+    { "global", "C-w",         "kill-region" },
+    { "global", "C-s",         "find" },
+    { "global", "C-SPC",       "set-mark" },
+    { "global", "TAB",         "insert-tab" },
+    { "global", "RET",         "newline" },
+    { "global", "C-m",         "newline" },
+    { "global", "<enter>",     "newline" },
+    { "global", "C-g",         "keyboard-quit" },
+    { "global", "C-l",         "redraw-display" },
+    { "global", "<f1>",        "toggle-help" },
+    { "global", "M-x",         "execute-extended-command" },
+    { "global", "M-X",         "execute-extended-command" },
+    { "global", "M-f",         "forward-word" },
+    { "global", "M-b",         "backward-word" },
+    { "global", "M-<",         "beginning-of-buffer" },
+    { "global", "M->",         "end-of-buffer" },
+    { "global", "M-d",         "kill-word" },
+    { "global", "M-w",         "copy-region" },
+    { "global", "M-%",         "replace" },
+    { "global", "C-x C-s",     "save-buffer" },
+    { "global", "C-x C-f",     "find-file" },
+    { "global", "C-x C-c",     "quit" },
+    { "global", "C-x b",       "switch-to-buffer" },
+    { "global", "C-x k",       "kill-buffer" },
+    { "global", "C-x s",       "open-shell" },
+    { "global", "C-x 2",       "split-window" },
+    { "global", "C-x (",       "kmacro-start" },
+    { "global", "C-x )",       "kmacro-end" },
+    { "global", "C-x e",       "kmacro-execute" },
+    { NULL, NULL, NULL }
+};
+
+/*
+ * Keymaps.  "global" serves file and scratch buffers; unbound printable
+ * keys there insert themselves.  "shell" serves live shell buffers; it
+ * shares the C-x map with "global" and passes every other unbound key to
+ * the PTY.
+ */
+static Keymap *s_global_map;
+static Keymap *s_shell_map;
+
+static void keys_init(void) {
+    if (s_global_map) return;
+    for (int i = 0; s_commands[i].name; i++)
+        command_define(s_commands[i].name, s_commands[i].fn);
+    s_global_map = keymap_new("global");
+    s_shell_map = keymap_new("shell");
+    for (int i = 0; s_default_bindings[i].map; i++)
+        keys_bind(s_default_bindings[i].map, s_default_bindings[i].seq,
+                  s_default_bindings[i].cmd);
+    /* Shell buffers get C-x commands and nothing else */
+    KeyBinding *cx = keymap_lookup(s_global_map, CTRL('x'));
+    if (cx && cx->prefix) keymap_bind_prefix(s_shell_map, CTRL('x'), cx->prefix);
+}
+
+void keys_shutdown(void) {
+    keymap_free_all();
+    s_global_map = s_shell_map = NULL;
+}
+
+int keys_bind(const char *map_name, const char *seq, const char *command) {
+    keys_init();
+    Keymap *map = keymap_find(map_name ? map_name : "global");
+    if (!map) return -1;
+    int keys[16];
+    int n = keys_parse(seq, keys, 16);
+    if (n <= 0) return -2;
+    Command *cmd = command_find(command);
+    if (!cmd) return -3;
+    return keymap_bind(map, keys, n, cmd) == 0 ? 0 : -1;
+}
+
+int keys_define_js_command(const char *name, int js_id) {
+    keys_init();
+    return command_define_js(name, js_id) ? 0 : -1;
+}
+
+static void run_command(Editor *e, Command *cmd, const char *arg) {
+    if (cmd->fn) cmd->fn(e, arg);
+    else script_run_command(e, cmd->js_id, arg);
+}
+
+/* M-x: "name" or "name argument text" */
+static void cb_mx_command(Editor *e, const char *input) {
+    char name[128];
+    size_t len = strcspn(input, " ");
+    if (len >= sizeof(name)) len = sizeof(name) - 1;
+    memcpy(name, input, len);
+    name[len] = '\0';
+    const char *arg = input[len] == ' ' && input[len + 1] ? input + len + 1 : NULL;
+
+    keys_init();
+    Command *cmd = command_find(name);
+    if (cmd) run_command(e, cmd, arg);
+    else editor_set_message(e, "Unknown command: %s", input);
 }
 
 /* Handle minibuffer input */
@@ -179,304 +1093,94 @@ static void handle_minibuf_key(Editor *e, int key) {
     }
 }
 
-/* Handle C-x prefix sequence */
-static void handle_ctrl_x_key(Editor *e, int key) {
-    e->pending_ctrl_x = 0;
+/* Shell buffer: send an unbound key to the pty as raw bytes. */
+static void shell_passthrough(Buffer *buf, int key) {
+    char raw[RAW_KEY_BUF_SIZE];
+    int rawlen = 0;
 
     switch (key) {
-    case CTRL('s'):
-        editor_save_current(e);
-        break;
-    case CTRL('f'):
-        editor_start_minibuf(e, "Find file: ", cb_find_file);
-        break;
-    case CTRL('c'):
-        e->running = 0;
-        break;
-    case 'b':
-        editor_start_minibuf(e, "Switch to buffer: ", cb_switch_buffer);
-        break;
-    case 'k':
-        editor_start_minibuf(e, "Kill buffer: ", cb_kill_buffer);
-        break;
-    case 's':
-        shell_buf_create(e, "/bin/bash");
-        editor_set_message(e, "Opened shell buffer");
-        break;
-    case '2':
-        editor_set_message(e, "Window splitting not yet implemented");
-        break;
+    case KEY_UP:    raw[0] = '\033'; raw[1] = '['; raw[2] = 'A'; rawlen = 3; break;
+    case KEY_DOWN:  raw[0] = '\033'; raw[1] = '['; raw[2] = 'B'; rawlen = 3; break;
+    case KEY_RIGHT: raw[0] = '\033'; raw[1] = '['; raw[2] = 'C'; rawlen = 3; break;
+    case KEY_LEFT:  raw[0] = '\033'; raw[1] = '['; raw[2] = 'D'; rawlen = 3; break;
+    case KEY_BACKSPACE: raw[0] = 127; rawlen = 1; break;
+    case '\n': case '\r': raw[0] = '\r'; rawlen = 1; break;
     default:
-        editor_set_message(e, "C-x %c is undefined", key);
-        break;
-    }
-}
-
-/* Handle M- (meta/ESC) prefix */
-static void handle_meta_key(Editor *e, int key) {
-    e->pending_meta = 0;
-    Buffer *buf = editor_current_buffer(e);
-
-    switch (key) {
-    case 'x':
-    case 'X':
-        editor_start_minibuf(e, "M-x ", cb_mx_command);
-        break;
-    case 'f': /* M-f: forward word */
-        if (buf) {
-            char *line = buf->lines[buf->cursor_line];
-            int len = (int)strlen(line);
-            /* Skip non-word chars then word chars */
-            while (buf->cursor_col < len && line[buf->cursor_col] == ' ')
-                buf->cursor_col++;
-            while (buf->cursor_col < len && line[buf->cursor_col] != ' ')
-                buf->cursor_col++;
-        }
-        break;
-    case 'b': /* M-b: backward word */
-        if (buf) {
-            char *line = buf->lines[buf->cursor_line];
-            if (buf->cursor_col > 0) buf->cursor_col--;
-            while (buf->cursor_col > 0 && line[buf->cursor_col] == ' ')
-                buf->cursor_col--;
-            while (buf->cursor_col > 0 && line[buf->cursor_col - 1] != ' ')
-                buf->cursor_col--;
+        if (key >= 0 && key < 256) {
+            raw[0] = (char)key;
+            rawlen = 1;
         }
         break;
-    case '<': /* M-<: beginning of buffer */
-        if (buf) {
-            buf->cursor_line = 0;
-            buf->cursor_col  = 0;
-            buf->top_line    = 0;
-        }
-        break;
-    case '>': /* M->: end of buffer */
-        if (buf) {
-            buf->cursor_line = buf->num_lines - 1;
-            buf->cursor_col  = (int)strlen(buf->lines[buf->cursor_line]);
-        }
-        break;
-    case 'd': /* M-d: kill word forward */
-        if (buf) {
-            char *line = buf->lines[buf->cursor_line];
-            int len = (int)strlen(line);
-            int start = buf->cursor_col;
-            while (buf->cursor_col < len && line[buf->cursor_col] == ' ')
-                buf->cursor_col++;
-            while (buf->cursor_col < len && line[buf->cursor_col] != ' ')
-                buf->cursor_col++;
-            /* Delete from start to cursor_col */
-            memmove(line + start, line + buf->cursor_col,
-                    len - buf->cursor_col + 1);
-            buf->cursor_col = start;
-            buf->modified = 1;
-        }
-        break;
-    case 'w': /* M-w: copy region */
-        if (buf && buf->mark_active) {
-            buffer_copy_region(buf, &e->kill_ring);
-            editor_set_message(e, "Region copied");
-        } else {
-            editor_set_message(e, "No mark set");
-        }
-        break;
-    case '%': /* M-%: find and replace */
-        editor_start_minibuf(e, "Find: ", cb_find_for_replace);
-        break;
-    default:
-        editor_set_message(e, "M-%c is undefined", key);
-        break;
+    }
+    if (rawlen > 0) {
+        shell_buf_write(buf, raw, rawlen);
     }
 }
 
 void handle_key(Editor *e, int key) {
+    if (e->kmacro_recording && !e->kmacro_replaying && key != KEY_RESIZE) {
+        /* A new top-level sequence: the point to cut back to if it turns
+         * out to run C-x ) or C-x e, however they were invoked */
+        if (!e->pending_keymap && !e->minibuf_active)
+            e->kmacro_seq_start = e->kmacro_len;
+        kmacro_record(e, key);
+    }
+
     /* Handle minibuf mode */
     if (e->minibuf_active) {
         handle_minibuf_key(e, key);
         return;
     }
 
-    /* Handle C-x prefix */
-    if (e->pending_ctrl_x) {
-        handle_ctrl_x_key(e, key);
-        return;
-    }
-
-    /* Handle Meta prefix */
-    if (e->pending_meta) {
-        handle_meta_key(e, key);
+    if (key == KEY_RESIZE) {
+        ui_resize(e);
         return;
     }
 
+    keys_init();
     Buffer *buf = editor_current_buffer(e);
-    if (!buf) return;
+    int shell = buf && buf->is_shell && buf->pty_fd >= 0;
+    Keymap *map = e->pending_keymap ? e->pending_keymap
+                : shell ? s_shell_map : s_global_map;
+    int prefixed = e->pending_keymap != NULL;
+    e->pending_keymap = NULL;
+    if (!prefixed) e->pending_keys[0] = '\0';
 
-    /* Shell buffer: send raw input to pty (except C-x) */
-    if (buf->is_shell && buf->pty_fd >= 0) {
-        char raw[RAW_KEY_BUF_SIZE];
-        int rawlen = 0;
-        int passthru = 1;
-
-        switch (key) {
-        case CTRL('x'):
-            e->pending_ctrl_x = 1;
-            editor_set_message(e, "C-x-");
-            passthru = 0;
-            break;
-        case KEY_UP:    raw[0] = '\033'; raw[1] = '['; raw[2] = 'A'; rawlen = 3; break;
-        case KEY_DOWN:  raw[0] = '\033'; raw[1] = '['; raw[2] = 'B'; rawlen = 3; break;
-        case KEY_RIGHT: raw[0] = '\033'; raw[1] = '['; raw[2] = 'C'; rawlen = 3; break;
-        case KEY_LEFT:  raw[0] = '\033'; raw[1] = '['; raw[2] = 'D'; rawlen = 3; break;
-        case KEY_BACKSPACE: raw[0] = 127; rawlen = 1; break;
-        case '\n': case '\r': raw[0] = '\r'; rawlen = 1; break;
-        default:
-            if (key >= 0 && key < 256) {
-                raw[0] = (char)key;
-                rawlen = 1;
-            } else {
-                passthru = 0;
-            }
-            break;
-        }
-        if (passthru && rawlen > 0) {
-            shell_buf_write(buf, raw, rawlen);
-        }
+    char name[16];
+    keys_describe(key, name, sizeof(name));
+    KeyBinding *kb = keymap_lookup(map, key);
+
+    if (kb && kb->prefix) {
+        /* Wait for the next key; pending_keys reads "C-x " or "M-" */
+        e->pending_keymap = kb->prefix;
+        size_t n = strlen(e->pending_keys);
+        if (key == 27)
+            snprintf(e->pending_keys + n, sizeof(e->pending_keys) - n, "M-");
+        else
+            snprintf(e->pending_keys + n, sizeof(e->pending_keys) - n, "%s ", name);
+        /* A bare ESC (Meta) is not echoed */
+        if (key != 27)
+            editor_set_message(e, "%.*s-", (int)strlen(e->pending_keys) - 1,
+                               e->pending_keys);
+        return;
+    }
+    /* A complete key sequence: commands see what the previous one did */
+    e->last_cmd_flags = e->cmd_flags;
+    e->cmd_flags = 0;
+    if (kb && kb->cmd) {
+        run_command(e, kb->cmd, NULL);
         return;
     }
 
-    /* Normal buffer key handling */
-    switch (key) {
-    /* Movement */
-    case KEY_UP:
-    case CTRL('p'):
-        buffer_move_cursor(buf, -1, 0);
-        break;
-    case KEY_DOWN:
-    case CTRL('n'):
-        buffer_move_cursor(buf, 1, 0);
-        break;
-    case KEY_LEFT:
-    case CTRL('b'):
-        if (buf->cursor_col > 0) {
-            buf->cursor_col--;
-        } else if (buf->cursor_line > 0) {
-            buf->cursor_line--;
-            buffer_move_eol(buf);
-        }
-        break;
-    case KEY_RIGHT:
-    case CTRL('f'):
-        {
-            int linelen = (int)strlen(buf->lines[buf->cursor_line]);
-            if (buf->cursor_col < linelen) {
-                buf->cursor_col++;
-            } else if (buf->cursor_line < buf->num_lines - 1) {
-                buf->cursor_line++;
-                buf->cursor_col = 0;
-            }
-        }
-        break;
-    case CTRL('a'):
-    case KEY_HOME:
-        buffer_move_bol(buf);
-        break;
-    case CTRL('e'):
-    case KEY_END:
-        buffer_move_eol(buf);
-        break;
-
-    /* Page up/down */
-    case KEY_PPAGE:
-        buf->cursor_line -= e->edit_height;
-        buf->top_line    -= e->edit_height;
-        if (buf->top_line < 0) buf->top_line = 0;
-        buffer_clamp_cursor(buf);
-        break;
-    case KEY_NPAGE:
-        buf->cursor_line += e->edit_height;
-        buf->top_line    += e->edit_height;
-        if (buf->top_line >= buf->num_lines)
-            buf->top_line = buf->num_lines - 1;
-        buffer_clamp_cursor(buf);
-        break;
-
-    /* Editing */
-    case KEY_BACKSPACE:
-    case 127:
-    case CTRL('h'):
-        buffer_delete_char(buf);
-        break;
-    case CTRL('d'):
-    case KEY_DC:
-        buffer_delete_forward(buf);
-        break;
-    case CTRL('k'):
-        buffer_kill_line(buf, &e->kill_ring);
-        break;
-    case CTRL('y'):
-        buffer_yank(buf, e->kill_ring);
-        break;
-    case CTRL('w'): /* C-w: cut (kill) region */
-        if (buf->mark_active) {
-            buffer_kill_region(buf, &e->kill_ring);
-            editor_set_message(e, "Killed region");
-        } else {
-            editor_set_message(e, "No mark set");
-        }
-        break;
-    case CTRL('s'): /* C-s: find (search forward) */
-        editor_start_minibuf(e, "Find: ", cb_find);
-        break;
-    case 0: /* C-SPC / C-@: set mark */
-        buffer_set_mark(buf);
-        editor_set_message(e, "Mark set");
-        break;
-    case '\t':
-        buffer_insert_char(buf, '\t');
-        break;
-    case '\n':
-    case '\r':
-    case KEY_ENTER:
-        buffer_insert_char(buf, '\n');
-        break;
-
-    /* C-x prefix */
-    case CTRL('x'):
-        e->pending_ctrl_x = 1;
-        editor_set_message(e, "C-x-");
-        break;
-
-    /* ESC = Meta prefix */
-    case 27:
-        e->pending_meta = 1;
-        break;
-
-    /* M-x via Alt+x on some terminals sends as 'x' after ESC */
-    case CTRL('g'):
-        e->pending_ctrl_x = 0;
-        e->pending_meta   = 0;
-        editor_set_message(e, "Quit");
-        break;
-
-    case CTRL('l'):
-        clearok(e->edit_win, TRUE);
-        editor_set_message(e, "");
-        break;
-
-    case KEY_F(1):
-        e->show_help = !e->show_help;
-        break;
-
-    case KEY_RESIZE:
-        ui_resize(e);
-        break;
-
-    default:
-        if (key >= 32 && key < 256) {
-            buffer_insert_char(buf, (char)key);
-            /* Clear message after typing */
-            if (e->message[0]) e->message[0] = '\0';
-        }
-        break;
+    if (prefixed) {
+        if (key == CTRL('g')) editor_set_message(e, "Quit");
+        else editor_set_message(e, "%s%s is undefined", e->pending_keys, name);
+    } else if (shell) {
+        shell_passthrough(buf, key);
+    } else if (buf && key >= 32 && key < 256) {
+        /* Self-insert */
+        buffer_insert_char(buf, (char)key);
+        /* Clear message after typing */
+        if (e->message[0]) e->message[0] = '\0';
     }
 }
@@ -4,6 +4,12 @@
 #include "editor.h"
 
 void handle_key(Editor *e, int key);
+int keys_execute(Editor *e, const int *keys, int n, int times);
+int keys_parse(const char *seq, int *keys, int max);
+void keys_describe(int key, char *out, size_t len);
+int keys_bind(const char *map_name, const char *seq, const char *command);
+int keys_define_js_command(const char *name, int js_id);
+void keys_shutdown(void);
 
 /* Control key helper */
 #define CTRL(x) ((x) & 0x1f)
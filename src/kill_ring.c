@@ -0,0 +1,109 @@
+#include "kill_ring.h"
+#include <stdlib.h>
+#include <string.h>
+
+static KillEntry *entry_new(size_t cap) {
+    KillEntry *k = malloc(sizeof(KillEntry) + cap);
+    if (!k) return NULL;
+    k->refs = 1;
+    k->len = 0;
+    k->cap = cap;
+    k->text[0] = '\0';
+    return k;
+}
+
+KillEntry *kill_entry_ref(KillEntry *k) {
+    if (k) k->refs++;
+    return k;
+}
+
+void kill_entry_unref(KillEntry *k) {
+    if (k && --k->refs == 0) free(k);
+}
+
+void kill_ring_init(KillRing *r) {
+    memset(r, 0, sizeof(*r));
+    r->max_entries = KILL_RING_MAX;
+    r->max_bytes = KILL_RING_MAX_BYTES;
+}
+
+void kill_ring_free(KillRing *r) {
+    for (int i = 0; i < r->count; i++) kill_entry_unref(r->entries[i]);
+    free(r->entries);
+    kill_ring_init(r);
+}
+
+/* Drop the oldest entries over the limits; the newest always stays. */
+static void evict(KillRing *r) {
+    while (r->count > 1 && (r->count > r->max_entries || r->bytes > r->max_bytes)) {
+        KillEntry *old = r->entries[--r->count];
+        r->bytes -= old->len;
+        kill_entry_unref(old);
+    }
+}
+
+/* Room for `len` more bytes at the end of the newest entry */
+static KillEntry *grow_newest(KillRing *r, size_t len) {
+    KillEntry *k = r->entries[0];
+    size_t need = k->len + len + 1;
+    if (k->refs == 1 && need <= k->cap) return k;
+    /* Doubling, so a run of C-k is linear in the text killed */
+    size_t cap = need > k->cap * 2 ? need : k->cap * 2;
+    KillEntry *grown;
+    if (k->refs == 1) {
+        grown = realloc(k, sizeof(KillEntry) + cap);
+        if (!grown) return NULL;
+        grown->cap = cap;
+    } else {
+        /* Someone holds the old text: leave it as it is */
+        grown = entry_new(cap);
+        if (!grown) return NULL;
+        memcpy(grown->text, k->text, k->len + 1);
+        grown->len = k->len;
+        kill_entry_unref(k);
+    }
+    r->entries[0] = grown;
+    return grown;
+}
+
+char *kill_ring_reserve(KillRing *r, size_t len, int append) {
+    KillEntry *k;
+    if (append && r->count > 0) {
+        k = grow_newest(r, len);
+        if (!k) return NULL;
+    } else {
+        if (r->count == r->cap) {
+            int cap = r->cap ? r->cap * 2 : 16;
+            KillEntry **grown = realloc(r->entries, sizeof(KillEntry *) * cap);
+            if (!grown) return NULL;
+            r->entries = grown;
+            r->cap = cap;
+        }
+        k = entry_new(len + 1);
+        if (!k) return NULL;
+        memmove(&r->entries[1], &r->entries[0], sizeof(KillEntry *) * r->count);
+        r->entries[0] = k;
+        r->count++;
+    }
+    char *dst = k->text + k->len;
+    k->len += len;
+    k->text[k->len] = '\0';
+    r->bytes += len;
+    r->yank = 0;
+    evict(r);
+    return dst;
+}
+
+KillEntry *kill_ring_get(KillRing *r, int n) {
+    return n >= 0 && n < r->count ? r->entries[n] : NULL;
+}
+
+KillEntry *kill_ring_current(KillRing *r) {
+    return kill_ring_get(r, r->yank);
+}
+
+KillEntry *kill_ring_rotate(KillRing *r) {
+    if (r->count == 0) return NULL;
+    r->yank = (r->yank + 1) % r->count;
+    return r->entries[r->yank];
+}
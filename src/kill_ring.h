@@ -0,0 +1,52 @@
+#ifndef KILL_RING_H
+#define KILL_RING_H
+
+#include <stddef.h>
+
+#define KILL_RING_MAX       64              /* entries kept */
+#define KILL_RING_MAX_BYTES (32UL << 20)    /* text kept, the newest entry aside */
+
+/*
+ * A killed piece of text.  Entries are reference counted and never change
+ * once another holder (a script's byte view) has a reference: appending
+ * to a shared entry copies it first, so a holder keeps the text it got.
+ */
+typedef struct KillEntry {
+    int refs;
+    size_t len;
+    size_t cap;             /* bytes allocated for text, the NUL included */
+    char text[];            /* NUL-terminated */
+} KillEntry;
+
+KillEntry *kill_entry_ref(KillEntry *k);
+void kill_entry_unref(KillEntry *k);
+
+/* Newest entry first.  Older entries fall off past max_entries, or while
+ * the text exceeds max_bytes. */
+typedef struct KillRing {
+    KillEntry **entries;
+    int count;
+    int cap;
+    int yank;               /* entry C-y inserts; M-y moves it back */
+    size_t bytes;           /* text held by the entries */
+    int max_entries;
+    size_t max_bytes;
+} KillRing;
+
+void kill_ring_init(KillRing *r);
+void kill_ring_free(KillRing *r);
+/*
+ * Make room for `len` bytes of killed text and return where to write them:
+ * a new newest entry, or with `append` (consecutive kills) the end of the
+ * newest one.  The caller fills them in before any other ring call.
+ * Returns NULL if out of memory.
+ */
+char *kill_ring_reserve(KillRing *r, size_t len, int append);
+/* The entry `n` kills back, or NULL */
+KillEntry *kill_ring_get(KillRing *r, int n);
+/* The entry C-y inserts, or NULL */
+KillEntry *kill_ring_current(KillRing *r);
+/* Move the yank point one entry back (M-y), wrapping; returns the entry */
+KillEntry *kill_ring_rotate(KillRing *r);
+
+#endif /* KILL_RING_H */
@@ -0,0 +1,272 @@
+#include "lex_worker.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Lines lexed between cancellation checks and published as one piece */
+#define LEX_CHUNK 1024
+
+typedef struct LexJob {
+    unsigned long gen;
+    int cancelled;          /* under s_lock */
+    LexStateFn lex;
+    const void *lang;
+    char *text;             /* snapshot: all lines, NUL-separated */
+    char **lines;
+    int num_lines;
+    int top_line;
+    struct LexJob *next;    /* running jobs */
+} LexJob;
+
+/*
+ * Same scheme as worker.c: finished pieces are queued under s_lock and
+ * announced by a byte on the notify pipe the main loop polls.
+ */
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static LexJob *s_running;
+static LexPiece *s_done_head;
+static LexPiece *s_done_tail;
+static int s_pipe[2] = { -1, -1 };
+
+static void job_free(LexJob *job) {
+    free(job->text);
+    free(job->lines);
+    free(job);
+}
+
+static LexJob *job_new(const Buffer *buf) {
+    LexJob *job = calloc(1, sizeof(LexJob));
+    if (!job) return NULL;
+    size_t total = 0;
+    for (int i = 0; i < buf->num_lines; i++) total += strlen(buf->lines[i]) + 1;
+    job->text = malloc(total ? total : 1);
+    job->lines = malloc(sizeof(char *) * (buf->num_lines ? buf->num_lines : 1));
+    if (!job->text || !job->lines) {
+        job_free(job);
+        return NULL;
+    }
+    char *p = job->text;
+    for (int i = 0; i < buf->num_lines; i++) {
+        size_t len = strlen(buf->lines[i]) + 1;
+        memcpy(p, buf->lines[i], len);
+        job->lines[i] = p;
+        p += len;
+    }
+    job->num_lines = buf->num_lines;
+    return job;
+}
+
+static int cancelled(LexJob *job) {
+    pthread_mutex_lock(&s_lock);
+    int c = job->cancelled;
+    pthread_mutex_unlock(&s_lock);
+    return c;
+}
+
+/* Queue a copy of states[first, first + n); returns -1 if cancelled or
+ * out of memory. */
+static int publish(LexJob *job, const unsigned char *states, int first, int n,
+                   int exact, int last) {
+    LexPiece *piece = calloc(1, sizeof(LexPiece));
+    if (!piece) return -1;
+    piece->gen = job->gen;
+    piece->first = first;
+    piece->exact = exact;
+    piece->last = last;
+    if (n > 0) {
+        piece->states = malloc((size_t)n);
+        if (!piece->states) {
+            free(piece);
+            return -1;
+        }
+        memcpy(piece->states, states + first, (size_t)n);
+        piece->n = n;
+    }
+
+    pthread_mutex_lock(&s_lock);
+    int c = job->cancelled;
+    if (!c) {
+        if (s_done_tail) s_done_tail->next = piece;
+        else s_done_head = piece;
+        s_done_tail = piece;
+    }
+    pthread_mutex_unlock(&s_lock);
+    if (c) {
+        lex_piece_free(piece);
+        return -1;
+    }
+    char b = 1;
+    if (write(s_pipe[1], &b, 1) < 0) {
+        /* pipe full: the main loop already has a wakeup pending */
+    }
+    return 0;
+}
+
+/* Lex chunk c entered in `state`; returns the state leaving it. */
+static int lex_chunk(LexJob *job, unsigned char *states, int c, int state) {
+    int end = (c + 1) * LEX_CHUNK < job->num_lines ? (c + 1) * LEX_CHUNK : job->num_lines;
+    for (int i = c * LEX_CHUNK; i < end; i++) {
+        states[i] = (unsigned char)state;
+        state = job->lex(job->lang, job->lines[i], state);
+    }
+    return state;
+}
+
+/* Returns 0 once the final piece is published. */
+static int run_job(LexJob *job) {
+    int rc = -1;
+    int nchunks = (job->num_lines + LEX_CHUNK - 1) / LEX_CHUNK;
+    unsigned char *states = malloc((size_t)job->num_lines + 1);
+    int *ends = malloc(sizeof(int) * (nchunks ? nchunks : 1));
+    char *done = calloc((size_t)nchunks + 1, 1);    /* 1 lexed, 2 exactly */
+    if (!states || !ends || !done) goto out;
+
+    /* Viewport chunk first, then alternately below and above it.  A
+     * chunk whose predecessor is not done yet is entered in state 0
+     * (normal text), which is almost always right. */
+    int home = job->top_line / LEX_CHUNK;
+    if (home >= nchunks) home = nchunks - 1;
+    for (int d = 0; d <= nchunks; d++) {
+        int order[2] = { home + d, home - d - 1 };
+        for (int k = 0; k < 2; k++) {
+            int c = order[k];
+            if (c < 0 || c >= nchunks || done[c]) continue;
+            if (cancelled(job)) goto out;
+            int exact = c == 0 || done[c - 1] == 2;
+            ends[c] = lex_chunk(job, states, c, c == 0 ? 0 : done[c - 1] ? ends[c - 1] : 0);
+            done[c] = exact ? 2 : 1;
+            if (publish(job, states, c * LEX_CHUNK,
+                        (c + 1) * LEX_CHUNK < job->num_lines ? LEX_CHUNK
+                                                             : job->num_lines - c * LEX_CHUNK,
+                        exact, 0) != 0)
+                goto out;
+        }
+    }
+
+    /* Fix the guesses in file order; a re-lexed chunk ends early once
+     * it reaches a line already entered in the right state */
+    for (int c = 1; c < nchunks; c++) {
+        int first = c * LEX_CHUNK;
+        if (states[first] == ends[c - 1]) continue;
+        if (cancelled(job)) goto out;
+        int end = first + LEX_CHUNK < job->num_lines ? first + LEX_CHUNK : job->num_lines;
+        int state = ends[c - 1];
+        int i = first;
+        for (; i < end && !(i > first && states[i] == state); i++) {
+            states[i] = (unsigned char)state;
+            state = job->lex(job->lang, job->lines[i], state);
+        }
+        if (i == end) ends[c] = state;
+        if (publish(job, states, first, i - first, 1, 0) != 0) goto out;
+    }
+    rc = publish(job, states, 0, 0, 1, 1);
+
+out:
+    free(states);
+    free(ends);
+    free(done);
+    return rc;
+}
+
+static void *lex_main(void *arg) {
+    LexJob *job = arg;
+    trace_thread_name("lex");
+    TRACE_BEGIN("lex_job");
+    /* A job that gave up still says it is finished, with exact = 0 */
+    if (run_job(job) != 0 && !cancelled(job)) publish(job, NULL, 0, 0, 0, 1);
+    TRACE_END_N("lex_job", job->num_lines);
+
+    pthread_mutex_lock(&s_lock);
+    for (LexJob **pp = &s_running; *pp; pp = &(*pp)->next) {
+        if (*pp == job) {
+            *pp = job->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_lock);
+    job_free(job);
+    return NULL;
+}
+
+int lex_worker_start(unsigned long gen, const Buffer *buf, int top_line,
+                     LexStateFn lex, const void *lang) {
+    if (s_pipe[0] < 0) {
+        if (pipe(s_pipe) != 0) return -1;
+        for (int i = 0; i < 2; i++) {
+            fcntl(s_pipe[i], F_SETFL, fcntl(s_pipe[i], F_GETFL) | O_NONBLOCK);
+            fcntl(s_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    LexJob *job = job_new(buf);
+    if (!job) return -1;
+    job->gen = gen;
+    job->lex = lex;
+    job->lang = lang;
+    job->top_line = top_line;
+
+    pthread_mutex_lock(&s_lock);
+    job->next = s_running;
+    s_running = job;
+    pthread_mutex_unlock(&s_lock);
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&tid, &attr, lex_main, job);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        pthread_mutex_lock(&s_lock);
+        s_running = job->next;
+        pthread_mutex_unlock(&s_lock);
+        job_free(job);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stop the job for `gen` at its next chunk; nothing more is published. */
+void lex_worker_cancel(unsigned long gen) {
+    pthread_mutex_lock(&s_lock);
+    for (LexJob *job = s_running; job; job = job->next)
+        if (job->gen == gen) job->cancelled = 1;
+    pthread_mutex_unlock(&s_lock);
+}
+
+/* Pop one published piece (NULL if none), draining the notify pipe. */
+LexPiece *lex_worker_take(void) {
+    char drain[64];
+    while (s_pipe[0] >= 0 && read(s_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+    pthread_mutex_lock(&s_lock);
+    LexPiece *piece = s_done_head;
+    if (piece) {
+        s_done_head = piece->next;
+        if (!s_done_head) s_done_tail = NULL;
+        piece->next = NULL;
+    }
+    pthread_mutex_unlock(&s_lock);
+    return piece;
+}
+
+void lex_piece_free(LexPiece *piece) {
+    if (!piece) return;
+    free(piece->states);
+    free(piece);
+}
+
+int lex_worker_notify_fd(void) {
+    return s_pipe[0];
+}
+
+/* Jobs running or pieces not yet taken. */
+int lex_worker_pending(void) {
+    pthread_mutex_lock(&s_lock);
+    int n = (s_running != NULL) + (s_done_head != NULL);
+    pthread_mutex_unlock(&s_lock);
+    return n;
+}
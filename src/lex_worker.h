@@ -0,0 +1,38 @@
+#ifndef LEX_WORKER_H
+#define LEX_WORKER_H
+
+#include "buffer.h"
+
+/*
+ * Background lexing for syntax.c.  A job lexes a snapshot of a buffer on
+ * its own thread, computing the lexer state at the start of every line.
+ * It starts with the chunk of lines around the viewport and spreads
+ * outward, guessing the state entering each chunk whose predecessor is
+ * not done yet, then corrects wrong guesses in one pass in file order.
+ * Results come back in pieces tagged with the generation the snapshot
+ * was taken at, so the owner can drop pieces made stale by an edit.
+ */
+
+/* Lexer state at the end of `line` entered in `state` */
+typedef int (*LexStateFn)(const void *lang, const char *line, int state);
+
+typedef struct LexPiece {
+    unsigned long gen;
+    int first;              /* start states of lines first .. first + n - 1 */
+    int n;
+    unsigned char *states;
+    int exact;              /* states do not rest on a guess */
+    int last;               /* the job is finished; with exact, all states
+                             * it published are exact */
+    struct LexPiece *next;
+} LexPiece;
+
+int  lex_worker_start(unsigned long gen, const Buffer *buf, int top_line,
+                      LexStateFn lex, const void *lang);
+void lex_worker_cancel(unsigned long gen);
+LexPiece *lex_worker_take(void);
+void lex_piece_free(LexPiece *piece);
+int  lex_worker_notify_fd(void);
+int  lex_worker_pending(void);
+
+#endif /* LEX_WORKER_H */
@@ -0,0 +1,205 @@
+#include "loop_guard.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A single pass over the tokens.  Strings, comments and regular
+ * expression literals are copied through untouched; brackets are kept on
+ * a stack so the guard is closed at the parenthesis that ends the loop
+ * header.  A '/' starts a regular expression unless it follows a value
+ * (a name, number, string or closing bracket), as in the JS grammar.
+ */
+enum { FRAME_PLAIN, FRAME_WHILE, FRAME_FOR };
+
+typedef struct Frame {
+    int kind;
+    int semis;              /* for: ';' seen at this level */
+    int cond_used;          /* for: tokens after the first ';' */
+    size_t cond_at;         /* where the condition starts in the output */
+} Frame;
+
+typedef struct Out {
+    char *s;
+    size_t len;
+    size_t cap;
+    int oom;
+} Out;
+
+static void out_reserve(Out *o, size_t n) {
+    if (o->oom || o->len + n + 1 <= o->cap) return;
+    size_t cap = o->cap * 2 > o->len + n + 1 ? o->cap * 2 : o->len + n + 1;
+    char *s = realloc(o->s, cap);
+    if (!s) { o->oom = 1; return; }
+    o->s = s;
+    o->cap = cap;
+}
+
+static void out_put(Out *o, const char *p, size_t n) {
+    out_reserve(o, n);
+    if (o->oom) return;
+    memcpy(o->s + o->len, p, n);
+    o->len += n;
+}
+
+static void out_insert(Out *o, size_t at, const char *p) {
+    size_t n = strlen(p);
+    out_reserve(o, n);
+    if (o->oom) return;
+    memmove(o->s + at + n, o->s + at, o->len - at);
+    memcpy(o->s + at, p, n);
+    o->len += n;
+}
+
+static int is_ident(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_' || c == '$' || c == '\\' || c >= 0x80;
+}
+
+/* Keywords after which an expression, so possibly a regexp, follows */
+static int expects_operand(const char *w, size_t n) {
+    static const char *const kw[] = {
+        "return", "typeof", "instanceof", "in", "new", "delete", "void",
+        "throw", "case", "do", "else", NULL
+    };
+    for (int i = 0; kw[i]; i++)
+        if (strlen(kw[i]) == n && memcmp(kw[i], w, n) == 0) return 1;
+    return 0;
+}
+
+/* End of the string, comment or regexp starting at i */
+static size_t skip_quoted(const char *s, size_t len, size_t i) {
+    char q = s[i++];
+    while (i < len && s[i] != q && s[i] != '\n') i += s[i] == '\\' ? 2 : 1;
+    return i < len ? i + 1 : len;
+}
+
+static size_t skip_regexp(const char *s, size_t len, size_t i) {
+    int in_class = 0;
+    for (i++; i < len && s[i] != '\n'; i++) {
+        if (s[i] == '\\') i++;
+        else if (s[i] == '[') in_class = 1;
+        else if (s[i] == ']') in_class = 0;
+        else if (s[i] == '/' && !in_class) return i + 1;
+    }
+    return i < len ? i : len;
+}
+
+char *loop_guard_source(const char *src, size_t len, size_t *out_len) {
+    Out o = { NULL, 0, 0, 0 };
+    Frame *stack = NULL;
+    int depth = 0, stack_cap = 0;
+    int pending = FRAME_PLAIN;  /* 'while'/'for' seen, waiting for '(' */
+    int after_value = 0;        /* a '/' here divides */
+    int after_dot = 0;          /* obj.while is a property, not a loop */
+    out_reserve(&o, len + len / 8 + 64);
+
+    size_t i = 0;
+    while (i < len && !o.oom) {
+        unsigned char c = (unsigned char)src[i];
+        size_t start = i;
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v') {
+            out_put(&o, src + i++, 1);
+            continue;
+        }
+        if (c == '/' && i + 1 < len && (src[i + 1] == '/' || src[i + 1] == '*')) {
+            if (src[i + 1] == '/') {
+                while (i < len && src[i] != '\n') i++;
+            } else {
+                const char *end = NULL;
+                for (size_t j = i + 2; j + 1 < len; j++)
+                    if (src[j] == '*' && src[j + 1] == '/') { end = src + j + 2; break; }
+                i = end ? (size_t)(end - src) : len;
+            }
+            out_put(&o, src + start, i - start);
+            continue;
+        }
+
+        /* Any other token counts toward a for(;;) condition */
+        Frame *top = depth > 0 ? &stack[depth - 1] : NULL;
+        if (top && top->kind == FRAME_FOR && top->semis == 1 && c != ';')
+            top->cond_used = 1;
+
+        if (c == '\'' || c == '"' || (c == '/' && !after_value)) {
+            i = c == '/' ? skip_regexp(src, len, i) : skip_quoted(src, len, i);
+            out_put(&o, src + start, i - start);
+            pending = FRAME_PLAIN;
+            after_value = 1;
+            after_dot = 0;
+            continue;
+        }
+        if (is_ident(c)) {
+            while (i < len && is_ident((unsigned char)src[i])) i += src[i] == '\\' ? 2 : 1;
+            if (i > len) i = len;
+            size_t n = i - start;
+            int num = c >= '0' && c <= '9';
+            pending = FRAME_PLAIN;
+            if (!num && !after_dot && n == 5 && memcmp(src + start, "while", 5) == 0)
+                pending = FRAME_WHILE;
+            else if (!num && !after_dot && n == 3 && memcmp(src + start, "for", 3) == 0)
+                pending = FRAME_FOR;
+            after_value = num || !expects_operand(src + start, n);
+            after_dot = 0;
+            out_put(&o, src + start, n);
+            continue;
+        }
+
+        i++;
+        if (c == '(' || c == '[' || c == '{') {
+            if (depth == stack_cap) {
+                int cap = stack_cap ? stack_cap * 2 : 16;
+                Frame *tmp = realloc(stack, sizeof(Frame) * cap);
+                if (!tmp) { o.oom = 1; break; }
+                stack = tmp;
+                stack_cap = cap;
+            }
+            out_put(&o, src + start, 1);
+            Frame *f = &stack[depth++];
+            f->kind = c == '(' ? pending : FRAME_PLAIN;
+            f->semis = 0;
+            f->cond_used = 0;
+            f->cond_at = o.len;
+        } else if (c == ')' || c == ']' || c == '}') {
+            if (depth > 0) {
+                Frame *f = &stack[--depth];
+                if (f->kind == FRAME_WHILE && f->cond_at < o.len) {
+                    out_insert(&o, f->cond_at, LOOP_GUARD_FN "() && (");
+                    out_put(&o, ")", 1);
+                }
+            }
+            out_put(&o, src + start, 1);
+        } else if (c == ';' && top && top->kind == FRAME_FOR && top->semis < 2) {
+            if (++top->semis == 1) {
+                out_put(&o, ";", 1);
+                top->cond_at = o.len;
+            } else {
+                if (top->cond_used) {
+                    out_insert(&o, top->cond_at, " " LOOP_GUARD_FN "() && (");
+                    out_put(&o, ")", 1);
+                } else {
+                    out_insert(&o, top->cond_at, " " LOOP_GUARD_FN "()");
+                }
+                out_put(&o, ";", 1);
+            }
+        } else {
+            out_put(&o, src + start, 1);
+        }
+        pending = FRAME_PLAIN;
+        after_value = c == ')' || c == ']' || c == '}';
+        after_dot = c == '.';
+    }
+
+    free(stack);
+    if (o.oom) {
+        free(o.s);
+        return NULL;
+    }
+    out_reserve(&o, 0);
+    if (o.oom) {
+        free(o.s);
+        return NULL;
+    }
+    o.s[o.len] = '\0';
+    *out_len = o.len;
+    return o.s;
+}
@@ -0,0 +1,27 @@
+#ifndef LOOP_GUARD_H
+#define LOOP_GUARD_H
+
+#include <stddef.h>
+
+/*
+ * Loop guards.  The system Duktape is built without
+ * DUK_USE_EXEC_TIMEOUT_CHECK, so a loop that never calls a C function
+ * cannot be stopped from outside.  Scripts are therefore rewritten before
+ * they are compiled so that every while, do-while and for(;;) condition
+ * calls LOOP_GUARD_FN first:
+ *
+ *     while (x)         ->  while (__loopGuard() && (x))
+ *     for (i = 0;; i++) ->  for (i = 0; __loopGuard(); i++)
+ *
+ * The guard returns true, or throws once the eval is out of budget.  Only
+ * tokens are added, inside the line they belong to, so line numbers in
+ * error messages still match the source.  for-in loops are finite and
+ * left alone; code built at run time (eval, new Function) is not guarded.
+ */
+#define LOOP_GUARD_FN "__loopGuard"
+
+/* Rewrite `src` (`len` bytes) as above into a malloc'd, NUL-terminated
+ * copy of `*out_len` bytes.  Returns NULL if out of memory. */
+char *loop_guard_source(const char *src, size_t len, size_t *out_len);
+
+#endif /* LOOP_GUARD_H */
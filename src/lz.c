@@ -0,0 +1,128 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A block is a run of sequences.  Each is a token byte (literal count in
+ * the high nibble, match length - 4 in the low one, 15 meaning more
+ * length bytes follow, each adding up to 255), the literals, then a
+ * 2-byte little-endian match offset.  The last sequence stops after its
+ * literals.
+ */
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS  13
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lz_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+/* The part of a length past the token's 15 */
+static unsigned char *put_length(unsigned char *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* One sequence: `lit_len` literals, then a match unless match_len is 0 */
+static unsigned char *emit(unsigned char *op, const unsigned char *lit, size_t lit_len,
+                           size_t offset, size_t match_len) {
+    size_t m = match_len ? match_len - LZ_MIN_MATCH : 0;
+    *op++ = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15));
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len) {
+        *op++ = (unsigned char)(offset & 0xff);
+        *op++ = (unsigned char)(offset >> 8);
+        if (m >= 15) op = put_length(op, m - 15);
+    }
+    return op;
+}
+
+size_t lz_compress(const char *src, size_t n, char *dst) {
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base, *anchor = base, *end = base + n;
+    unsigned char *op = (unsigned char *)dst;
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    while ((size_t)(end - ip) >= LZ_MIN_MATCH) {
+        uint32_t seq = read32(ip);
+        uint32_t *slot = &table[hash4(seq)];
+        const unsigned char *ref = base + *slot;
+        *slot = (uint32_t)(ip - base);
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+            /* Step faster through text that does not compress */
+            size_t step = 1 + ((size_t)(ip - anchor) >> 6);
+            if (step >= (size_t)(end - ip)) break;
+            ip += step;
+            continue;
+        }
+        size_t offset = (size_t)(ip - ref);
+        const unsigned char *m = ip + LZ_MIN_MATCH;
+        ref += LZ_MIN_MATCH;
+        while (m < end && *m == *ref) {
+            m++;
+            ref++;
+        }
+        op = emit(op, anchor, (size_t)(ip - anchor), offset, (size_t)(m - ip));
+        ip = anchor = m;
+    }
+    op = emit(op, anchor, (size_t)(end - anchor), 0, 0);
+    return (size_t)(op - (unsigned char *)dst);
+}
+
+static int get_length(const unsigned char **ip, const unsigned char *end, size_t *len) {
+    unsigned b;
+    do {
+        if (*ip >= end) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const char *src, size_t n, char *dst, size_t out_n) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+    unsigned char *out = (unsigned char *)dst, *op = out, *oend = out + out_n;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, iend, &lit) != 0) return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && get_length(&ip, iend, &len) != 0) return -1;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || len > (size_t)(oend - op))
+            return -1;
+        const unsigned char *ref = op - offset;
+        if (offset >= len) {
+            memcpy(op, ref, len);
+            op += len;
+        } else {
+            /* Overlapping: a run repeating the last `offset` bytes */
+            while (len--) *op++ = *ref++;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
@@ -0,0 +1,21 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/*
+ * A small LZ77 block codec in the style of LZ4: one pass with a hash of
+ * 4-byte sequences, 64 KiB window, byte-aligned output.  Fast in both
+ * directions rather than tight; text typically packs to a quarter to a half.
+ */
+
+/* Largest output lz_compress() can produce for `n` input bytes */
+size_t lz_bound(size_t n);
+/* Compress src[0..n) into dst (at least lz_bound(n) bytes); returns the
+ * compressed size. */
+size_t lz_compress(const char *src, size_t n, char *dst);
+/* Decompress src[0..n) into dst, which must take exactly `out_n` bytes.
+ * Returns 0, or -1 if the input is corrupt. */
+int lz_decompress(const char *src, size_t n, char *dst, size_t out_n);
+
+#endif /* LZ_H */
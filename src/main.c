@@ -4,11 +4,16 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <locale.h>
 
 #include "editor.h"
 #include "ui.h"
 #include "keys.h"
 #include "shell_buf.h"
+#include "file_watch.h"
+#include "headless.h"
+#include "stats.h"
+#include "trace.h"
 
 static void handle_sigwinch(int sig) {
     (void)sig;
@@ -22,7 +27,49 @@ static void handle_sigchld(int sig) {
     while (waitpid(-1, &status, WNOHANG) > 0);
 }
 
-int main(void) {
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--record KEYLOG]\n"
+            "       %s --headless --replay KEYLOG [--size COLSxROWS] [--realtime] [--json]\n",
+            prog, prog);
+}
+
+int main(int argc, char **argv) {
+    HeadlessOptions hl = { NULL, 80, 24, 0, 0 };
+    int headless = 0;
+    const char *record = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (strcmp(a, "--headless") == 0) {
+            headless = 1;
+        } else if (strcmp(a, "--realtime") == 0) {
+            hl.realtime = 1;
+        } else if (strcmp(a, "--json") == 0) {
+            hl.json = 1;
+        } else if (strcmp(a, "--replay") == 0 && i + 1 < argc) {
+            hl.replay = argv[++i];
+        } else if (strcmp(a, "--record") == 0 && i + 1 < argc) {
+            record = argv[++i];
+        } else if (strcmp(a, "--size") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%dx%d", &hl.cols, &hl.rows) == 2 &&
+                   hl.cols > 0 && hl.rows > 2) {
+            i++;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (headless != (hl.replay != NULL) || (headless && record)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE *keylog = NULL;
+    if (record && !(keylog = fopen(record, "w"))) {
+        perror(record);
+        return 1;
+    }
+
     /* Set up signals */
     signal(SIGWINCH, handle_sigwinch);
     signal(SIGCHLD,  handle_sigchld);
@@ -36,6 +83,18 @@ int main(void) {
     }
     g_editor = e;
 
+    const char *trace_env = getenv(TRACE_ENV);
+    if (trace_env && *trace_env) trace_start();
+
+    /* UTF-8 output and wcwidth() follow the user's locale */
+    setlocale(LC_ALL, "");
+
+    int status = 0;
+    if (headless) {
+        status = headless_run(e, &hl);
+        goto done;
+    }
+
     /* Initialize UI */
     ui_init(e);
 
@@ -43,17 +102,37 @@ int main(void) {
     while (e->running) {
         /* Poll shell buffers and refresh */
         ui_refresh(e);
+        if (e->first_frame_ms == 0) e->first_frame_ms = editor_elapsed_ms(e);
 
         int key = ui_get_key(e);
         if (key == ERR) {
             /* Timeout or only shell data received; loop again */
+            file_watch_tick(e);
+            /* Idle: bring up scripting now that the first frame is out */
+            if (!e->js_ctx) editor_script_ctx(e);
+            /* Compress a buffer nobody has looked at for a while */
+            if (e->pack_delay_secs > 0) editor_pack_buffers(e, e->pack_delay_secs * 1e3, 1);
             continue;
         }
 
+        if (keylog) keylog_write(keylog, editor_elapsed_ms(e), key);
+        long start = stats_now_ns();
+        TRACE_BEGIN("handle_key");
         handle_key(e, key);
+        TRACE_END_N("handle_key", key);
+        stats_record(STAT_KEY, stats_now_ns() - start);
     }
 
     ui_cleanup();
+    if (keylog) fclose(keylog);
+
+done:
+    if (TRACE_ON()) {
+        const char *path = trace_default_path();
+        int n = trace_stop(path);
+        if (n < 0) fprintf(stderr, "Cannot write trace to %s\n", path);
+        else fprintf(stderr, "Wrote %d trace events to %s\n", n, path);
+    }
 
     /* Kill any shell children */
     for (int i = 0; i < e->num_buffers; i++) {
@@ -63,5 +142,6 @@ int main(void) {
     }
 
     editor_destroy(e);
-    return 0;
+    keys_shutdown();
+    return status;
 }
@@ -1,17 +1,267 @@
 #include "script.h"
 #include "editor.h"
 #include "buffer.h"
+#include "worker.h"
+#include "ui.h"
+#include "keys.h"
+#include "stats.h"
+#include "trace.h"
+#include "loop_guard.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * The editor owning the scripting heap.  Kept in a static rather than the
+ * global stash so a binding call does not pay for a property lookup.
+ */
+static Editor *s_editor;
 
-/* Helper to get editor from JS context */
 static Editor *get_editor(duk_context *ctx) {
+    (void)ctx;
+    return s_editor;
+}
+
+/*
+ * Execution budget.  Each top-level eval gets e->js_time_limit_ms of wall
+ * time and can be interrupted with C-g.  The budget is checked on every
+ * editor.* call and, through the loop guards (loop_guard.h), on every
+ * loop iteration, which also stops loops that never call into the
+ * editor.  A Duktape built with DUK_USE_EXEC_TIMEOUT_CHECK(udata) =
+ * script_exec_timeout_check(udata) checks it from the bytecode executor
+ * as well.  Once tripped it stays tripped until the eval ends, so scripts
+ * cannot catch the error and carry on.
+ */
+#define KEY_POLL_INTERVAL_NS 10000000L  /* look for C-g every 10 ms */
+#define GUARD_CHECK_MASK     255        /* loop iterations between checks */
+
+typedef struct GenSnapshot {
+    Buffer *buf;            /* NULL once the buffer is killed */
+    unsigned long gen;
+} GenSnapshot;
+
+static int s_budget_depth;
+static struct timespec s_budget_start;
+static struct timespec s_last_key_poll;
+static const char *s_interrupted;       /* reason, NULL while running */
+static GenSnapshot *s_gen_snap;
+static int s_gen_snap_count;
+
+static long elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (long)(to->tv_sec - from->tv_sec) * 1000000000L +
+           (to->tv_nsec - from->tv_nsec);
+}
+
+static int budget_exceeded(void) {
+    if (s_budget_depth == 0) return 0;
+    if (s_interrupted) return 1;
+
+    Editor *e = s_editor;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long limit_ms = e ? e->js_time_limit_ms : 0;
+    if (limit_ms > 0 && elapsed_ns(&s_budget_start, &now) / 1000000L >= limit_ms) {
+        s_interrupted = "time limit exceeded";
+    } else if (elapsed_ns(&s_last_key_poll, &now) >= KEY_POLL_INTERVAL_NS) {
+        s_last_key_poll = now;
+        if (e && ui_interrupt_pending(e)) s_interrupted = "interrupted by C-g";
+    }
+    return s_interrupted != NULL;
+}
+
+duk_bool_t script_exec_timeout_check(void *udata) {
+    /* Worker heaps carry their job as udata, the editor's heap none */
+    return udata ? worker_budget_exceeded(udata) : budget_exceeded();
+}
+
+/* Throw if the running eval is out of budget. */
+static void budget_check(duk_context *ctx) {
+    if (budget_exceeded())
+        (void)duk_error(ctx, DUK_ERR_RANGE_ERROR, "script %s", s_interrupted);
+}
+
+/* __loopGuard() -- called by every loop condition of a guarded script */
+static duk_ret_t js_loop_guard(duk_context *ctx) {
+    static unsigned s_guard_calls;
+    if ((++s_guard_calls & GUARD_CHECK_MASK) == 0 || s_interrupted) budget_check(ctx);
+    duk_push_true(ctx);
+    return 1;
+}
+
+/* Compile-and-run `code` with its loops guarded; like duk_peval_lstring() */
+static duk_int_t peval_guarded(duk_context *ctx, const char *code, size_t len) {
+    size_t glen;
+    char *guarded = loop_guard_source(code, len, &glen);
+    if (!guarded) {
+        duk_push_string(ctx, "out of memory");
+        return DUK_EXEC_ERROR;
+    }
+    duk_int_t rc = duk_peval_lstring(ctx, guarded, glen);
+    free(guarded);
+    return rc;
+}
+
+/* Start the budget for a top-level eval; nested evals share it. */
+static void budget_begin(void) {
+    if (s_budget_depth++ > 0) return;
+    TRACE_BEGIN("script_eval");
+    clock_gettime(CLOCK_MONOTONIC, &s_budget_start);
+    s_last_key_poll = s_budget_start;
+    s_interrupted = NULL;
+
+    /* Remember each buffer's generation to report partial edits */
+    Editor *e = s_editor;
+    s_gen_snap_count = 0;
+    if (!e) return;
+    GenSnapshot *tmp = realloc(s_gen_snap, sizeof(GenSnapshot) * (e->num_buffers + 1));
+    if (!tmp) return;
+    s_gen_snap = tmp;
+    for (int i = 0; i < e->num_buffers; i++) {
+        s_gen_snap[s_gen_snap_count].buf = e->buffers[i];
+        s_gen_snap[s_gen_snap_count++].gen = e->buffers[i]->change_gen;
+    }
+}
+
+/*
+ * End the budget.  If the eval was cut short, overwrite `result` with the
+ * reason and the buffers it had already edited: edits are not rolled back.
+ */
+static void budget_end(char *result, int result_len) {
+    if (--s_budget_depth > 0) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stats_record(STAT_JS_EVAL, elapsed_ns(&s_budget_start, &now));
+    TRACE_END("script_eval");
+    if (!s_interrupted) return;
+    if (!result) return;
+    int n = snprintf(result, result_len, "Script %s; edited:", s_interrupted);
+    int edited = 0;
+    for (int i = 0; i < s_gen_snap_count && n < result_len; i++) {
+        Buffer *b = s_gen_snap[i].buf;
+        if (!b || b->change_gen == s_gen_snap[i].gen) continue;
+        n += snprintf(result + n, result_len - n, "%s %s", edited ? "," : "", b->name);
+        edited++;
+    }
+    if (!edited && n < result_len) snprintf(result + n, result_len - n, " none");
+}
+
+/*
+ * Zero-copy byte views.  lineBytes()/regionBytes() hand out Uint8Arrays
+ * over Duktape external buffers that point straight into a line's storage.
+ * Such a view is only valid while its buffer is unchanged: any edit made
+ * through editor.* detaches every view of that buffer (its length drops
+ * to 0, so reads yield undefined), and all views are detached when the
+ * eval that created them returns.  Inside editor.batch() change_gen only
+ * moves at commit, so there every edit detaches the buffer's views.
+ * Views are meant to be read; writing
+ * through one edits the line in place without any bookkeeping.
+ * killBytes() views hold a reference to their kill ring entry instead,
+ * which no later kill changes, so only the end of the eval detaches them.
+ */
+typedef struct ByteView {
+    Buffer *buf;            /* NULL for a kill ring view */
+    unsigned long gen;
+    KillEntry *kill;
+} ByteView;
+
+static ByteView *s_views;
+static int s_num_views;
+static int s_views_cap;
+
+/* Buffers with an editor.batch() running, innermost first */
+typedef struct BatchFrame {
+    Buffer *buf;            /* NULL once the buffer is killed */
+    struct BatchFrame *up;
+} BatchFrame;
+
+static BatchFrame *s_batches;
+
+/* Push the stash array stored under `key`, creating it if needed. */
+static void push_stash_array(duk_context *ctx, const char *key) {
     duk_push_global_stash(ctx);
-    duk_get_prop_string(ctx, -1, "editor_ptr");
-    Editor *e = (Editor *)duk_get_pointer(ctx, -1);
-    duk_pop_2(ctx);
-    return e;
+    if (!duk_get_prop_string(ctx, -1, key)) {
+        duk_pop(ctx);
+        duk_push_array(ctx);
+        duk_dup(ctx, -1);
+        duk_put_prop_string(ctx, -3, key);
+    }
+    duk_remove(ctx, -2);
+}
+
+/* Detach every view of `buf` if it is `gone`, else only the stale ones;
+ * with `all`, every view there is. */
+static void views_detach(duk_context *ctx, Buffer *buf, int all, int gone) {
+    if (s_num_views == 0) return;
+    push_stash_array(ctx, "views");
+    int kept = 0;
+    for (int i = 0; i < s_num_views; i++) {
+        ByteView *v = &s_views[i];
+        int stale = all || (v->buf && v->buf == buf &&
+                            (gone || buf->change_gen != v->gen || buf->batch_depth > 0));
+        duk_get_prop_index(ctx, -1, (duk_uarridx_t)i);
+        if (stale) {
+            duk_config_buffer(ctx, -1, NULL, 0);
+            duk_pop(ctx);
+            kill_entry_unref(v->kill);
+        } else {
+            duk_put_prop_index(ctx, -2, (duk_uarridx_t)kept);
+            s_views[kept++] = *v;
+        }
+    }
+    duk_push_int(ctx, kept);
+    duk_put_prop_string(ctx, -2, "length");
+    duk_pop(ctx);
+    s_num_views = kept;
+}
+
+/* Detach views of `buf` that are stale (all views with `all`). */
+static void views_invalidate(duk_context *ctx, Buffer *buf, int all) {
+    views_detach(ctx, buf, all, 0);
+}
+
+/*
+ * Called before a buffer is destroyed: detach its views and forget it in
+ * any running batch and in the eval's edit report, so nothing here
+ * touches it afterwards.
+ */
+void script_buffer_killed(Editor *e, Buffer *buf) {
+    for (int i = 0; i < s_gen_snap_count; i++)
+        if (s_gen_snap[i].buf == buf) s_gen_snap[i].buf = NULL;
+    for (BatchFrame *f = s_batches; f; f = f->up)
+        if (f->buf == buf) f->buf = NULL;
+    if (e->js_ctx) views_detach(e->js_ctx, buf, 0, 1);
+}
+
+/* Push a Uint8Array over [data, data + len) of `buf`'s storage (or of a
+ * kill ring entry when buf is NULL; the caller sets its reference). */
+static void push_view(duk_context *ctx, Buffer *buf, char *data, size_t len) {
+    if (s_num_views == s_views_cap) {
+        int new_cap = s_views_cap ? s_views_cap * 2 : 16;
+        ByteView *tmp = realloc(s_views, sizeof(ByteView) * new_cap);
+        if (!tmp) { duk_error(ctx, DUK_ERR_ERROR, "out of memory"); return; }
+        s_views = tmp;
+        s_views_cap = new_cap;
+    }
+    duk_push_external_buffer(ctx);
+    duk_config_buffer(ctx, -1, data, len);
+
+    push_stash_array(ctx, "views");
+    duk_dup(ctx, -2);
+    duk_put_prop_index(ctx, -2, (duk_uarridx_t)s_num_views);
+    duk_pop(ctx);
+    s_views[s_num_views].buf = buf;
+    s_views[s_num_views].gen = buf ? buf->change_gen : 0;
+    s_views[s_num_views].kill = NULL;
+    s_num_views++;
+
+    duk_push_buffer_object(ctx, -1, 0, len, DUK_BUFOBJ_UINT8ARRAY);
+    duk_remove(ctx, -2);
 }
 
 /* editor.message(str) */
@@ -43,6 +293,97 @@ static duk_ret_t js_list_buffers(duk_context *ctx) {
     return 1;
 }
 
+/*
+ * editor.stats() -- the M-x editor-stats counters as an object:
+ * { timers: { key: { count, mean, p50, p90, p99, max, total }, frame,
+ * search, replace, js }, buffers: [{ name, lines, allocs, ptyBytes }],
+ * allocs, ptyBytes }.  Durations are in microseconds except total (ms);
+ * the top-level totals include killed buffers.  The js timer does not
+ * yet count the eval that is calling.
+ */
+static duk_ret_t js_stats(duk_context *ctx) {
+    Editor *e = get_editor(ctx);
+    duk_push_object(ctx);
+    duk_push_object(ctx);
+    for (int t = 0; t < STAT_NUM_TIMERS; t++) {
+        StatSummary st;
+        stats_summary(t, &st);
+        duk_push_object(ctx);
+        duk_push_number(ctx, (double)st.count);
+        duk_put_prop_string(ctx, -2, "count");
+        duk_push_number(ctx, st.mean_us);
+        duk_put_prop_string(ctx, -2, "mean");
+        duk_push_number(ctx, st.p50_us);
+        duk_put_prop_string(ctx, -2, "p50");
+        duk_push_number(ctx, st.p90_us);
+        duk_put_prop_string(ctx, -2, "p90");
+        duk_push_number(ctx, st.p99_us);
+        duk_put_prop_string(ctx, -2, "p99");
+        duk_push_number(ctx, st.max_us);
+        duk_put_prop_string(ctx, -2, "max");
+        duk_push_number(ctx, st.total_ms);
+        duk_put_prop_string(ctx, -2, "total");
+        duk_put_prop_string(ctx, -2, stats_timer_name(t));
+    }
+    duk_put_prop_string(ctx, -2, "timers");
+
+    unsigned long long allocs = stats_retired_allocs();
+    duk_push_array(ctx);
+    for (int i = 0; e && i < e->num_buffers; i++) {
+        Buffer *b = e->buffers[i];
+        allocs += b->allocs;
+        duk_push_object(ctx);
+        duk_push_string(ctx, b->name);
+        duk_put_prop_string(ctx, -2, "name");
+        duk_push_int(ctx, b->num_lines);
+        duk_put_prop_string(ctx, -2, "lines");
+        duk_push_number(ctx, (double)b->allocs);
+        duk_put_prop_string(ctx, -2, "allocs");
+        duk_push_number(ctx, (double)b->pty_bytes);
+        duk_put_prop_string(ctx, -2, "ptyBytes");
+        duk_put_prop_index(ctx, -2, (duk_uarridx_t)i);
+    }
+    duk_put_prop_string(ctx, -2, "buffers");
+    duk_push_number(ctx, (double)allocs);
+    duk_put_prop_string(ctx, -2, "allocs");
+    duk_push_number(ctx, (double)stats_pty_bytes());
+    duk_put_prop_string(ctx, -2, "ptyBytes");
+    return 1;
+}
+
+/*
+ * editor.bufferStats([name]) -- memory of a buffer (default: current):
+ * { lines, textBytes, lineArrayBytes, overheadBytes, packedBytes, totalBytes,
+ * allocs, ptyBytes }, or undefined if there is no such buffer.  A packed
+ * buffer named here stays packed.
+ */
+static duk_ret_t js_buffer_stats(duk_context *ctx) {
+    Editor *e = get_editor(ctx);
+    const char *name = duk_opt_string(ctx, 0, NULL);
+    Buffer *buf = !e ? NULL : name ? editor_find_buffer(e, name) : editor_current_buffer(e);
+    if (!buf) return 0;
+    BufferMemStats st;
+    buffer_mem_stats(buf, &st);
+    duk_push_object(ctx);
+    duk_push_int(ctx, buf->num_lines);
+    duk_put_prop_string(ctx, -2, "lines");
+    duk_push_number(ctx, (double)st.text);
+    duk_put_prop_string(ctx, -2, "textBytes");
+    duk_push_number(ctx, (double)st.line_array);
+    duk_put_prop_string(ctx, -2, "lineArrayBytes");
+    duk_push_number(ctx, (double)st.overhead);
+    duk_put_prop_string(ctx, -2, "overheadBytes");
+    duk_push_number(ctx, (double)st.packed);
+    duk_put_prop_string(ctx, -2, "packedBytes");
+    duk_push_number(ctx, (double)st.total);
+    duk_put_prop_string(ctx, -2, "totalBytes");
+    duk_push_number(ctx, (double)buf->allocs);
+    duk_put_prop_string(ctx, -2, "allocs");
+    duk_push_number(ctx, (double)buf->pty_bytes);
+    duk_put_prop_string(ctx, -2, "ptyBytes");
+    return 1;
+}
+
 /* editor.switchBuffer(name) */
 static duk_ret_t js_switch_buffer(duk_context *ctx) {
     const char *name = duk_require_string(ctx, 0);
@@ -61,17 +402,246 @@ static duk_ret_t js_new_buffer(duk_context *ctx) {
 
 /* editor.insertText(str) */
 static duk_ret_t js_insert_text(duk_context *ctx) {
-    const char *str = duk_require_string(ctx, 0);
+    duk_size_t len;
+    const char *str = duk_require_lstring(ctx, 0, &len);
     Editor *e = get_editor(ctx);
     if (!e) return 0;
     Buffer *buf = editor_current_buffer(e);
     if (!buf) return 0;
-    for (const char *p = str; *p; p++) {
-        buffer_insert_char(buf, *p);
+    buffer_insert_text(buf, str, len);
+    views_invalidate(ctx, buf, 0);
+    return 0;
+}
+
+/*
+ * editor.batch(fn) -- run fn as one edit transaction on the current
+ * buffer.  Its edits are folded into a single change (one change_gen
+ * step, one round of view invalidation) when fn returns or throws.
+ * Returns fn's result; an exception is rethrown after the commit.
+ */
+static duk_ret_t js_batch(duk_context *ctx) {
+    duk_require_function(ctx, 0);
+    Editor *e = get_editor(ctx);
+    Buffer *buf = e ? editor_current_buffer(e) : NULL;
+    duk_dup(ctx, 0);
+    if (!buf) {
+        duk_call(ctx, 0);
+        return 1;
+    }
+    /* fn may kill the buffer; script_buffer_killed() clears frame.buf */
+    BatchFrame frame = { buf, s_batches };
+    s_batches = &frame;
+    buffer_begin_batch(buf);
+    int rc = duk_pcall(ctx, 0);
+    s_batches = frame.up;
+    if (frame.buf) {
+        buffer_end_batch(frame.buf);
+        views_invalidate(ctx, frame.buf, 0);
+    }
+    if (rc != 0) return duk_throw(ctx);
+    return 1;
+}
+
+/*
+ * editor.sendKeys(seq[, times]) -- feed a key sequence such as
+ * "C-a C-k M-x" to the editor as if typed, `times` times (default 1).
+ * Returns the number of complete runs (fewer if C-g was pressed).
+ */
+static duk_ret_t js_send_keys(duk_context *ctx) {
+    const char *seq = duk_require_string(ctx, 0);
+    int times = duk_opt_int(ctx, 1, 1);
+    Editor *e = get_editor(ctx);
+    if (!e) return 0;
+    size_t max = strlen(seq) + 1;
+    int *keys = malloc(sizeof(int) * max);
+    if (!keys) return duk_error(ctx, DUK_ERR_ERROR, "out of memory");
+    int n = keys_parse(seq, keys, (int)max);
+    if (n < 0) {
+        free(keys);
+        return duk_error(ctx, DUK_ERR_TYPE_ERROR, "invalid key sequence: %s", seq);
+    }
+    int done = keys_execute(e, keys, n, times);
+    free(keys);
+    /* Keys may have edited any buffer */
+    views_invalidate(ctx, NULL, 1);
+    duk_push_int(ctx, done);
+    return 1;
+}
+
+/*
+ * editor.spawnWorker(code, input, callback[, timeLimitMs]) -- run code on
+ * a worker thread in its own heap, against a snapshot of buffer `input`
+ * (the current buffer when null).  The worker sees worker.lineCount(),
+ * worker.getLine(n) and worker.bufferName; its completion value comes
+ * back through JSON as callback(error, result), called from the main
+ * loop.  Workers are meant for long analysis, so unlike evals they have
+ * no time limit unless timeLimitMs is given.  Returns the job id.
+ * Callbacks wait in the stash "workers" array.
+ */
+static int s_next_worker_id = 1;
+
+static duk_ret_t js_spawn_worker(duk_context *ctx) {
+    const char *code = duk_require_string(ctx, 0);
+    duk_require_function(ctx, 2);
+    Editor *e = get_editor(ctx);
+    Buffer *buf = NULL;
+    if (e) buf = duk_is_null_or_undefined(ctx, 1) ? editor_current_buffer(e)
+                 : editor_find_buffer(e, duk_require_string(ctx, 1));
+    if (!buf) return duk_error(ctx, DUK_ERR_ERROR, "no such buffer");
+    if (buffer_unpack(buf) != 0) return duk_error(ctx, DUK_ERR_ERROR, "out of memory");
+
+    int id = s_next_worker_id;
+    int limit_ms = duk_opt_int(ctx, 3, 0);
+    WorkerJob *job = worker_job_new(id, code, buf, limit_ms > 0 ? limit_ms : 0);
+    if (!job) return duk_error(ctx, DUK_ERR_ERROR, "out of memory");
+
+    /* Register the callback before the thread can finish */
+    push_stash_array(ctx, "workers");
+    duk_dup(ctx, 2);
+    duk_put_prop_index(ctx, -2, (duk_uarridx_t)id);
+    if (worker_start(job) != 0) {
+        duk_del_prop_index(ctx, -1, (duk_uarridx_t)id);
+        worker_job_free(job);
+        return duk_error(ctx, DUK_ERR_ERROR, "cannot start worker");
+    }
+    duk_pop(ctx);
+    s_next_worker_id++;
+    duk_push_int(ctx, id);
+    return 1;
+}
+
+/* editor.cancelWorker(id) -- stop a running worker; true if it was running.
+ * Its callback still runs, with a "cancelled" error. */
+static duk_ret_t js_cancel_worker(duk_context *ctx) {
+    duk_push_boolean(ctx, worker_cancel(duk_require_int(ctx, 0)) == 0);
+    return 1;
+}
+
+static duk_ret_t decode_result(duk_context *ctx, void *udata) {
+    (void)udata;
+    duk_json_decode(ctx, -1);
+    return 1;
+}
+
+/* Call the callback registered for a finished job. */
+static void worker_deliver(duk_context *ctx, WorkerJob *job) {
+    push_stash_array(ctx, "workers");
+    duk_get_prop_index(ctx, -1, (duk_uarridx_t)job->id);
+    duk_del_prop_index(ctx, -2, (duk_uarridx_t)job->id);
+    duk_remove(ctx, -2);
+    if (!duk_is_function(ctx, -1)) {
+        duk_pop(ctx);
+        return;
+    }
+
+    if (job->failed) {
+        duk_push_string(ctx, job->result ? job->result : "worker failed");
+        duk_push_undefined(ctx);
+    } else {
+        duk_push_null(ctx);
+        if (job->result) {
+            duk_push_string(ctx, job->result);
+            if (duk_safe_call(ctx, decode_result, NULL, 1, 1) != 0) {
+                duk_pop(ctx);
+                duk_push_undefined(ctx);
+            }
+        } else {
+            duk_push_undefined(ctx);
+        }
+    }
+
+    char msg[256] = {0};
+    budget_begin();
+    int rc = duk_pcall(ctx, 2);
+    views_invalidate(ctx, NULL, 1);
+    if (rc != 0) snprintf(msg, sizeof(msg), "Error: %s", duk_safe_to_string(ctx, -1));
+    budget_end(msg, sizeof(msg));
+    duk_pop(ctx);
+    if (msg[0] && s_editor) editor_set_message(s_editor, "Worker %d: %s", job->id, msg);
+}
+
+void script_worker_results(Editor *e) {
+    WorkerJob *job;
+    while ((job = worker_take_done())) {
+        if (e->js_ctx) worker_deliver(e->js_ctx, job);
+        worker_job_free(job);
     }
+}
+
+/*
+ * JS commands.  editor.defineCommand(name, fn) makes fn an M-x command;
+ * editor.bindKey(seq, fnOrName[, keymap]) binds a key sequence in keymap
+ * ("global" or "shell", default "global") to a command name or to fn,
+ * which then becomes the command "js-command-<id>".  Functions live in
+ * the stash "commands" array, indexed by the command's js_id.  A command
+ * is called as fn(arg), with arg the M-x argument text or undefined.
+ */
+static int s_next_command_id = 1;
+
+static int define_js_command(duk_context *ctx, duk_idx_t fn_idx, const char *name) {
+    int id = s_next_command_id++;
+    push_stash_array(ctx, "commands");
+    duk_dup(ctx, fn_idx);
+    duk_put_prop_index(ctx, -2, (duk_uarridx_t)id);
+    duk_pop(ctx);
+    if (keys_define_js_command(name, id) != 0) {
+        return duk_error(ctx, DUK_ERR_ERROR, "cannot define command %s", name);
+    }
+    return id;
+}
+
+/* editor.defineCommand(name, fn) */
+static duk_ret_t js_define_command(duk_context *ctx) {
+    const char *name = duk_require_string(ctx, 0);
+    duk_require_function(ctx, 1);
+    if (!name[0] || strchr(name, ' '))
+        return duk_error(ctx, DUK_ERR_TYPE_ERROR, "invalid command name: %s", name);
+    define_js_command(ctx, 1, name);
     return 0;
 }
 
+/* editor.bindKey(seq, fnOrName[, keymap]) */
+static duk_ret_t js_bind_key(duk_context *ctx) {
+    const char *seq = duk_require_string(ctx, 0);
+    const char *map = duk_opt_string(ctx, 2, "global");
+    char name[64];
+    if (duk_is_function(ctx, 1)) {
+        snprintf(name, sizeof(name), "js-command-%d", s_next_command_id);
+        define_js_command(ctx, 1, name);
+    } else {
+        snprintf(name, sizeof(name), "%s", duk_require_string(ctx, 1));
+    }
+    switch (keys_bind(map, seq, name)) {
+    case 0:  return 0;
+    case -2: return duk_error(ctx, DUK_ERR_TYPE_ERROR, "invalid key sequence: %s", seq);
+    case -3: return duk_error(ctx, DUK_ERR_ERROR, "unknown command: %s", name);
+    default: return duk_error(ctx, DUK_ERR_ERROR, "cannot bind in keymap %s", map);
+    }
+}
+
+void script_run_command(Editor *e, int js_id, const char *arg) {
+    duk_context *ctx = e->js_ctx;
+    if (!ctx) return;
+    push_stash_array(ctx, "commands");
+    duk_get_prop_index(ctx, -1, (duk_uarridx_t)js_id);
+    duk_remove(ctx, -2);
+    if (!duk_is_function(ctx, -1)) {
+        duk_pop(ctx);
+        return;
+    }
+    if (arg) duk_push_string(ctx, arg);
+    else duk_push_undefined(ctx);
+
+    char msg[256] = {0};
+    budget_begin();
+    int rc = duk_pcall(ctx, 1);
+    views_invalidate(ctx, NULL, 1);
+    if (rc != 0) snprintf(msg, sizeof(msg), "Error: %s", duk_safe_to_string(ctx, -1));
+    budget_end(msg, sizeof(msg));
+    duk_pop(ctx);
+    if (msg[0]) editor_set_message(e, "JS: %s", msg);
+}
+
 /* editor.getBufferContent() */
 static duk_ret_t js_get_buffer_content(duk_context *ctx) {
     Editor *e = get_editor(ctx);
@@ -105,27 +675,190 @@ static duk_ret_t js_get_buffer_content(duk_context *ctx) {
     return 1;
 }
 
+/*
+ * Line-range access.  Line numbers are 1-based like getCurrentLine(); a
+ * range start..end includes both ends.  These touch only the requested
+ * lines, never the whole buffer.
+ */
+
+/* editor.lineCount() */
+static duk_ret_t js_line_count(duk_context *ctx) {
+    Editor *e = get_editor(ctx);
+    Buffer *buf = e ? editor_current_buffer(e) : NULL;
+    duk_push_int(ctx, buf ? buf->num_lines : 0);
+    return 1;
+}
+
+/* editor.getLine(n) -- text of line n, or undefined */
+static duk_ret_t js_get_line(duk_context *ctx) {
+    int n = duk_require_int(ctx, 0);
+    Editor *e = get_editor(ctx);
+    Buffer *buf = e ? editor_current_buffer(e) : NULL;
+    if (!buf || n < 1 || n > buf->num_lines) return 0;
+    duk_push_string(ctx, buf->lines[n - 1]);
+    return 1;
+}
+
+/* editor.getLines(start, end) -- array of lines, clamped to the buffer */
+static duk_ret_t js_get_lines(duk_context *ctx) {
+    int start = duk_require_int(ctx, 0);
+    int end   = duk_require_int(ctx, 1);
+    Editor *e = get_editor(ctx);
+    Buffer *buf = e ? editor_current_buffer(e) : NULL;
+    duk_push_array(ctx);
+    if (!buf) return 1;
+    if (start < 1) start = 1;
+    if (end > buf->num_lines) end = buf->num_lines;
+    for (int ln = start; ln <= end; ln++) {
+        duk_push_string(ctx, buf->lines[ln - 1]);
+        duk_put_prop_index(ctx, -2, (duk_uarridx_t)(ln - start));
+    }
+    return 1;
+}
+
+/* Collect the value at idx (string split on '\n', or array of strings)
+ * into malloc'd lines.  Returns the count, or -1 on allocation failure. */
+static int collect_lines(duk_context *ctx, duk_idx_t idx, char ***out) {
+    int n = 0;
+    char **lines = NULL;
+    if (duk_is_array(ctx, idx)) {
+        n = (int)duk_get_length(ctx, idx);
+        lines = malloc(sizeof(char *) * (n ? n : 1));
+        if (!lines) return -1;
+        for (int i = 0; i < n; i++) {
+            duk_get_prop_index(ctx, idx, (duk_uarridx_t)i);
+            lines[i] = strdup(duk_to_string(ctx, -1));
+            duk_pop(ctx);
+        }
+    } else {
+        duk_size_t len;
+        const char *text = duk_require_lstring(ctx, idx, &len);
+        n = 1;
+        for (const char *p = text; (p = memchr(p, '\n', len - (size_t)(p - text))); p++)
+            n++;
+        lines = malloc(sizeof(char *) * n);
+        if (!lines) return -1;
+        const char *p = text, *end = text + len;
+        for (int i = 0; i < n; i++) {
+            const char *stop = memchr(p, '\n', (size_t)(end - p));
+            if (!stop) stop = end;
+            lines[i] = malloc((size_t)(stop - p) + 1);
+            if (lines[i]) {
+                memcpy(lines[i], p, (size_t)(stop - p));
+                lines[i][stop - p] = '\0';
+            }
+            p = stop + 1;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (!lines[i]) {
+            for (int j = 0; j < n; j++) free(lines[j]);
+            free(lines);
+            return -1;
+        }
+    }
+    *out = lines;
+    return n;
+}
+
+/*
+ * editor.replaceLines(start, end, text) -- replace lines start..end with
+ * `text` (a string or an array of lines).  end = start - 1 inserts before
+ * start; an empty array deletes.  Returns the number of lines inserted.
+ */
+static duk_ret_t js_replace_lines(duk_context *ctx) {
+    int start = duk_require_int(ctx, 0);
+    int end   = duk_require_int(ctx, 1);
+    Editor *e = get_editor(ctx);
+    Buffer *buf = e ? editor_current_buffer(e) : NULL;
+    if (!buf) { duk_push_int(ctx, 0); return 1; }
+    if (start < 1 || end < start - 1 || end > buf->num_lines ||
+        start > buf->num_lines + 1)
+        return duk_error(ctx, DUK_ERR_RANGE_ERROR, "invalid line range %d..%d",
+                         start, end);
+
+    char **lines;
+    int n = collect_lines(ctx, 2, &lines);
+    if (n < 0) return duk_error(ctx, DUK_ERR_ERROR, "out of memory");
+    buffer_replace_lines(buf, start - 1, end - start + 1, lines, n);
+    free(lines);
+    views_invalidate(ctx, buf, 0);
+    duk_push_int(ctx, n);
+    return 1;
+}
+
+/* iterator.next() -- { value: line, line: n, done: bool } */
+static duk_ret_t js_line_iter_next(duk_context *ctx) {
+    budget_check(ctx);
+    duk_push_this(ctx);
+    duk_get_prop_string(ctx, -1, "\xff" "buffer");
+    const char *name = duk_get_string(ctx, -1);
+    duk_get_prop_string(ctx, -2, "\xff" "pos");
+    int pos = duk_get_int(ctx, -1);
+    duk_get_prop_string(ctx, -3, "\xff" "end");
+    int end = duk_get_int(ctx, -1);
+    duk_pop_3(ctx);
+
+    /* Looked up by name each step, so killing the buffer just ends it */
+    Editor *e = get_editor(ctx);
+    Buffer *buf = e && name ? editor_find_buffer(e, name) : NULL;
+    duk_push_object(ctx);
+    if (!buf || pos > end || pos > buf->num_lines || buffer_unpack(buf) != 0) {
+        duk_push_true(ctx);
+        duk_put_prop_string(ctx, -2, "done");
+        return 1;
+    }
+    duk_push_string(ctx, buf->lines[pos - 1]);
+    duk_put_prop_string(ctx, -2, "value");
+    duk_push_int(ctx, pos);
+    duk_put_prop_string(ctx, -2, "line");
+    duk_push_false(ctx);
+    duk_put_prop_string(ctx, -2, "done");
+
+    duk_push_int(ctx, pos + 1);
+    duk_put_prop_string(ctx, -3, "\xff" "pos");
+    return 1;
+}
+
+/*
+ * editor.lines([start[, end]]) -- iterator over lines of the current
+ * buffer; each next() reads one line from the live buffer.
+ */
+static duk_ret_t js_lines(duk_context *ctx) {
+    Editor *e = get_editor(ctx);
+    Buffer *buf = e ? editor_current_buffer(e) : NULL;
+    int start = duk_get_int_default(ctx, 0, 1);
+    int end   = duk_get_int_default(ctx, 1, INT_MAX);
+    if (start < 1) start = 1;
+
+    duk_push_object(ctx);
+    duk_push_string(ctx, buf ? buf->name : "");
+    duk_put_prop_string(ctx, -2, "\xff" "buffer");
+    duk_push_int(ctx, start);
+    duk_put_prop_string(ctx, -2, "\xff" "pos");
+    duk_push_int(ctx, end);
+    duk_put_prop_string(ctx, -2, "\xff" "end");
+    duk_push_c_function(ctx, js_line_iter_next, 0);
+    duk_put_prop_string(ctx, -2, "next");
+    return 1;
+}
+
 /* editor.setBufferContent(str) */
 static duk_ret_t js_set_buffer_content(duk_context *ctx) {
-    const char *str = duk_require_string(ctx, 0);
+    duk_require_string(ctx, 0);
     Editor *e = get_editor(ctx);
     if (!e) return 0;
     Buffer *buf = editor_current_buffer(e);
     if (!buf) return 0;
 
-    /* Clear buffer */
-    for (int i = 0; i < buf->num_lines; i++) free(buf->lines[i]);
-    buf->num_lines = 0;
-    buf->lines[0] = strdup("");
-    buf->num_lines = 1;
-    buf->cursor_line = 0;
-    buf->cursor_col  = 0;
-
-    /* Insert content */
-    for (const char *p = str; *p; p++) {
-        buffer_insert_char(buf, *p);
-    }
-    buf->modified = 1;
+    /* Swap in the new lines wholesale; cursor ends after the text */
+    char **lines;
+    int n = collect_lines(ctx, 0, &lines);
+    if (n < 0) return duk_error(ctx, DUK_ERR_ERROR, "out of memory");
+    buffer_replace_lines(buf, 0, buf->num_lines, lines, n);
+    free(lines);
+    buffer_scroll_to_end(buf);
+    views_invalidate(ctx, buf, 0);
     return 0;
 }
 
@@ -176,7 +909,7 @@ static duk_ret_t js_copy_region(duk_context *ctx) {
     Editor *e = get_editor(ctx);
     if (!e) return 0;
     Buffer *buf = editor_current_buffer(e);
-    if (buf) buffer_copy_region(buf, &e->kill_ring);
+    if (buf) buffer_copy_region(buf, &e->kill_ring, 0);
     return 0;
 }
 
@@ -185,7 +918,8 @@ static duk_ret_t js_kill_region(duk_context *ctx) {
     Editor *e = get_editor(ctx);
     if (!e) return 0;
     Buffer *buf = editor_current_buffer(e);
-    if (buf) buffer_kill_region(buf, &e->kill_ring);
+    if (buf) buffer_kill_region(buf, &e->kill_ring, 0);
+    views_invalidate(ctx, buf, 0);
     return 0;
 }
 
@@ -194,7 +928,9 @@ static duk_ret_t js_yank(duk_context *ctx) {
     Editor *e = get_editor(ctx);
     if (!e) return 0;
     Buffer *buf = editor_current_buffer(e);
-    if (buf) buffer_yank(buf, e->kill_ring);
+    KillEntry *k = kill_ring_current(&e->kill_ring);
+    if (buf && k) buffer_yank(buf, k);
+    views_invalidate(ctx, buf, 0);
     return 0;
 }
 
@@ -218,50 +954,389 @@ static duk_ret_t js_replace(duk_context *ctx) {
     Buffer *buf = editor_current_buffer(e);
     if (!buf) { duk_push_int(ctx, 0); return 1; }
     duk_push_int(ctx, buffer_replace_all(buf, search, replacement));
+    views_invalidate(ctx, buf, 0);
+    return 1;
+}
+
+/* editor.lineBytes(n) -- Uint8Array view of line n's bytes (no newline) */
+static duk_ret_t js_line_bytes(duk_context *ctx) {
+    int n = duk_require_int(ctx, 0);
+    Editor *e = get_editor(ctx);
+    Buffer *buf = e ? editor_current_buffer(e) : NULL;
+    if (!buf || n < 1 || n > buf->num_lines) return 0;
+    char *line = buf->lines[n - 1];
+    push_view(ctx, buf, line, strlen(line));
     return 1;
 }
 
+/*
+ * editor.regionBytes() -- bytes of the active region as a Uint8Array.  A
+ * region inside one line is a view of the line; a multi-line region is
+ * copied once into a fixed buffer (lines joined with '\n').
+ */
+static duk_ret_t js_region_bytes(duk_context *ctx) {
+    Editor *e = get_editor(ctx);
+    Buffer *buf = e ? editor_current_buffer(e) : NULL;
+    if (!buf || !buf->mark_active) return 0;
+    buffer_clamp_cursor(buf);
+
+    if (buf->mark_line == buf->cursor_line) {
+        char *line = buf->lines[buf->cursor_line];
+        int len = (int)strlen(line);
+        int sc = buf->mark_col < buf->cursor_col ? buf->mark_col : buf->cursor_col;
+        int ec = buf->mark_col < buf->cursor_col ? buf->cursor_col : buf->mark_col;
+        if (sc > len) sc = len;
+        if (ec > len) ec = len;
+        push_view(ctx, buf, line + sc, (size_t)(ec - sc));
+        return 1;
+    }
+
+    size_t len = buffer_region_size(buf);
+    buffer_region_read(buf, duk_push_fixed_buffer(ctx, len));
+    duk_push_buffer_object(ctx, -1, 0, len, DUK_BUFOBJ_UINT8ARRAY);
+    return 1;
+}
+
+/*
+ * editor.killBytes([n]) -- Uint8Array view of the kill ring entry n kills
+ * back (default 0, the newest).  The view shares the entry's text.
+ */
+static duk_ret_t js_kill_bytes(duk_context *ctx) {
+    int n = duk_get_int_default(ctx, 0, 0);
+    Editor *e = get_editor(ctx);
+    KillEntry *k = e ? kill_ring_get(&e->kill_ring, n) : NULL;
+    if (!k) return 0;
+    push_view(ctx, NULL, k->text, k->len);
+    s_views[s_num_views - 1].kill = kill_entry_ref(k);
+    return 1;
+}
+
+/*
+ * Every editor.* method is registered as js_dispatch with its index in
+ * s_methods as the function's magic, so cross-cutting checks live here.
+ */
+static const struct { const char *name; duk_c_function fn; } s_methods[] = {
+    { "message",              js_message              },
+    { "getCurrentBufferName", js_get_current_buffer_name },
+    { "listBuffers",          js_list_buffers         },
+    { "switchBuffer",         js_switch_buffer        },
+    { "newBuffer",            js_new_buffer           },
+    { "insertText",           js_insert_text          },
+    { "batch",                js_batch                },
+    { "spawnWorker",          js_spawn_worker         },
+    { "cancelWorker",         js_cancel_worker        },
+    { "sendKeys",             js_send_keys            },
+    { "bindKey",              js_bind_key             },
+    { "defineCommand",        js_define_command       },
+    { "getBufferContent",     js_get_buffer_content   },
+    { "setBufferContent",     js_set_buffer_content   },
+    { "lineCount",            js_line_count           },
+    { "getLine",              js_get_line             },
+    { "getLines",             js_get_lines            },
+    { "replaceLines",         js_replace_lines        },
+    { "lines",                js_lines                },
+    { "lineBytes",            js_line_bytes           },
+    { "regionBytes",          js_region_bytes         },
+    { "killBytes",            js_kill_bytes           },
+    { "openFile",             js_open_file            },
+    { "saveFile",             js_save_file            },
+    { "getCurrentLine",       js_get_current_line     },
+    { "getCurrentCol",        js_get_current_col      },
+    { "setMark",              js_set_mark             },
+    { "copyRegion",           js_copy_region          },
+    { "killRegion",           js_kill_region          },
+    { "yank",                 js_yank                 },
+    { "find",                 js_find                 },
+    { "replace",              js_replace              },
+    { "stats",                js_stats                },
+    { "bufferStats",          js_buffer_stats         },
+    { NULL, NULL }
+};
+
+#define NUM_METHODS ((int)(sizeof(s_methods) / sizeof(s_methods[0])) - 1)
+
+/*
+ * Profiler (M-x js-profile).  While it runs, js_dispatch times every
+ * native binding, and user functions reachable from the global object
+ * (globals and methods of global objects) are swapped for a native
+ * wrapper that times the call.  Self time excludes time spent in nested
+ * profiled calls, whether JS or native.  Functions created by the
+ * profiled code itself are not wrapped.
+ */
+#define PROF_MAX_FUNCS 4096
+
+typedef struct ProfEntry {
+    char name[96];
+    unsigned long calls;
+    long total_ns;
+    long self_ns;
+} ProfEntry;
+
+static int s_profiling;
+static int s_prof_run;                  /* tags wrappers of the current run */
+static long s_prof_child_ns;            /* time of finished nested calls */
+static ProfEntry s_prof_natives[NUM_METHODS];
+static ProfEntry *s_prof_funcs;
+static int s_prof_num_funcs;
+
+static long now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long)t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static void prof_account(ProfEntry *p, long start, long outer_child) {
+    long elapsed = now_ns() - start;
+    p->calls++;
+    p->total_ns += elapsed;
+    p->self_ns += elapsed - s_prof_child_ns;
+    s_prof_child_ns = outer_child + elapsed;
+}
+
+static duk_ret_t js_dispatch(duk_context *ctx) {
+    budget_check(ctx);
+    int i = duk_get_current_magic(ctx);
+    if (!s_profiling) return s_methods[i].fn(ctx);
+
+    /* A binding that throws is left out of the profile */
+    long outer = s_prof_child_ns;
+    s_prof_child_ns = 0;
+    long start = now_ns();
+    duk_ret_t rc = s_methods[i].fn(ctx);
+    prof_account(&s_prof_natives[i], start, outer);
+    return rc;
+}
+
+/*
+ * Stand-in for a wrapped JS function.  The original hangs off the wrapper,
+ * so a wrapper that escaped the run still works; its magic indexes
+ * s_prof_funcs, used only while its own run is in progress.
+ */
+static duk_ret_t prof_wrapper(duk_context *ctx) {
+    int i = duk_get_current_magic(ctx);
+    duk_idx_t nargs = duk_get_top(ctx);
+    int ctor = duk_is_constructor_call(ctx);
+
+    duk_push_current_function(ctx);
+    duk_get_prop_string(ctx, -1, "\xff" "run");
+    int live = s_profiling && duk_get_int(ctx, -1) == s_prof_run;
+    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "\xff" "f");
+    duk_remove(ctx, -2);
+    if (!ctor) duk_push_this(ctx);
+    for (duk_idx_t k = 0; k < nargs; k++) duk_dup(ctx, k);
+
+    long outer = s_prof_child_ns;
+    s_prof_child_ns = 0;
+    long start = now_ns();
+    int rc = ctor ? duk_pnew(ctx, nargs) : duk_pcall_method(ctx, nargs);
+    if (live) prof_account(&s_prof_funcs[i], start, outer);
+    else s_prof_child_ns = outer;
+    if (rc != 0) return duk_throw(ctx);
+    return 1;
+}
+
+/* Wrap the function at obj[key] (key on stack top, obj at obj_idx). */
+static void prof_wrap(duk_context *ctx, duk_idx_t obj_idx, const char *prefix) {
+    if (s_prof_num_funcs >= PROF_MAX_FUNCS) return;
+    int i = s_prof_num_funcs;
+    ProfEntry *p = &s_prof_funcs[i];
+    memset(p, 0, sizeof(*p));
+    snprintf(p->name, sizeof(p->name), "%s%s", prefix, duk_get_string(ctx, -1));
+
+    push_stash_array(ctx, "prof");
+    duk_push_object(ctx);
+    duk_dup(ctx, obj_idx);
+    duk_put_prop_string(ctx, -2, "h");
+    duk_dup(ctx, -3);
+    duk_put_prop_string(ctx, -2, "k");
+    duk_push_c_function(ctx, prof_wrapper, DUK_VARARGS);
+    duk_set_magic(ctx, -1, i);
+    duk_push_int(ctx, s_prof_run);
+    duk_put_prop_string(ctx, -2, "\xff" "run");
+    duk_dup(ctx, -4);
+    duk_get_prop(ctx, obj_idx);
+    duk_put_prop_string(ctx, -2, "\xff" "f");
+    duk_dup(ctx, -1);
+    duk_put_prop_string(ctx, -3, "w");
+    /* stack: ... key prof entry wrapper */
+    duk_dup(ctx, -4);
+    duk_dup(ctx, -2);
+    duk_put_prop(ctx, obj_idx);
+    duk_pop(ctx);
+    duk_put_prop_index(ctx, -2, (duk_uarridx_t)i);
+    duk_pop(ctx);
+    s_prof_num_funcs++;
+}
+
+/* Wrap the user functions among the own enumerable properties of the
+ * object on the stack top; recurse one level into plain objects. */
+static void prof_wrap_object(duk_context *ctx, const char *prefix, int depth) {
+    duk_idx_t obj_idx = duk_get_top(ctx) - 1;
+    duk_enum(ctx, obj_idx, DUK_ENUM_OWN_PROPERTIES_ONLY);
+    while (duk_next(ctx, -1, 1)) {
+        const char *key = duk_get_string(ctx, -2);
+        if (duk_is_function(ctx, -1)) {
+            duk_pop(ctx);
+            prof_wrap(ctx, obj_idx, prefix);
+        } else if (depth == 0 && duk_is_object(ctx, -1) && key &&
+                   strcmp(key, "editor") != 0) {
+            char sub[96];
+            snprintf(sub, sizeof(sub), "%s.", key);
+            prof_wrap_object(ctx, sub, depth + 1);
+            duk_pop(ctx);
+        } else {
+            duk_pop(ctx);
+        }
+        duk_pop(ctx);
+    }
+    duk_pop(ctx);
+}
+
+static duk_ret_t prof_wrap_globals(duk_context *ctx, void *udata) {
+    (void)udata;
+    duk_push_global_object(ctx);
+    prof_wrap_object(ctx, "", 0);
+    return 0;
+}
+
+/* Put back every original that is still replaced by its wrapper. */
+static duk_ret_t prof_unwrap(duk_context *ctx, void *udata) {
+    (void)udata;
+    push_stash_array(ctx, "prof");
+    for (int i = 0; i < s_prof_num_funcs; i++) {
+        duk_get_prop_index(ctx, -1, (duk_uarridx_t)i);
+        duk_get_prop_string(ctx, -1, "h");
+        duk_get_prop_string(ctx, -2, "k");
+        duk_dup(ctx, -1);
+        duk_get_prop(ctx, -3);
+        duk_get_prop_string(ctx, -4, "w");
+        int same = duk_strict_equals(ctx, -1, -2);
+        duk_pop_2(ctx);
+        if (same) {
+            duk_get_prop_string(ctx, -3, "w");
+            duk_get_prop_string(ctx, -1, "\xff" "f");
+            duk_remove(ctx, -2);
+            duk_put_prop(ctx, -3);
+        } else {
+            duk_pop(ctx);
+        }
+        duk_pop_2(ctx);
+    }
+    duk_pop(ctx);
+    return 0;
+}
+
+static int cmp_prof_self(const void *a, const void *b) {
+    long x = ((const ProfEntry *)a)->self_ns, y = ((const ProfEntry *)b)->self_ns;
+    return (x < y) - (x > y);
+}
+
+/* Append report rows for `n` entries, hottest first. */
+static void prof_rows(ProfEntry *entries, int n, char **rows, int *nrows) {
+    qsort(entries, n, sizeof(ProfEntry), cmp_prof_self);
+    for (int i = 0; i < n; i++) {
+        ProfEntry *p = &entries[i];
+        if (!p->calls) continue;
+        char line[256];
+        snprintf(line, sizeof(line), "  %-32s %10lu %10.2f %10.2f %10.2f",
+                 p->name, p->calls, p->self_ns / 1e6, p->total_ns / 1e6,
+                 p->total_ns / 1e3 / (double)p->calls);
+        rows[(*nrows)++] = strdup(line);
+    }
+}
+
+int script_profile(Editor *e, duk_context *ctx, const char *code,
+                   char *result, int result_len) {
+    if (!ctx || !code) return -1;
+    s_prof_funcs = calloc(PROF_MAX_FUNCS, sizeof(ProfEntry));
+    if (!s_prof_funcs) return -1;
+    memset(s_prof_natives, 0, sizeof(s_prof_natives));
+    for (int i = 0; i < NUM_METHODS; i++)
+        snprintf(s_prof_natives[i].name, sizeof(s_prof_natives[i].name),
+                 "editor.%s", s_methods[i].name);
+    s_prof_num_funcs = 0;
+    s_prof_child_ns = 0;
+    s_prof_run++;
+
+    /* Assigning to a frozen object throws: wrap what can be wrapped */
+    if (duk_safe_call(ctx, prof_wrap_globals, NULL, 0, 1) != 0)
+        editor_set_message(e, "Profiler: %s", duk_safe_to_string(ctx, -1));
+    duk_pop(ctx);
+
+    s_profiling = 1;
+    long start = now_ns();
+    int rc = script_eval(ctx, code, result, result_len);
+    long total = now_ns() - start;
+    s_profiling = 0;
+    duk_safe_call(ctx, prof_unwrap, NULL, 0, 1);
+    duk_pop(ctx);
+    duk_push_global_stash(ctx);
+    duk_del_prop_string(ctx, -1, "prof");
+    duk_pop(ctx);
+
+    int max_rows = NUM_METHODS + s_prof_num_funcs + 8;
+    char **rows = malloc(sizeof(char *) * max_rows);
+    int nrows = 0;
+    if (rows) {
+        char line[640];
+        snprintf(line, sizeof(line), "JS profile of: %s", code);
+        rows[nrows++] = strdup(line);
+        snprintf(line, sizeof(line), "Total %.2f ms, result: %s", total / 1e6,
+                 result ? result : "");
+        rows[nrows++] = strdup(line);
+        rows[nrows++] = strdup("");
+        snprintf(line, sizeof(line), "  %-32s %10s %10s %10s %10s",
+                 "JS function", "calls", "self ms", "total ms", "avg us");
+        rows[nrows++] = strdup(line);
+        prof_rows(s_prof_funcs, s_prof_num_funcs, rows, &nrows);
+        rows[nrows++] = strdup("");
+        snprintf(line, sizeof(line), "  %-32s %10s %10s %10s %10s",
+                 "Native binding", "calls", "self ms", "total ms", "avg us");
+        rows[nrows++] = strdup(line);
+        prof_rows(s_prof_natives, NUM_METHODS, rows, &nrows);
+
+        Buffer *pb = editor_find_buffer(e, "*js-profile*");
+        if (!pb) pb = editor_new_buffer(e, "*js-profile*");
+        if (pb) {
+            buffer_replace_lines(pb, 0, pb->num_lines, rows, nrows);
+            pb->modified = 0;
+            pb->cursor_line = pb->cursor_col = pb->top_line = 0;
+            e->current_buffer = pb->index;
+        } else {
+            while (nrows > 0) free(rows[--nrows]);
+        }
+        free(rows);
+    }
+    free(s_prof_funcs);
+    s_prof_funcs = NULL;
+    return rc;
+}
+
 duk_context *script_init(Editor *e) {
     duk_context *ctx = duk_create_heap_default();
     if (!ctx) return NULL;
 
-    /* Store editor pointer in global stash */
-    duk_push_global_stash(ctx);
-    duk_push_pointer(ctx, e);
-    duk_put_prop_string(ctx, -2, "editor_ptr");
-    duk_pop(ctx);
+    s_editor = e;
 
     /* Create 'editor' global object */
     duk_push_object(ctx);
 
-    static const struct { const char *name; duk_c_function fn; } methods[] = {
-        { "message",              js_message              },
-        { "getCurrentBufferName", js_get_current_buffer_name },
-        { "listBuffers",          js_list_buffers         },
-        { "switchBuffer",         js_switch_buffer        },
-        { "newBuffer",            js_new_buffer           },
-        { "insertText",           js_insert_text          },
-        { "getBufferContent",     js_get_buffer_content   },
-        { "setBufferContent",     js_set_buffer_content   },
-        { "openFile",             js_open_file            },
-        { "saveFile",             js_save_file            },
-        { "getCurrentLine",       js_get_current_line     },
-        { "getCurrentCol",        js_get_current_col      },
-        { "setMark",              js_set_mark             },
-        { "copyRegion",           js_copy_region          },
-        { "killRegion",           js_kill_region          },
-        { "yank",                 js_yank                 },
-        { "find",                 js_find                 },
-        { "replace",              js_replace              },
-        { NULL, NULL }
-    };
-
-    for (int i = 0; methods[i].name; i++) {
-        duk_push_c_function(ctx, methods[i].fn, DUK_VARARGS);
-        duk_put_prop_string(ctx, -2, methods[i].name);
+
+    for (int i = 0; s_methods[i].name; i++) {
+        duk_push_c_function(ctx, js_dispatch, DUK_VARARGS);
+        duk_set_magic(ctx, -1, i);
+        duk_put_prop_string(ctx, -2, s_methods[i].name);
     }
 
     duk_put_global_string(ctx, "editor");
+
+    /* Read-only and hidden from enumeration (and so from the profiler) */
+    duk_push_global_object(ctx);
+    duk_push_string(ctx, LOOP_GUARD_FN);
+    duk_push_c_function(ctx, js_loop_guard, 0);
+    duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE);
+    duk_pop(ctx);
     return ctx;
 }
 
@@ -272,14 +1347,18 @@ void script_destroy(duk_context *ctx) {
 int script_eval(duk_context *ctx, const char *code, char *result, int result_len) {
     if (!ctx || !code) return -1;
 
-    int rc = duk_peval_string(ctx, code);
+    budget_begin();
+    int rc = peval_guarded(ctx, code, strlen(code));
+    views_invalidate(ctx, NULL, 1);
     if (rc != 0) {
         /* Error */
         const char *err = duk_safe_to_string(ctx, -1);
         if (result) snprintf(result, result_len, "Error: %s", err);
+        budget_end(result, result_len);
         duk_pop(ctx);
         return -1;
     }
+    budget_end(result, result_len);
 
     /* Success: get result as string */
     const char *res = duk_safe_to_string(ctx, -1);
@@ -287,3 +1366,159 @@ int script_eval(duk_context *ctx, const char *code, char *result, int result_len
     duk_pop(ctx);
     return 0;
 }
+
+/*
+ * Bytecode cache.  Each script gets one file under ~/.myfancyeditor/cache,
+ * named after a hash of its path and holding the dumped bytecode behind a
+ * header that records the hash of the guarded source (so a change to the
+ * loop guards also invalidates it).  An entry is only loaded when the
+ * header matches the current source and Duktape version exactly, since
+ * Duktape does not validate bytecode itself.
+ */
+#define BC_MAGIC 0x4346424dU    /* "MBFC" */
+
+typedef struct BytecodeHeader {
+    uint32_t magic;
+    uint32_t duk_version;
+    uint64_t source_hash;
+    uint64_t length;
+} BytecodeHeader;
+
+static uint64_t fnv1a64(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#define FNV64_OFFSET 14695981039346656037ULL
+
+static char *read_whole_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fileno(f), &st) == 0 && (data = malloc((size_t)st.st_size + 1))) {
+        *len = fread(data, 1, (size_t)st.st_size, f);
+        data[*len] = '\0';
+    }
+    fclose(f);
+    return data;
+}
+
+/* Build the cache entry path for `path`, creating the directories. */
+static int cache_path(const char *path, char *out, size_t out_len) {
+    const char *home = getenv("HOME");
+    if (!home || !*home) return -1;
+    snprintf(out, out_len, "%s/.myfancyeditor", home);
+    if (mkdir(out, 0755) != 0 && errno != EEXIST) return -1;
+    snprintf(out, out_len, "%s/.myfancyeditor/cache", home);
+    if (mkdir(out, 0755) != 0 && errno != EEXIST) return -1;
+    uint64_t h = fnv1a64(FNV64_OFFSET, path, strlen(path));
+    int n = snprintf(out, out_len, "%s/.myfancyeditor/cache/%016llx.bc",
+                     home, (unsigned long long)h);
+    return n < (int)out_len ? 0 : -1;
+}
+
+static duk_ret_t load_bytecode(duk_context *ctx, void *udata) {
+    (void)udata;
+    duk_load_function(ctx);
+    return 1;
+}
+
+/* Push the cached function for a source with hash `hash`; 0 on a hit. */
+static int cache_load(duk_context *ctx, const char *cpath, uint64_t hash) {
+    size_t len;
+    char *data = read_whole_file(cpath, &len);
+    if (!data) return -1;
+    BytecodeHeader hdr;
+    int ok = len >= sizeof(hdr);
+    if (ok) {
+        memcpy(&hdr, data, sizeof(hdr));
+        ok = hdr.magic == BC_MAGIC && hdr.duk_version == (uint32_t)DUK_VERSION &&
+             hdr.source_hash == hash && hdr.length == len - sizeof(hdr);
+    }
+    if (ok) {
+        void *bc = duk_push_fixed_buffer(ctx, (duk_size_t)hdr.length);
+        memcpy(bc, data + sizeof(hdr), (size_t)hdr.length);
+        if (duk_safe_call(ctx, load_bytecode, NULL, 1, 1) != 0) {
+            duk_pop(ctx);
+            ok = 0;
+        }
+    }
+    free(data);
+    return ok ? 0 : -1;
+}
+
+/* Dump the function on the stack top into the cache (tmp file + rename). */
+static void cache_store(duk_context *ctx, const char *cpath, uint64_t hash) {
+    duk_dup_top(ctx);
+    duk_dump_function(ctx);
+    duk_size_t len;
+    void *bc = duk_get_buffer(ctx, -1, &len);
+    BytecodeHeader hdr = { BC_MAGIC, (uint32_t)DUK_VERSION, hash, len };
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d", cpath, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (f) {
+        int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+                 fwrite(bc, 1, len, f) == len;
+        if (fclose(f) != 0) ok = 0;
+        if (!ok || rename(tmp, cpath) != 0) unlink(tmp);
+    }
+    duk_pop(ctx);
+}
+
+int script_load_file(duk_context *ctx, const char *path, char *result, int result_len) {
+    if (!ctx || !path) return -1;
+    size_t raw_len, len;
+    char *raw = read_whole_file(path, &raw_len);
+    if (!raw) {
+        if (result) snprintf(result, result_len, "Cannot read %s", path);
+        return -1;
+    }
+    char *src = loop_guard_source(raw, raw_len, &len);
+    free(raw);
+    if (!src) {
+        if (result) snprintf(result, result_len, "Out of memory loading %s", path);
+        return -1;
+    }
+
+    uint64_t hash = fnv1a64(FNV64_OFFSET, src, len);
+    char cpath[PATH_MAX];
+    int have_cache = cache_path(path, cpath, sizeof(cpath)) == 0;
+    int cached = have_cache && cache_load(ctx, cpath, hash) == 0;
+    if (!cached) {
+        duk_push_string(ctx, path);
+        if (duk_pcompile_lstring_filename(ctx, 0, src, len) != 0) {
+            if (result) snprintf(result, result_len, "Error: %s",
+                                 duk_safe_to_string(ctx, -1));
+            duk_pop(ctx);
+            free(src);
+            return -1;
+        }
+        if (have_cache) cache_store(ctx, cpath, hash);
+    }
+    free(src);
+
+    budget_begin();
+    int rc = duk_pcall(ctx, 0);
+    views_invalidate(ctx, NULL, 1);
+    if (result) snprintf(result, result_len, rc != 0 ? "Error: %s" : "%s",
+                         duk_safe_to_string(ctx, -1));
+    budget_end(result, result_len);
+    duk_pop(ctx);
+    return rc != 0 ? -1 : cached;
+}
+
+int script_load_init(duk_context *ctx, char *result, int result_len) {
+    const char *home = getenv("HOME");
+    if (!ctx || !home || !*home) return -2;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.myfancyeditor/init.js", home);
+    if (access(path, R_OK) != 0) return -2;
+    return script_load_file(ctx, path, result, result_len);
+}
@@ -4,9 +4,29 @@
 #include <duktape.h>
 
 typedef struct Editor Editor;
+typedef struct Buffer Buffer;
 
 duk_context *script_init(Editor *e);
 void script_destroy(duk_context *ctx);
 int script_eval(duk_context *ctx, const char *code, char *result, int result_len);
+/* Run a script file through the bytecode cache.  Returns 1 if cached
+ * bytecode was used, 0 if the source was compiled, -1 on error. */
+int script_load_file(duk_context *ctx, const char *path, char *result, int result_len);
+/* Load ~/.myfancyeditor/init.js; -2 if there is none. */
+int script_load_init(duk_context *ctx, char *result, int result_len);
+/* Hook for a Duktape built with DUK_USE_EXEC_TIMEOUT_CHECK: true once
+ * the running eval is out of time or was interrupted with C-g.  Without
+ * it the loop guards (loop_guard.h) do the same job. */
+duk_bool_t script_exec_timeout_check(void *udata);
+/* Evaluate `code` under the profiler and show the report in *js-profile*. */
+int script_profile(Editor *e, duk_context *ctx, const char *code,
+                   char *result, int result_len);
+/* Run the callbacks of finished editor.spawnWorker() jobs. */
+void script_worker_results(Editor *e);
+/* Forget a buffer about to be destroyed (its views, running batches,
+ * the running eval's edit report). */
+void script_buffer_killed(Editor *e, Buffer *buf);
+/* Call the JS function behind a command from editor.defineCommand/bindKey. */
+void script_run_command(Editor *e, int js_id, const char *arg);
 
 #endif /* SCRIPT_H */
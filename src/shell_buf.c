@@ -1,6 +1,8 @@
 #include "shell_buf.h"
 #include "editor.h"
 #include "buffer.h"
+#include "stats.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -36,7 +38,7 @@ Buffer *shell_buf_create(Editor *e, const char *shell) {
     pid_t pid = forkpty(&master_fd, NULL, NULL, &ws);
     if (pid < 0) {
         editor_set_message(e, "forkpty failed: %s", strerror(errno));
-        editor_kill_buffer(e, e->num_buffers - 1);
+        editor_kill_buffer(e, buf->index);
         return NULL;
     }
 
@@ -58,7 +60,7 @@ Buffer *shell_buf_create(Editor *e, const char *shell) {
     int flags = fcntl(master_fd, F_GETFL, 0);
     fcntl(master_fd, F_SETFL, flags | O_NONBLOCK);
 
-    e->current_buffer = e->num_buffers - 1;
+    e->current_buffer = buf->index;
     editor_set_message(e, "Shell started in %s (pid %d)", bufname, (int)pid);
     return buf;
 }
@@ -81,11 +83,17 @@ void shell_buf_read(Buffer *buf) {
 
     char tmp[4096];
     int n;
+    size_t total = 0;
 
+    TRACE_BEGIN("shell_buf_read");
     while ((n = (int)read(buf->pty_fd, tmp, sizeof(tmp) - 1)) > 0) {
         tmp[n] = '\0';
+        buf->pty_bytes += (unsigned long long)n;
+        stats_add_pty_bytes((size_t)n);
+        total += (size_t)n;
         buffer_append_string(buf, tmp);
     }
+    TRACE_END_N("shell_buf_read", total);
 
     if (n < 0 && errno != EAGAIN && errno != EINTR) {
         /* Shell died */
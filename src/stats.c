@@ -0,0 +1,112 @@
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+/*
+ * Bucket b < 8 holds b ns exactly; above that, 8 buckets split each
+ * power of two [2^k, 2^(k+1)).  The last one also takes everything past
+ * 2^STAT_MAX_EXP ns (about 18 minutes).
+ */
+#define STAT_SUB_BITS 3
+#define STAT_SUB      (1 << STAT_SUB_BITS)
+#define STAT_MAX_EXP  40
+#define STAT_BUCKETS  ((STAT_MAX_EXP - STAT_SUB_BITS + 2) * STAT_SUB)
+
+typedef struct StatTimer {
+    unsigned long count;
+    long total_ns;
+    long max_ns;
+    unsigned long buckets[STAT_BUCKETS];
+} StatTimer;
+
+static StatTimer s_timers[STAT_NUM_TIMERS];
+static unsigned long long s_pty_bytes;
+static unsigned long long s_retired_allocs;
+
+static const char *s_timer_names[STAT_NUM_TIMERS] = {
+    "key", "frame", "search", "replace", "js"
+};
+
+long stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int bucket_of(long ns) {
+    if (ns < STAT_SUB) return ns < 0 ? 0 : (int)ns;
+    int exp = 63 - __builtin_clzl((unsigned long)ns);
+    if (exp > STAT_MAX_EXP) return STAT_BUCKETS - 1;
+    int sub = (int)(ns >> (exp - STAT_SUB_BITS)) & (STAT_SUB - 1);
+    return (exp - STAT_SUB_BITS + 1) * STAT_SUB + sub;
+}
+
+/* Smallest duration falling in bucket b */
+static double bucket_low(int b) {
+    if (b < STAT_SUB) return b;
+    int exp = b / STAT_SUB + STAT_SUB_BITS - 1;
+    return (double)((long)(STAT_SUB + b % STAT_SUB) << (exp - STAT_SUB_BITS));
+}
+
+void stats_record(int timer, long ns) {
+    StatTimer *t = &s_timers[timer];
+    t->count++;
+    t->total_ns += ns;
+    if (ns > t->max_ns) t->max_ns = ns;
+    t->buckets[bucket_of(ns)]++;
+}
+
+/* Midpoint of the bucket holding the sample of rank ceil(p% of count) */
+static double percentile_ns(const StatTimer *t, double p) {
+    unsigned long rank = (unsigned long)(p / 100.0 * t->count + 0.999999);
+    if (rank == 0) rank = 1;
+    unsigned long seen = 0;
+    for (int b = 0; b < STAT_BUCKETS; b++) {
+        seen += t->buckets[b];
+        if (seen >= rank) {
+            double mid = b + 1 < STAT_BUCKETS ? (bucket_low(b) + bucket_low(b + 1)) / 2
+                                              : bucket_low(b);
+            return mid < t->max_ns ? mid : t->max_ns;
+        }
+    }
+    return t->max_ns;
+}
+
+void stats_summary(int timer, StatSummary *out) {
+    const StatTimer *t = &s_timers[timer];
+    memset(out, 0, sizeof(*out));
+    out->count = t->count;
+    if (!t->count) return;
+    out->mean_us = t->total_ns / 1e3 / t->count;
+    out->p50_us = percentile_ns(t, 50) / 1e3;
+    out->p90_us = percentile_ns(t, 90) / 1e3;
+    out->p99_us = percentile_ns(t, 99) / 1e3;
+    out->max_us = t->max_ns / 1e3;
+    out->total_ms = t->total_ns / 1e6;
+}
+
+const char *stats_timer_name(int timer) {
+    return timer >= 0 && timer < STAT_NUM_TIMERS ? s_timer_names[timer] : "?";
+}
+
+void stats_add_pty_bytes(size_t n) {
+    s_pty_bytes += n;
+}
+
+unsigned long long stats_pty_bytes(void) {
+    return s_pty_bytes;
+}
+
+void stats_retire_buffer_allocs(unsigned long n) {
+    s_retired_allocs += n;
+}
+
+unsigned long long stats_retired_allocs(void) {
+    return s_retired_allocs;
+}
+
+void stats_reset(void) {
+    memset(s_timers, 0, sizeof(s_timers));
+    s_pty_bytes = 0;
+    s_retired_allocs = 0;
+}
@@ -0,0 +1,49 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+/*
+ * Runtime performance counters.  Each timer keeps a log-linear histogram
+ * of durations (8 buckets per power of two, so percentiles are within
+ * 12.5%), recorded with a clock read and a few adds.  PTY bytes per shell
+ * and allocations per buffer are counted on the Buffer itself (pty_bytes,
+ * allocs); the totals here also cover buffers already killed.  All of it
+ * is main-thread only.
+ */
+enum {
+    STAT_KEY,               /* handle_key() of one read key */
+    STAT_FRAME,             /* ui_refresh() */
+    STAT_SEARCH,            /* buffer_search_forward() */
+    STAT_REPLACE,           /* buffer_replace_all() */
+    STAT_JS_EVAL,           /* one top-level JS eval or callback */
+    STAT_NUM_TIMERS
+};
+
+typedef struct StatSummary {
+    unsigned long count;
+    double mean_us;
+    double p50_us;
+    double p90_us;
+    double p99_us;
+    double max_us;
+    double total_ms;
+} StatSummary;
+
+long stats_now_ns(void);
+/* Record a duration for `timer`: stats_record(T, stats_now_ns() - start) */
+void stats_record(int timer, long ns);
+void stats_summary(int timer, StatSummary *out);
+/* Short name of a timer ("key", "frame", ...) */
+const char *stats_timer_name(int timer);
+
+/* Bytes read from any shell's PTY */
+void stats_add_pty_bytes(size_t n);
+unsigned long long stats_pty_bytes(void);
+/* Allocations of destroyed buffers, added up by buffer_destroy() */
+void stats_retire_buffer_allocs(unsigned long n);
+unsigned long long stats_retired_allocs(void);
+
+void stats_reset(void);
+
+#endif /* STATS_H */
@@ -0,0 +1,581 @@
+#include "syntax.h"
+#include "lex_worker.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Most lines lexed on the UI thread to draw one line; further than this
+ * and the work goes to a background job */
+#define LEX_UI_LINES 5000
+
+/* Lexer states carried from one line to the next */
+enum { ST_NORMAL, ST_COMMENT, ST_DQUOTE, ST_SQUOTE, ST_TEMPLATE, ST_UNKNOWN = 0xFF };
+
+/* Spans produced by one lexer run; NULL when only the end state is wanted */
+typedef struct LexOut {
+    HlSpan *spans;
+    int n;
+    int cap;
+} LexOut;
+
+typedef struct SyntaxLang {
+    const char *name;
+    const char *const *exts;        /* file name suffixes */
+    int (*lex)(const struct SyntaxLang *lang, const char *s, int state, LexOut *o);
+    const char *const *keywords;
+    const char *const *types;
+    int js;                         /* `templates`, $ in identifiers */
+} SyntaxLang;
+
+static void emit(LexOut *o, int start, int end, int face) {
+    if (!o || start >= end) return;
+    if (o->n > 0 && o->spans[o->n - 1].end == start && o->spans[o->n - 1].face == face) {
+        o->spans[o->n - 1].end = end;
+        return;
+    }
+    if (o->n == o->cap) {
+        int new_cap = o->cap ? o->cap * 2 : 8;
+        HlSpan *grown = realloc(o->spans, sizeof(HlSpan) * new_cap);
+        if (!grown) return;         /* the rest stays uncoloured */
+        o->spans = grown;
+        o->cap = new_cap;
+    }
+    o->spans[o->n++] = (HlSpan){ start, end, face };
+}
+
+static int in_list(const char *const *list, const char *s, int len) {
+    for (; list && *list; list++)
+        if ((int)strlen(*list) == len && strncmp(*list, s, (size_t)len) == 0) return 1;
+    return 0;
+}
+
+static int is_word(int c, int js) {
+    return isalnum((unsigned char)c) || c == '_' || (js && c == '$');
+}
+
+/* Index past the closing quote q of a string whose body starts at i;
+ * *closed = 0 if the line ends first. */
+static int scan_string(const char *s, int i, char q, int *closed) {
+    while (s[i]) {
+        if (s[i] == '\\' && s[i + 1]) {
+            i += 2;
+        } else if (s[i++] == q) {
+            *closed = 1;
+            return i;
+        }
+    }
+    *closed = 0;
+    return i;
+}
+
+static int quote_state(char q) {
+    return q == '"' ? ST_DQUOTE : q == '\'' ? ST_SQUOTE : ST_TEMPLATE;
+}
+
+static char state_quote(int state) {
+    return state == ST_DQUOTE ? '"' : state == ST_SQUOTE ? '\'' : '`';
+}
+
+/* --- C and JavaScript --- */
+
+static int lex_clike(const SyntaxLang *lang, const char *s, int state, LexOut *o) {
+    int len = (int)strlen(s);
+    int i = 0;
+
+    /* Finish a comment or string left open by the previous line */
+    if (state == ST_COMMENT) {
+        const char *end = strstr(s, "*/");
+        i = end ? (int)(end - s) + 2 : len;
+        emit(o, 0, i, FACE_COMMENT);
+        if (!end) return ST_COMMENT;
+    } else if (state == ST_DQUOTE || state == ST_SQUOTE || state == ST_TEMPLATE) {
+        int closed;
+        i = scan_string(s, 0, state_quote(state), &closed);
+        emit(o, 0, i, FACE_STRING);
+        if (!closed) return state == ST_TEMPLATE || (len && s[len - 1] == '\\') ? state : ST_NORMAL;
+    } else if (!lang->js) {
+        int j = 0;
+        while (s[j] == ' ' || s[j] == '\t') j++;
+        if (s[j] == '#') {
+            i = j + 1;
+            while (s[i] == ' ' || s[i] == '\t') i++;
+            while (is_word(s[i], 0)) i++;
+            emit(o, j, i, FACE_PREPROC);
+            if (strncmp(s + j, "#include", 8) == 0) {
+                while (s[i] == ' ' || s[i] == '\t') i++;
+                if (s[i] == '<') {
+                    const char *end = strchr(s + i, '>');
+                    int k = end ? (int)(end - s) + 1 : len;
+                    emit(o, i, k, FACE_STRING);
+                    i = k;
+                }
+            }
+        }
+    }
+
+    while (i < len) {
+        char c = s[i];
+        if (c == '/' && s[i + 1] == '/') {
+            emit(o, i, len, FACE_COMMENT);
+            break;
+        }
+        if (c == '/' && s[i + 1] == '*') {
+            const char *end = strstr(s + i + 2, "*/");
+            if (!end) {
+                emit(o, i, len, FACE_COMMENT);
+                return ST_COMMENT;
+            }
+            int j = (int)(end - s) + 2;
+            emit(o, i, j, FACE_COMMENT);
+            i = j;
+            continue;
+        }
+        if (c == '"' || c == '\'' || (c == '`' && lang->js)) {
+            int closed;
+            int j = scan_string(s, i + 1, c, &closed);
+            emit(o, i, j, FACE_STRING);
+            if (!closed) {
+                /* Template literals span lines; other strings only
+                 * through a trailing backslash */
+                if (c == '`' || s[len - 1] == '\\') return quote_state(c);
+                break;
+            }
+            i = j;
+            continue;
+        }
+        if (isdigit((unsigned char)c) && (i == 0 || !is_word(s[i - 1], lang->js))) {
+            int j = i;
+            while (is_word(s[j], 0) || s[j] == '.') j++;
+            emit(o, i, j, FACE_NUMBER);
+            i = j;
+            continue;
+        }
+        if (is_word(c, lang->js)) {
+            int j = i;
+            while (is_word(s[j], lang->js)) j++;
+            if (o) {
+                if (in_list(lang->keywords, s + i, j - i)) emit(o, i, j, FACE_KEYWORD);
+                else if (in_list(lang->types, s + i, j - i)) emit(o, i, j, FACE_TYPE);
+            }
+            i = j;
+            continue;
+        }
+        i++;
+    }
+    return ST_NORMAL;
+}
+
+/* --- Shell --- */
+
+static int lex_shell(const SyntaxLang *lang, const char *s, int state, LexOut *o) {
+    int len = (int)strlen(s);
+    int i = 0;
+
+    if (state == ST_SQUOTE) {
+        const char *end = strchr(s, '\'');
+        i = end ? (int)(end - s) + 1 : len;
+        emit(o, 0, i, FACE_STRING);
+        if (!end) return ST_SQUOTE;
+    } else if (state == ST_DQUOTE) {
+        int closed;
+        i = scan_string(s, 0, '"', &closed);
+        emit(o, 0, i, FACE_STRING);
+        if (!closed) return ST_DQUOTE;
+    }
+
+    while (i < len) {
+        char c = s[i];
+        if (c == '#' && (i == 0 || isspace((unsigned char)s[i - 1]) || s[i - 1] == ';')) {
+            emit(o, i, len, FACE_COMMENT);
+            break;
+        }
+        if (c == '\\') {
+            i += s[i + 1] ? 2 : 1;
+            continue;
+        }
+        if (c == '\'') {
+            const char *end = strchr(s + i + 1, '\'');
+            if (!end) {
+                emit(o, i, len, FACE_STRING);
+                return ST_SQUOTE;
+            }
+            int j = (int)(end - s) + 1;
+            emit(o, i, j, FACE_STRING);
+            i = j;
+            continue;
+        }
+        if (c == '"') {
+            int closed;
+            int j = scan_string(s, i + 1, '"', &closed);
+            emit(o, i, j, FACE_STRING);
+            if (!closed) return ST_DQUOTE;
+            i = j;
+            continue;
+        }
+        if (c == '$') {
+            int j = i + 1;
+            if (s[j] == '{') {
+                const char *end = strchr(s + j, '}');
+                j = end ? (int)(end - s) + 1 : len;
+            } else if (is_word(s[j], 0)) {
+                while (is_word(s[j], 0)) j++;
+            } else if (s[j] && strchr("?#@*!$-", s[j])) {
+                j++;
+            }
+            emit(o, i, j, FACE_VARIABLE);
+            i = j;
+            continue;
+        }
+        if (is_word(c, 0)) {
+            int j = i;
+            while (is_word(s[j], 0) || s[j] == '-') j++;
+            if (o && in_list(lang->keywords, s + i, j - i)) emit(o, i, j, FACE_KEYWORD);
+            i = j;
+            continue;
+        }
+        i++;
+    }
+    return ST_NORMAL;
+}
+
+/* --- Log files: no state crosses lines --- */
+
+static const char *const log_errors[]   = { "ERROR", "ERR", "FATAL", "CRITICAL", "CRIT",
+                                            "PANIC", "FAILED", "error", "fatal", "failed", NULL };
+static const char *const log_warnings[] = { "WARN", "WARNING", "warn", "warning", NULL };
+static const char *const log_levels[]   = { "INFO", "NOTICE", "DEBUG", "TRACE",
+                                            "info", "notice", "debug", "trace", NULL };
+
+static int lex_log(const SyntaxLang *lang, const char *s, int state, LexOut *o) {
+    (void)lang;
+    (void)state;
+    if (!o) return ST_NORMAL;
+    int i = 0;
+    /* Leading timestamp: "2024-01-02 03:04:05.678", "Jan  2 03:04:05" */
+    if (isdigit((unsigned char)s[0]) ||
+        (isupper((unsigned char)s[0]) && strlen(s) > 5 && s[3] == ' ' &&
+         isdigit((unsigned char)s[5]))) {
+        int j = isdigit((unsigned char)s[0]) ? 0 : 4;
+        while (s[j] && (isdigit((unsigned char)s[j]) || strchr(":-./T,+Z ", s[j]))) j++;
+        while (j > 0 && s[j - 1] == ' ') j--;
+        emit(o, 0, j, FACE_NUMBER);
+        i = j;
+    }
+    while (s[i]) {
+        if (s[i] == '"') {
+            int closed;
+            int j = scan_string(s, i + 1, '"', &closed);
+            emit(o, i, j, FACE_STRING);
+            i = j;
+            continue;
+        }
+        if (isalpha((unsigned char)s[i])) {
+            int j = i;
+            while (isalpha((unsigned char)s[j])) j++;
+            if (in_list(log_errors, s + i, j - i)) emit(o, i, j, FACE_ERROR);
+            else if (in_list(log_warnings, s + i, j - i)) emit(o, i, j, FACE_WARNING);
+            else if (in_list(log_levels, s + i, j - i)) emit(o, i, j, FACE_KEYWORD);
+            i = j;
+            continue;
+        }
+        i++;
+    }
+    return ST_NORMAL;
+}
+
+/* --- Languages --- */
+
+static const char *const c_exts[] = { ".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp", NULL };
+static const char *const c_keywords[] = {
+    "if", "else", "for", "while", "do", "switch", "case", "default", "break",
+    "continue", "return", "goto", "sizeof", "typedef", "struct", "union", "enum",
+    "static", "extern", "const", "volatile", "inline", "register", "restrict",
+    "auto", "class", "namespace", "template", "public", "private", "protected",
+    "new", "delete", "virtual", "NULL", "true", "false", NULL
+};
+static const char *const c_types[] = {
+    "void", "char", "short", "int", "long", "float", "double", "signed",
+    "unsigned", "bool", "_Bool", "size_t", "ssize_t", "off_t", "pid_t",
+    "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t", "uint16_t",
+    "uint32_t", "uint64_t", "FILE", NULL
+};
+static const char *const js_exts[] = { ".js", ".mjs", ".cjs", ".json", NULL };
+static const char *const js_keywords[] = {
+    "var", "let", "const", "function", "return", "if", "else", "for", "while",
+    "do", "switch", "case", "default", "break", "continue", "new", "delete",
+    "typeof", "instanceof", "in", "of", "class", "extends", "super", "this",
+    "null", "undefined", "true", "false", "try", "catch", "finally", "throw",
+    "async", "await", "yield", "import", "export", "from", NULL
+};
+static const char *const sh_exts[] = { ".sh", ".bash", ".bashrc", ".profile", NULL };
+static const char *const sh_keywords[] = {
+    "if", "then", "else", "elif", "fi", "for", "while", "until", "do", "done",
+    "case", "esac", "in", "function", "return", "local", "export", "readonly",
+    "set", "unset", "shift", "exit", "source", NULL
+};
+static const char *const log_exts[] = { ".log", NULL };
+
+static const SyntaxLang s_langs[] = {
+    { "c",   c_exts,   lex_clike, c_keywords,  c_types, 0 },
+    { "js",  js_exts,  lex_clike, js_keywords, NULL,    1 },
+    { "sh",  sh_exts,  lex_shell, sh_keywords, NULL,    0 },
+    { "log", log_exts, lex_log,   NULL,        NULL,    0 },
+};
+#define NUM_LANGS (int)(sizeof(s_langs) / sizeof(s_langs[0]))
+
+static const SyntaxLang *lang_for_file(const char *filename) {
+    if (!filename) return NULL;
+    size_t len = strlen(filename);
+    for (int i = 0; i < NUM_LANGS; i++) {
+        for (const char *const *ext = s_langs[i].exts; *ext; ext++) {
+            size_t n = strlen(*ext);
+            if (len >= n && strcmp(filename + len - n, *ext) == 0) return &s_langs[i];
+        }
+    }
+    return NULL;
+}
+
+/* --- Per-line state --- */
+
+/* Generations are unique across buffers, so a piece's generation alone
+ * names the Syntax it belongs to */
+static unsigned long s_next_gen;
+
+static int reserve(Syntax *sx, int need) {
+    if (need <= sx->cap) return 0;
+    int new_cap = sx->cap ? sx->cap : 64;
+    while (new_cap < need) new_cap *= 2;
+    SyntaxLine *lines = realloc(sx->lines, sizeof(SyntaxLine) * new_cap);
+    if (!lines) return -1;
+    sx->lines = lines;
+    sx->cap = new_cap;
+    return 0;
+}
+
+static void clear_lines(Syntax *sx, int start, int n) {
+    for (int i = start; i < start + n; i++) {
+        free(sx->lines[i].spans);
+        sx->lines[i] = (SyntaxLine){ ST_UNKNOWN, 0, 0, 0, NULL };
+    }
+}
+
+static void cancel_bg(Syntax *sx) {
+    if (!sx->bg_gen) return;
+    lex_worker_cancel(sx->bg_gen);
+    sx->bg_gen = 0;
+}
+
+static int lex_state(const void *lang, const char *line, int state) {
+    const SyntaxLang *l = lang;
+    return l->lex(l, line, state, NULL);
+}
+
+/* Lex the whole buffer on a background thread, viewport first. */
+static int start_bg(Buffer *buf) {
+    Syntax *sx = buf->syntax;
+    cancel_bg(sx);
+    if (lex_worker_start(sx->gen, buf, buf->top_line, lex_state, sx->lang) != 0) return -1;
+    sx->bg_gen = sx->gen;
+    sx->bg_limit = INT_MAX;
+    return 0;
+}
+
+/* Forget everything: lex the buffer from the top again. */
+static void reset(Buffer *buf) {
+    Syntax *sx = buf->syntax;
+    cancel_bg(sx);
+    sx->gen = ++s_next_gen;
+    clear_lines(sx, 0, sx->num_lines);
+    sx->num_lines = 0;
+    if (reserve(sx, buf->num_lines) != 0) {
+        sx->dirty_lo = -1;          /* nothing cached: draw uncoloured */
+        return;
+    }
+    sx->num_lines = buf->num_lines;
+    for (int i = 0; i < sx->num_lines; i++)
+        sx->lines[i] = (SyntaxLine){ ST_UNKNOWN, 0, 0, 0, NULL };
+    if (sx->num_lines > 0) sx->lines[0].state = ST_NORMAL;
+    sx->dirty_lo = 0;
+    sx->dirty_hi = sx->num_lines - 1;
+    /* Big files are lexed off the UI thread from the start */
+    if (sx->num_lines > LEX_UI_LINES) start_bg(buf);
+}
+
+const char *syntax_attach(Buffer *buf, const char *name) {
+    const SyntaxLang *lang = NULL;
+    if (!name) {
+        lang = lang_for_file(buf->filename);
+    } else {
+        for (int i = 0; i < NUM_LANGS; i++)
+            if (strcmp(s_langs[i].name, name) == 0) lang = &s_langs[i];
+    }
+    syntax_detach(buf);
+    if (!lang || buf->is_shell) return NULL;
+
+    buf->syntax = calloc(1, sizeof(Syntax));
+    if (!buf->syntax) return NULL;
+    buf->syntax->lang = lang;
+    reset(buf);
+    return lang->name;
+}
+
+void syntax_detach(Buffer *buf) {
+    Syntax *sx = buf->syntax;
+    if (!sx) return;
+    cancel_bg(sx);
+    clear_lines(sx, 0, sx->num_lines);
+    free(sx->lines);
+    free(sx);
+    buf->syntax = NULL;
+}
+
+void syntax_lines_changed(Buffer *buf, int start, int old_n, int new_n) {
+    Syntax *sx = buf->syntax;
+    if (!sx) return;
+    if (start < 0 || start + old_n > sx->num_lines ||
+        sx->num_lines - old_n + new_n != buf->num_lines ||
+        reserve(sx, buf->num_lines) != 0) {
+        reset(buf);                 /* out of step */
+        return;
+    }
+    sx->gen = ++s_next_gen;
+    /* The running job's results stay good above the edit */
+    if (sx->bg_gen) {
+        if (start < sx->bg_limit) sx->bg_limit = start;
+        if (sx->bg_limit == 0) cancel_bg(sx);
+    }
+
+    /* Splice, keeping the start state of the first line: it depends
+     * only on the lines above */
+    int state = start < sx->num_lines ? sx->lines[start].state : ST_UNKNOWN;
+    clear_lines(sx, start, old_n);
+    memmove(&sx->lines[start + new_n], &sx->lines[start + old_n],
+            sizeof(SyntaxLine) * (size_t)(sx->num_lines - start - old_n));
+    sx->num_lines += new_n - old_n;
+    for (int i = start; i < start + new_n; i++)
+        sx->lines[i] = (SyntaxLine){ ST_UNKNOWN, 0, 0, 0, NULL };
+    if (new_n > 0 && start < sx->num_lines) sx->lines[start].state = state;
+
+    /* A pure deletion moves a line up into `start` with the state it had
+     * below the deleted lines: rebuild it from the line above */
+    int lo = start;
+    if (new_n == 0 && start < sx->num_lines) {
+        SyntaxLine *sl = &sx->lines[start];
+        sl->spans_ok = 0;
+        if (start == 0) {
+            sl->state = ST_NORMAL;
+        } else {
+            sl->state = ST_UNKNOWN;
+            lo = start - 1;
+        }
+    }
+
+    int hi = start + new_n - 1;
+    if (sx->dirty_lo < 0) {
+        sx->dirty_lo = lo;
+        sx->dirty_hi = hi;
+    } else {
+        if (sx->dirty_hi >= start + old_n) sx->dirty_hi += new_n - old_n;
+        if (lo < sx->dirty_lo) sx->dirty_lo = lo;
+        if (hi > sx->dirty_hi) sx->dirty_hi = hi;
+    }
+    if (sx->dirty_lo >= sx->num_lines) sx->dirty_lo = -1;
+}
+
+/*
+ * Lex forward from dirty_lo until line ln's start state is known.  Past
+ * the edited lines, a line entered in the state it was last lexed with
+ * ends the work: everything below is already right.  When that is too
+ * far, a background job does it and ln is drawn from its current state.
+ */
+static void catch_up(Syntax *sx, Buffer *buf, int ln) {
+    if (sx->dirty_lo >= 0 && ln - sx->dirty_lo > LEX_UI_LINES &&
+        (sx->bg_gen || start_bg(buf) == 0))
+        return;
+    while (sx->dirty_lo >= 0 && sx->dirty_lo < ln) {
+        int i = sx->dirty_lo;
+        int end = sx->lang->lex(sx->lang, buf->lines[i], sx->lines[i].state, NULL);
+        SyntaxLine *next = &sx->lines[i + 1];
+        if (i + 1 >= sx->num_lines ||
+            (i + 1 > sx->dirty_hi && !next->guess && next->state == end)) {
+            sx->dirty_lo = -1;
+            break;
+        }
+        if (next->state != end) {
+            next->state = (unsigned char)end;
+            next->spans_ok = 0;
+        }
+        next->guess = 0;
+        sx->dirty_lo = i + 1;
+    }
+}
+
+/*
+ * Apply one piece of a background job to the buffer it was made for.
+ * Lines at or above the first edit made since the snapshot are still
+ * valid (a line's start state depends only on the lines above it);
+ * the rest of the piece is stale and dropped.  Lines before dirty_lo
+ * are exact already and keep their states.
+ */
+static void apply_piece(Buffer *buf, const LexPiece *piece) {
+    Syntax *sx = buf->syntax;
+    int last = piece->first + piece->n - 1;
+    if (last > sx->bg_limit) last = sx->bg_limit;
+    if (last >= sx->num_lines) last = sx->num_lines - 1;
+    int i = piece->first;
+    if (!piece->exact && sx->dirty_lo >= 0 && i < sx->dirty_lo) i = sx->dirty_lo;
+    if (sx->dirty_lo < 0 && !piece->exact) i = last + 1;
+    for (; i <= last; i++) {
+        SyntaxLine *sl = &sx->lines[i];
+        unsigned char st = piece->states[i - piece->first];
+        if (sl->state != st) {
+            sl->state = st;
+            sl->spans_ok = 0;
+        }
+        sl->guess = !piece->exact;
+    }
+    if (!piece->last) return;
+
+    /* Job done: every state it published up to the limit is exact.  A
+     * job that failed leaves the work to catch_up() */
+    sx->bg_gen = 0;
+    if (!piece->exact) return;
+    int limit = sx->bg_limit < sx->num_lines ? sx->bg_limit : sx->num_lines - 1;
+    for (i = 0; i <= limit; i++) sx->lines[i].guess = 0;
+    if (limit == sx->num_lines - 1 && sx->bg_limit >= sx->num_lines) sx->dirty_lo = -1;
+    else if (sx->dirty_lo >= 0 && sx->dirty_lo < limit) sx->dirty_lo = limit;
+}
+
+/* Apply the pieces background jobs have published. */
+void syntax_bg_results(Buffer **buffers, int num_buffers) {
+    LexPiece *piece;
+    while ((piece = lex_worker_take())) {
+        for (int i = 0; i < num_buffers; i++) {
+            Syntax *sx = buffers[i]->syntax;
+            if (sx && sx->bg_gen && sx->bg_gen == piece->gen) {
+                apply_piece(buffers[i], piece);
+                break;
+            }
+        }
+        lex_piece_free(piece);
+    }
+}
+
+const HlSpan *syntax_spans(Buffer *buf, int ln, int *n) {
+    Syntax *sx = buf->syntax;
+    *n = 0;
+    if (!sx || ln < 0 || ln >= sx->num_lines || ln >= buf->num_lines) return NULL;
+    catch_up(sx, buf, ln);
+    SyntaxLine *sl = &sx->lines[ln];
+    if (!sl->spans_ok) {
+        /* Reuse the old array, which holds at least num_spans */
+        LexOut o = { sl->spans, 0, sl->num_spans };
+        sx->lang->lex(sx->lang, buf->lines[ln], sl->state, &o);
+        sl->spans = o.spans;
+        sl->num_spans = o.n;
+        sl->spans_ok = 1;
+    }
+    *n = sl->num_spans;
+    return sl->spans;
+}
@@ -0,0 +1,72 @@
+#ifndef SYNTAX_H
+#define SYNTAX_H
+
+#include "buffer.h"
+
+/* Highlight faces; ui.c maps each to a colour pair */
+enum {
+    FACE_DEFAULT,
+    FACE_KEYWORD,
+    FACE_TYPE,
+    FACE_STRING,
+    FACE_COMMENT,
+    FACE_NUMBER,
+    FACE_PREPROC,
+    FACE_VARIABLE,
+    FACE_ERROR,
+    FACE_WARNING
+};
+
+/* Bytes [start, end) of a line drawn in `face` */
+typedef struct HlSpan {
+    int start;
+    int end;
+    int face;
+} HlSpan;
+
+/*
+ * Highlighting state of one buffer.  Every line records the lexer state
+ * at its start, so a line can be lexed without looking at the ones above
+ * it.  An edit marks the lines it touched dirty; they are re-lexed, on
+ * demand and only as far down as the lines being drawn, until the state
+ * entering an untouched line is the one it was lexed with before.  Spans
+ * are kept only for lines that have been drawn.
+ */
+typedef struct SyntaxLine {
+    unsigned char state;    /* lexer state at line start */
+    unsigned char spans_ok; /* spans match the text and state */
+    unsigned char guess;    /* state from a background job's guess */
+    int num_spans;
+    HlSpan *spans;
+} SyntaxLine;
+
+typedef struct Syntax {
+    const struct SyntaxLang *lang;
+    SyntaxLine *lines;      /* parallel to Buffer.lines */
+    int num_lines;
+    int cap;
+    /* Lines before dirty_lo have correct start states; lines in
+     * [dirty_lo, dirty_hi] were edited.  dirty_lo < 0: all clean. */
+    int dirty_lo;
+    int dirty_hi;
+    unsigned long gen;      /* bumped by every edit */
+    unsigned long bg_gen;   /* generation of the running job, 0 if none */
+    int bg_limit;           /* first line edited since the job's snapshot */
+} Syntax;
+
+/*
+ * Highlight buf as language `name` ("c", "js", "sh", "log"), or as
+ * guessed from its file name when name is NULL.  Returns the language
+ * used, or NULL (highlighting off) if none applies.
+ */
+const char *syntax_attach(Buffer *buf, const char *name);
+void syntax_detach(Buffer *buf);
+/* Lines [start, start + old_n) of buf became [start, start + new_n). */
+void syntax_lines_changed(Buffer *buf, int start, int old_n, int new_n);
+/* Spans of line ln, sorted and non-overlapping; *n = 0 if none. */
+const HlSpan *syntax_spans(Buffer *buf, int ln, int *n);
+/* Take in background lexing results (lex_worker.c) for whichever of
+ * `buffers` they belong to. */
+void syntax_bg_results(Buffer **buffers, int num_buffers);
+
+#endif /* SYNTAX_H */
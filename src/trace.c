@@ -0,0 +1,174 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_RING_SIZE   65536     /* events per thread, a power of two */
+#define TRACE_MAX_RINGS   32        /* threads beyond this are not traced */
+
+typedef struct TraceEvent {
+    const char *name;
+    long ts;                /* CLOCK_MONOTONIC ns */
+    long n;                 /* args.n of an end event, -1 if none */
+    int tid;
+    char phase;             /* 'B' or 'E' */
+} TraceEvent;
+
+typedef struct TraceRing {
+    const char *name;       /* thread kind, shared by the threads using it */
+    int in_use;             /* owned by a live thread */
+    unsigned long head;     /* events ever written; written by the owner */
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+int g_trace_on;
+
+static TraceRing *s_rings[TRACE_MAX_RINGS];
+static int s_num_rings;
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t s_ring_key;
+static pthread_once_t s_key_once = PTHREAD_ONCE_INIT;
+static long s_start_ns;
+
+static __thread TraceRing *t_ring;
+static __thread const char *t_name;
+static __thread int t_tid;
+static __thread int t_no_ring;      /* all rings taken: drop events */
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Thread exit: the ring, and the events in it, pass to the next thread
+ * of the same kind. */
+static void release_ring(void *ring) {
+    __atomic_store_n(&((TraceRing *)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void) {
+    pthread_key_create(&s_ring_key, release_ring);
+}
+
+static TraceRing *acquire_ring(void) {
+    const char *name = t_name ? t_name : "main";
+    pthread_once(&s_key_once, make_key);
+    pthread_mutex_lock(&s_lock);
+    TraceRing *ring = NULL;
+    for (int i = 0; i < s_num_rings && !ring; i++) {
+        TraceRing *r = s_rings[i];
+        if (!__atomic_load_n(&r->in_use, __ATOMIC_ACQUIRE) && strcmp(r->name, name) == 0)
+            ring = r;
+    }
+    if (!ring && s_num_rings < TRACE_MAX_RINGS) {
+        ring = calloc(1, sizeof(TraceRing));
+        if (ring) {
+            ring->name = name;
+            s_rings[s_num_rings++] = ring;
+        }
+    }
+    if (ring) ring->in_use = 1;
+    pthread_mutex_unlock(&s_lock);
+    if (!ring) {
+        t_no_ring = 1;
+        return NULL;
+    }
+    pthread_setspecific(s_ring_key, ring);
+    t_tid = (int)syscall(SYS_gettid);
+    return ring;
+}
+
+void trace_event(const char *name, char phase, long n) {
+    TraceRing *ring = t_ring;
+    if (!ring) {
+        if (t_no_ring || !(ring = t_ring = acquire_ring())) return;
+    }
+    unsigned long h = ring->head;
+    TraceEvent *ev = &ring->events[h & (TRACE_RING_SIZE - 1)];
+    ev->name = name;
+    ev->ts = now_ns();
+    ev->n = n;
+    ev->tid = t_tid;
+    ev->phase = phase;
+    __atomic_store_n(&ring->head, h + 1, __ATOMIC_RELEASE);
+}
+
+void trace_thread_name(const char *name) {
+    t_name = name;
+}
+
+const char *trace_default_path(void) {
+    const char *path = getenv(TRACE_ENV);
+    return path && *path ? path : TRACE_DEFAULT_FILE;
+}
+
+void trace_start(void) {
+    s_start_ns = now_ns();
+    __atomic_store_n(&g_trace_on, 1, __ATOMIC_RELAXED);
+}
+
+/* Write `s` as a JSON string body. */
+static void put_json_string(FILE *f, const char *s) {
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        fputc(*s, f);
+    }
+}
+
+/*
+ * Rings are read while their threads may still be running; events a
+ * late writer overwrites during the dump can come out garbled, which
+ * the end-without-begin check below mostly hides.
+ */
+int trace_stop(const char *path) {
+    __atomic_store_n(&g_trace_on, 0, __ATOMIC_RELAXED);
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    int pid = (int)getpid();
+    int count = 0;
+    const char *sep = "";
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+    pthread_mutex_lock(&s_lock);
+    int nrings = s_num_rings;
+    pthread_mutex_unlock(&s_lock);
+    for (int r = 0; r < nrings; r++) {
+        TraceRing *ring = s_rings[r];
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        int depth = 0, last_tid = 0;
+        for (unsigned long i = first; i < head; i++) {
+            const TraceEvent *ev = &ring->events[i & (TRACE_RING_SIZE - 1)];
+            if (ev->ts < s_start_ns) continue;
+            if (ev->tid != last_tid) {
+                /* A new thread took over the ring (or the first one) */
+                fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+                        "\"tid\": %d, \"args\": {\"name\": \"", sep, pid, ev->tid);
+                put_json_string(f, ring->name);
+                fprintf(f, "\"}}");
+                sep = ",\n";
+                last_tid = ev->tid;
+                depth = 0;
+            }
+            /* The ring wrapped or tracing started inside a span */
+            if (ev->phase == 'E' && depth == 0) continue;
+            depth += ev->phase == 'B' ? 1 : -1;
+            fprintf(f, "%s{\"name\": \"", sep);
+            sep = ",\n";
+            put_json_string(f, ev->name);
+            fprintf(f, "\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d",
+                    ev->phase, (ev->ts - s_start_ns) / 1e3, pid, ev->tid);
+            if (ev->n >= 0) fprintf(f, ", \"args\": {\"n\": %ld}", ev->n);
+            fprintf(f, "}");
+            count++;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) return -1;
+    return count;
+}
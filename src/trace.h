@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Event tracing in Chrome trace format (chrome://tracing, Perfetto).
+ * While tracing is on, TRACE_BEGIN/TRACE_END record timestamped begin
+ * and end events into a ring owned by the calling thread: no locks, the
+ * owner only publishes the ring head with a release store.  Each ring
+ * keeps the last TRACE_RING_SIZE events.  When tracing is off the macros
+ * cost one relaxed load.  Names must be string literals.
+ */
+extern int g_trace_on;
+
+#define TRACE_ON() __atomic_load_n(&g_trace_on, __ATOMIC_RELAXED)
+#define TRACE_BEGIN(name) \
+    do { if (TRACE_ON()) trace_event((name), 'B', -1); } while (0)
+#define TRACE_END(name) \
+    do { if (TRACE_ON()) trace_event((name), 'E', -1); } while (0)
+/* End event carrying a count (bytes read, key code) as args.n */
+#define TRACE_END_N(name, n) \
+    do { if (TRACE_ON()) trace_event((name), 'E', (long)(n)); } while (0)
+
+void trace_event(const char *name, char phase, long n);
+/* Name the calling thread's track ("lex", "worker"); threads that share
+ * a name reuse each other's rings once they exit.  Default "main". */
+void trace_thread_name(const char *name);
+
+/* Set to a file name, tracing runs from startup and is written there at
+ * exit; it is also where trace-stop writes by default. */
+#define TRACE_ENV "MYFANCYEDITOR_TRACE"
+#define TRACE_DEFAULT_FILE "myfancyeditor-trace.json"
+
+/* $MYFANCYEDITOR_TRACE if set, else TRACE_DEFAULT_FILE */
+const char *trace_default_path(void);
+void trace_start(void);
+/* Stop tracing and write the events since trace_start() to `path`.
+ * Returns the number of events written, or -1. */
+int trace_stop(const char *path);
+
+#endif /* TRACE_H */
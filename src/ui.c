@@ -2,11 +2,19 @@
 #include "editor.h"
 #include "buffer.h"
 #include "shell_buf.h"
+#include "file_watch.h"
+#include "script.h"
+#include "worker.h"
+#include "utf8.h"
+#include "wrap.h"
+#include "syntax.h"
+#include "lex_worker.h"
+#include "stats.h"
+#include "trace.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/select.h>
-#include <sys/time.h>
+#include <poll.h>
 #include <unistd.h>
 
 #define MODELINE_BUF_SIZE 1024
@@ -17,8 +25,10 @@
 /* Max line length when reading files */
 #define MAX_LINE_LENGTH 4096
 
-void ui_init(Editor *e) {
-    initscr();
+/* Screen made by ui_init_term(), NULL for the initscr() one */
+static SCREEN *s_screen;
+
+static void ui_setup(Editor *e) {
     cbreak();
     noecho();
     keypad(stdscr, TRUE);
@@ -31,6 +41,15 @@ void ui_init(Editor *e) {
         init_pair(COLOR_MSG,      COLOR_GREEN, -1);
         init_pair(COLOR_SHELL,    COLOR_CYAN,  -1);
         init_pair(COLOR_HELP,     COLOR_YELLOW, COLOR_BLUE);
+        init_pair(COLOR_KEYWORD,  COLOR_MAGENTA, -1);
+        init_pair(COLOR_TYPE,     COLOR_GREEN, -1);
+        init_pair(COLOR_STRING,   COLOR_YELLOW, -1);
+        init_pair(COLOR_COMMENT,  COLOR_BLUE, -1);
+        init_pair(COLOR_NUMBER,   COLOR_CYAN, -1);
+        init_pair(COLOR_PREPROC,  COLOR_RED, -1);
+        init_pair(COLOR_VARIABLE, COLOR_CYAN, -1);
+        init_pair(COLOR_ERROR,    COLOR_RED, -1);
+        init_pair(COLOR_WARNING,  COLOR_YELLOW, -1);
     }
 
     /* Compute window sizes */
@@ -48,8 +67,25 @@ void ui_init(Editor *e) {
     wtimeout(e->edit_win, 50);
 }
 
+void ui_init(Editor *e) {
+    initscr();
+    ui_setup(e);
+}
+
+/* Draw to `out` instead of the controlling terminal (headless mode). */
+int ui_init_term(Editor *e, const char *term, FILE *out, FILE *in) {
+    s_screen = newterm(term, out, in);
+    if (!s_screen) return -1;
+    ui_setup(e);
+    return 0;
+}
+
 void ui_cleanup(void) {
     endwin();
+    if (s_screen) {
+        delscreen(s_screen);
+        s_screen = NULL;
+    }
 }
 
 void ui_resize(Editor *e) {
@@ -76,43 +112,173 @@ void ui_resize(Editor *e) {
     }
 }
 
-void ui_draw_buffer(Editor *e) {
-    Buffer *buf = editor_current_buffer(e);
-    if (!buf) return;
+/*
+ * Draw line[i, end) at the window's cursor, starting at screen column
+ * `col`, showing columns [left, left + width): tabs expand to tab stops,
+ * control characters show as ^X, and malformed bytes or characters the
+ * locale cannot print as U+FFFD.  Returns 1 if the text was cut off at
+ * the right edge.
+ */
+static int draw_span(WINDOW *win, const char *line, size_t i, size_t end,
+                     int *colp, int left, int width) {
+    int col = *colp;
+    while (i < end && line[i]) {
+        int cp;
+        /* At most 4 bytes are examined, none past the NUL */
+        int n = utf8_decode(line + i, 4, &cp);
+        int w = utf8_width(cp, col);
+        if (col + w - left > width) {
+            *colp = col;
+            return 1;
+        }
+        if (col < left) {
+            /* Wide character or tab straddling the left edge */
+            for (int k = left; k < col + w; k++) waddch(win, ' ');
+        } else if (cp == '\t') {
+            for (int k = 0; k < w; k++) waddch(win, ' ');
+        } else if (cp >= 0 && (cp < 0x20 || cp == 0x7F)) {
+            waddch(win, '^');
+            waddch(win, cp == 0x7F ? '?' : cp + '@');
+        } else if (!utf8_printable(cp)) {
+            waddstr(win, "\xef\xbf\xbd");
+        } else {
+            waddnstr(win, line + i, n);
+        }
+        col += w;
+        i += (size_t)n;
+    }
+    *colp = col;
+    return 0;
+}
 
-    werase(e->edit_win);
+static attr_t face_attr(int face) {
+    switch (face) {
+    case FACE_KEYWORD:  return COLOR_PAIR(COLOR_KEYWORD) | A_BOLD;
+    case FACE_TYPE:     return COLOR_PAIR(COLOR_TYPE);
+    case FACE_STRING:   return COLOR_PAIR(COLOR_STRING);
+    case FACE_COMMENT:  return COLOR_PAIR(COLOR_COMMENT);
+    case FACE_NUMBER:   return COLOR_PAIR(COLOR_NUMBER);
+    case FACE_PREPROC:  return COLOR_PAIR(COLOR_PREPROC);
+    case FACE_VARIABLE: return COLOR_PAIR(COLOR_VARIABLE);
+    case FACE_ERROR:    return COLOR_PAIR(COLOR_ERROR) | A_BOLD;
+    case FACE_WARNING:  return COLOR_PAIR(COLOR_WARNING) | A_BOLD;
+    default:            return A_NORMAL;
+    }
+}
 
-    /* Adjust scroll so cursor is visible */
-    if (buf->cursor_line < buf->top_line)
-        buf->top_line = buf->cursor_line;
-    if (buf->cursor_line >= buf->top_line + e->edit_height)
-        buf->top_line = buf->cursor_line - e->edit_height + 1;
+/*
+ * draw_span() for bytes [i, end) of line ln, in the colours of the
+ * line's cached highlight spans.
+ */
+static int draw_line_part(WINDOW *win, Buffer *buf, int ln, size_t i, size_t end,
+                          int col, int left, int width) {
+    const char *line = buf->lines[ln];
+    int n = 0;
+    const HlSpan *sp = buf->syntax ? syntax_spans(buf, ln, &n) : NULL;
+    for (int k = 0; k < n && i < end; k++) {
+        size_t s = (size_t)sp[k].start, t = (size_t)sp[k].end;
+        if (t <= i) continue;
+        if (s > i) {
+            if (draw_span(win, line, i, s < end ? s : end, &col, left, width)) return 1;
+            i = s;
+            if (i >= end) break;
+        }
+        attr_t a = face_attr(sp[k].face);
+        wattron(win, a);
+        int cut = draw_span(win, line, i, t < end ? t : end, &col, left, width);
+        wattroff(win, a);
+        if (cut) return 1;
+        i = t;
+    }
+    return i < end ? draw_span(win, line, i, end, &col, left, width) : 0;
+}
+
+/*
+ * Truncated display: each line is one row scrolled to buf->left_col.
+ * Drawing starts at the first visible character, found through the
+ * line's column table, so a scrolled-over prefix costs nothing however
+ * long it is.  A line cut off at the right edge ends in '$'.
+ */
+static void draw_truncated(Editor *e, Buffer *buf) {
+    /* The last column is kept for the '$' marker, and a cursor that
+     * leaves the view recenters it, as in Emacs */
+    int text_width = e->edit_width - 1;
+    int cur_col = buffer_display_col(buf, buf->cursor_line, buf->cursor_col);
+    if (cur_col < buf->left_col || cur_col >= buf->left_col + text_width) {
+        buf->left_col = cur_col < text_width ? 0 : cur_col - text_width / 2;
+    }
 
     int screen_row = 0;
     for (int ln = buf->top_line; ln < buf->num_lines && screen_row < e->edit_height;
          ln++, screen_row++) {
         char *line = buf->lines[ln];
         if (!line) continue;
-        int len = (int)strlen(line);
-
-        /* Truncate display to window width */
-        int disp_len = len < e->edit_width ? len : e->edit_width - 1;
-        if (buf->is_shell) {
-            wattron(e->edit_win, COLOR_PAIR(COLOR_SHELL));
-        }
-        mvwaddnstr(e->edit_win, screen_row, 0, line, disp_len);
-        if (buf->is_shell) {
-            wattroff(e->edit_win, COLOR_PAIR(COLOR_SHELL));
-        }
+        size_t start = (size_t)buffer_col_to_byte(buf, ln, buf->left_col);
+        int col = buffer_display_col(buf, ln, (int)start);
+        wmove(e->edit_win, screen_row, 0);
+        if (draw_line_part(e->edit_win, buf, ln, start, (size_t)-1, col, buf->left_col, text_width))
+            waddch(e->edit_win, '$');
     }
 
     /* Position cursor */
     int cur_screen_row = buf->cursor_line - buf->top_line;
-    int cur_screen_col = buf->cursor_col;
-    if (cur_screen_col >= e->edit_width) cur_screen_col = e->edit_width - 1;
     if (cur_screen_row >= 0 && cur_screen_row < e->edit_height) {
-        wmove(e->edit_win, cur_screen_row, cur_screen_col);
+        wmove(e->edit_win, cur_screen_row, cur_col - buf->left_col);
     }
+}
+
+/*
+ * Visual line wrap: rows come from the buffer's wrap index, and the view
+ * starts at row top_row of top_line.  A row continued on the next one
+ * ends in '\\'.
+ */
+static void draw_wrapped(Editor *e, Buffer *buf) {
+    int text_width = e->edit_width - 1;
+    wrap_set_width(buf, text_width);
+
+    int cl = buf->cursor_line;
+    long cur_v = wrap_vrow(buf, cl) + wrap_row_of(buf, cl, buf->cursor_col);
+    long top_v = wrap_vrow(buf, buf->top_line) + buf->top_row;
+    if (cur_v < top_v) top_v = cur_v;
+    if (cur_v >= top_v + e->edit_height) top_v = cur_v - e->edit_height + 1;
+    wrap_locate(buf, top_v, &buf->top_line, &buf->top_row);
+
+    int ln = buf->top_line, row = buf->top_row;
+    for (int screen_row = 0; screen_row < e->edit_height && ln < buf->num_lines;
+         screen_row++) {
+        int rows = wrap_rows(buf, ln);
+        wmove(e->edit_win, screen_row, 0);
+        draw_line_part(e->edit_win, buf, ln, (size_t)wrap_row_start(buf, ln, row),
+                       (size_t)wrap_row_end(buf, ln, row), 0, 0, text_width);
+        if (row < rows - 1) mvwaddch(e->edit_win, screen_row, text_width, '\\');
+        if (++row >= rows) {
+            ln++;
+            row = 0;
+        }
+    }
+
+    /* Position cursor */
+    int cur_screen_col = wrap_col_in_row(buf, cl, buf->cursor_col);
+    if (cur_screen_col > text_width) cur_screen_col = text_width;
+    wmove(e->edit_win, (int)(cur_v - top_v), cur_screen_col);
+}
+
+void ui_draw_buffer(Editor *e) {
+    Buffer *buf = editor_current_buffer(e);
+    if (!buf) return;
+
+    werase(e->edit_win);
+
+    /* Adjust scroll so cursor is visible */
+    if (buf->cursor_line < buf->top_line)
+        buf->top_line = buf->cursor_line;
+    if (buf->cursor_line >= buf->top_line + e->edit_height)
+        buf->top_line = buf->cursor_line - e->edit_height + 1;
+
+    if (buf->is_shell) wattron(e->edit_win, COLOR_PAIR(COLOR_SHELL));
+    if (buf->wrap) draw_wrapped(e, buf);
+    else draw_truncated(e, buf);
+    if (buf->is_shell) wattroff(e->edit_win, COLOR_PAIR(COLOR_SHELL));
 
     /* Show help overlay if requested */
     if (e->show_help) {
@@ -165,7 +331,8 @@ void ui_draw_modeline(Editor *e) {
         snprintf(modeline, sizeof(modeline),
                  "  %s%-20s  %s  %s  L%d C%d  [%d/%d]",
                  stype, buf->name, mod, fname,
-                 buf->cursor_line + 1, buf->cursor_col + 1,
+                 buf->cursor_line + 1,
+                 buffer_display_col(buf, buf->cursor_line, buf->cursor_col) + 1,
                  e->current_buffer + 1, e->num_buffers);
     } else {
         snprintf(modeline, sizeof(modeline), "  No buffer");
@@ -207,6 +374,8 @@ void ui_draw_minibuf(Editor *e) {
 }
 
 void ui_refresh(Editor *e) {
+    long start = stats_now_ns();
+    TRACE_BEGIN("ui_refresh");
     ui_draw_buffer(e);
     ui_draw_modeline(e);
     ui_draw_minibuf(e);
@@ -218,42 +387,120 @@ void ui_refresh(Editor *e) {
         wnoutrefresh(e->minibuf_win);
     }
     doupdate();
+    TRACE_END("ui_refresh");
+    stats_record(STAT_FRAME, stats_now_ns() - start);
+}
+
+static void input_push(Editor *e, int key) {
+    if (e->input_head == e->input_len) e->input_head = e->input_len = 0;
+    if (e->input_len == e->input_cap) {
+        int cap = e->input_cap ? e->input_cap * 2 : 32;
+        int *tmp = realloc(e->input, sizeof(int) * cap);
+        if (!tmp) return;
+        e->input = tmp;
+        e->input_cap = cap;
+    }
+    e->input[e->input_len++] = key;
+}
+
+/*
+ * Non-blocking check for C-g during long-running work (scripts, macro
+ * replay).  Everything waiting on stdin is read, so a C-g typed after
+ * other keys is seen; those keys are queued for ui_get_key().
+ */
+int ui_interrupt_pending(Editor *e) {
+    struct pollfd pfd = { .fd = fileno(stdin), .events = POLLIN };
+    if (!e->edit_win || poll(&pfd, 1, 0) <= 0) return 0;
+    int interrupted = 0;
+    wtimeout(e->edit_win, 0);
+    int key;
+    while ((key = wgetch(e->edit_win)) != ERR) {
+        if (key == 7 /* C-g */) interrupted = 1;
+        else input_push(e, key);
+    }
+    wtimeout(e->edit_win, 50);
+    return interrupted;
 }
 
 int ui_get_key(Editor *e) {
-    /* Poll shell buffer fds while waiting for keyboard */
-    fd_set rfds;
-    int maxfd = -1;
+    if (e->input_head < e->input_len) return e->input[e->input_head++];
+
+    /* Poll shell buffer and file-watch fds while waiting for keyboard.
+     * poll() rather than select(): with many shells open the PTY fds can
+     * exceed FD_SETSIZE. */
+    static struct pollfd *fds;
+    static Buffer **owners;
+    static int fds_cap;
+
+    int need = e->num_buffers + 4;
+    if (need > fds_cap) {
+        struct pollfd *nf = realloc(fds, sizeof(struct pollfd) * need);
+        if (nf) fds = nf;
+        Buffer **no = realloc(owners, sizeof(Buffer *) * need);
+        if (no) owners = no;
+        if (!nf || !no)
+            return wgetch(e->minibuf_active ? e->minibuf_win : e->edit_win);
+        fds_cap = need;
+    }
 
-    FD_ZERO(&rfds);
+    int nfds = 0;
     for (int i = 0; i < e->num_buffers; i++) {
         if (e->buffers[i]->is_shell && e->buffers[i]->pty_fd >= 0) {
-            FD_SET(e->buffers[i]->pty_fd, &rfds);
-            if (e->buffers[i]->pty_fd > maxfd)
-                maxfd = e->buffers[i]->pty_fd;
+            fds[nfds].fd = e->buffers[i]->pty_fd;
+            fds[nfds].events = POLLIN;
+            owners[nfds++] = e->buffers[i];
         }
     }
+    int nshells = nfds;
+
+    int watch_idx = -1, worker_idx = -1, lex_idx = -1;
+    if (e->watch_fd >= 0) {
+        watch_idx = nfds;
+        fds[nfds].fd = e->watch_fd;
+        fds[nfds].events = POLLIN;
+        owners[nfds++] = NULL;
+    }
+    if (worker_pending()) {
+        worker_idx = nfds;
+        fds[nfds].fd = worker_notify_fd();
+        fds[nfds].events = POLLIN;
+        owners[nfds++] = NULL;
+    }
+    if (lex_worker_pending()) {
+        lex_idx = nfds;
+        fds[nfds].fd = lex_worker_notify_fd();
+        fds[nfds].events = POLLIN;
+        owners[nfds++] = NULL;
+    }
 
-    /* Use wgetch with timeout for input; shell fd polling via select */
-    if (maxfd >= 0) {
-        struct timeval tv = {0, 20000}; /* 20ms */
-        int stdin_fd = fileno(stdin);
-        FD_SET(stdin_fd, &rfds);
-        if (stdin_fd > maxfd) maxfd = stdin_fd;
+    /* Use wgetch with timeout for input; shell fd polling via poll */
+    if (nfds > 0) {
+        int stdin_idx = nfds;
+        fds[nfds].fd = fileno(stdin);
+        fds[nfds].events = POLLIN;
+        owners[nfds++] = NULL;
 
-        int ret = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+        int ret = poll(fds, (nfds_t)nfds, 20); /* 20ms */
         if (ret > 0) {
             /* Read shell output */
-            for (int i = 0; i < e->num_buffers; i++) {
-                if (e->buffers[i]->is_shell && e->buffers[i]->pty_fd >= 0 &&
-                    FD_ISSET(e->buffers[i]->pty_fd, &rfds)) {
-                    shell_buf_read(e->buffers[i]);
+            for (int i = 0; i < nshells; i++) {
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    shell_buf_read(owners[i]);
                 }
             }
-            if (FD_ISSET(stdin_fd, &rfds)) {
+            if (watch_idx >= 0 && (fds[watch_idx].revents & POLLIN)) {
+                file_watch_process(e);
+            }
+            if (worker_idx >= 0 && (fds[worker_idx].revents & POLLIN)) {
+                script_worker_results(e);
+            }
+            if (lex_idx >= 0 && (fds[lex_idx].revents & POLLIN)) {
+                syntax_bg_results(e->buffers, e->num_buffers);
+            }
+            if (fds[stdin_idx].revents & POLLIN) {
                 return wgetch(e->minibuf_active ? e->minibuf_win : e->edit_win);
             }
-            return ERR; /* only shell data */
+            return ERR; /* only shell, file-watch, worker or lexer data */
         }
         return ERR;
     }
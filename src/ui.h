@@ -4,6 +4,7 @@
 #include "editor.h"
 
 void ui_init(Editor *e);
+int ui_init_term(Editor *e, const char *term, FILE *out, FILE *in);
 void ui_cleanup(void);
 void ui_refresh(Editor *e);
 void ui_draw_buffer(Editor *e);
@@ -11,11 +12,22 @@ void ui_draw_modeline(Editor *e);
 void ui_draw_minibuf(Editor *e);
 void ui_resize(Editor *e);
 int ui_get_key(Editor *e);
+int ui_interrupt_pending(Editor *e);
 
 /* Color pair definitions */
 #define COLOR_MODELINE  1
 #define COLOR_MSG       2
 #define COLOR_SHELL     3
 #define COLOR_HELP      4
+/* Syntax highlighting faces */
+#define COLOR_KEYWORD   5
+#define COLOR_TYPE      6
+#define COLOR_STRING    7
+#define COLOR_COMMENT   8
+#define COLOR_NUMBER    9
+#define COLOR_PREPROC   10
+#define COLOR_VARIABLE  11
+#define COLOR_ERROR     12
+#define COLOR_WARNING   13
 
 #endif /* UI_H */
@@ -0,0 +1,61 @@
+#define _XOPEN_SOURCE 700    /* wcwidth() */
+#include "utf8.h"
+#include <wchar.h>
+
+int utf8_decode(const char *s, size_t len, int *cp) {
+    const unsigned char *p = (const unsigned char *)s;
+    int n, c;
+
+    if (p[0] < 0x80) { *cp = p[0]; return 1; }
+    if (p[0] >= 0xC2 && p[0] <= 0xDF)      { n = 2; c = p[0] & 0x1F; }
+    else if (p[0] >= 0xE0 && p[0] <= 0xEF) { n = 3; c = p[0] & 0x0F; }
+    else if (p[0] >= 0xF0 && p[0] <= 0xF4) { n = 4; c = p[0] & 0x07; }
+    else { *cp = -1; return 1; }
+
+    if ((size_t)n > len) { *cp = -1; return 1; }
+    for (int i = 1; i < n; i++) {
+        if (!UTF8_IS_CONT(p[i])) { *cp = -1; return 1; }
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+    /* Overlong forms, surrogates, beyond U+10FFFF */
+    if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF)) ||
+        (c >= 0xD800 && c <= 0xDFFF)) {
+        *cp = -1;
+        return 1;
+    }
+    *cp = c;
+    return n;
+}
+
+size_t utf8_next(const char *s, size_t len, size_t pos) {
+    if (pos >= len) return len;
+    int cp;
+    return pos + (size_t)utf8_decode(s + pos, len - pos, &cp);
+}
+
+size_t utf8_prev(const char *s, size_t pos) {
+    if (pos == 0) return 0;
+    /* Back over at most 3 continuation bytes, then check that the
+     * sequence found really ends at pos; otherwise step one byte. */
+    size_t start = pos - 1;
+    while (start > 0 && pos - start < 4 && UTF8_IS_CONT(s[start])) start--;
+    int cp;
+    if (start + (size_t)utf8_decode(s + start, pos - start, &cp) == pos)
+        return start;
+    return pos - 1;
+}
+
+int utf8_printable(int cp) {
+    if (cp < 0) return 0;
+    if (cp < 0x80) return cp >= 0x20 && cp != 0x7F;
+    return wcwidth((wchar_t)cp) >= 0;
+}
+
+int utf8_width(int cp, int col) {
+    if (cp == '\t') return TAB_WIDTH - col % TAB_WIDTH;
+    if (cp < 0) return 1;
+    if (cp < 0x20 || cp == 0x7F) return 2;
+    if (cp < 0x7F) return 1;
+    int w = wcwidth((wchar_t)cp);
+    return w < 0 ? 1 : w;   /* drawn as U+FFFD */
+}
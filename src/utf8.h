@@ -0,0 +1,33 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+
+#define TAB_WIDTH 8
+
+/* Continuation bytes (10xxxxxx) never start a character. */
+#define UTF8_IS_CONT(c) (((unsigned char)(c) & 0xC0) == 0x80)
+
+/*
+ * Decode the character at s[0..len).  Stores the code point in *cp and
+ * returns its byte length (1..4).  A malformed or truncated sequence
+ * decodes as one byte with *cp = -1.
+ */
+int utf8_decode(const char *s, size_t len, int *cp);
+
+/* Byte offset of the character after / before the one at `pos`. */
+size_t utf8_next(const char *s, size_t len, size_t pos);
+size_t utf8_prev(const char *s, size_t pos);
+
+/* Whether the locale can draw `cp` as itself (controls: no). */
+int utf8_printable(int cp);
+
+/*
+ * Screen columns taken by code point `cp` drawn at column `col`: tabs
+ * reach the next tab stop, wide (CJK) characters take 2, combining marks
+ * 0, control characters 2 ("^X"); malformed bytes and characters the
+ * locale cannot print take 1 (drawn as U+FFFD).
+ */
+int utf8_width(int cp, int col);
+
+#endif /* UTF8_H */
@@ -0,0 +1,275 @@
+#include "worker.h"
+#include "trace.h"
+#include "loop_guard.h"
+#include <duktape.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define MAX_WORKERS 8
+#define GUARD_CHECK_MASK 255    /* loop iterations between budget checks */
+
+/*
+ * Finished jobs are queued under s_lock and announced by a byte on the
+ * notify pipe, whose read end the main loop polls next to the keyboard.
+ * Running jobs are listed under the same lock so they can be cancelled.
+ * Jobs never touch editor state, so nothing else is shared.
+ */
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static WorkerJob *s_running_head;
+static WorkerJob *s_done_head;
+static WorkerJob *s_done_tail;
+static int s_running;
+static int s_pipe[2] = { -1, -1 };
+
+/* The job this thread runs */
+static __thread WorkerJob *t_job;
+
+WorkerJob *worker_job_new(int id, const char *code, const Buffer *buf,
+                          long time_limit_ms) {
+    WorkerJob *job = calloc(1, sizeof(WorkerJob));
+    if (!job) return NULL;
+    job->id = id;
+    job->time_limit_ms = time_limit_ms;
+    job->code = strdup(code);
+    job->name = strdup(buf->name);
+
+    /* One block for the text, so the snapshot costs two allocations */
+    size_t total = 0;
+    for (int i = 0; i < buf->num_lines; i++) total += strlen(buf->lines[i]) + 1;
+    job->text = malloc(total ? total : 1);
+    job->lines = malloc(sizeof(char *) * (buf->num_lines ? buf->num_lines : 1));
+    if (!job->code || !job->name || !job->text || !job->lines) {
+        worker_job_free(job);
+        return NULL;
+    }
+    char *p = job->text;
+    for (int i = 0; i < buf->num_lines; i++) {
+        size_t len = strlen(buf->lines[i]) + 1;
+        memcpy(p, buf->lines[i], len);
+        job->lines[i] = p;
+        p += len;
+    }
+    job->num_lines = buf->num_lines;
+    return job;
+}
+
+void worker_job_free(WorkerJob *job) {
+    if (!job) return;
+    free(job->code);
+    free(job->name);
+    free(job->text);
+    free(job->lines);
+    free(job->result);
+    free(job);
+}
+
+int worker_budget_exceeded(WorkerJob *job) {
+    if (job->stopped) return 1;
+    pthread_mutex_lock(&s_lock);
+    int cancelled = job->cancelled;
+    pthread_mutex_unlock(&s_lock);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (long)(now.tv_sec - job->start.tv_sec) * 1000L +
+              (now.tv_nsec - job->start.tv_nsec) / 1000000L;
+    if (cancelled)
+        job->stopped = "cancelled";
+    else if (job->time_limit_ms > 0 && ms >= job->time_limit_ms)
+        job->stopped = "time limit exceeded";
+    return job->stopped != NULL;
+}
+
+/* Throw if this thread's job is out of budget. */
+static void budget_check(duk_context *ctx) {
+    if (worker_budget_exceeded(t_job))
+        (void)duk_error(ctx, DUK_ERR_RANGE_ERROR, "worker %s", t_job->stopped);
+}
+
+/* __loopGuard() -- see loop_guard.h */
+static duk_ret_t w_loop_guard(duk_context *ctx) {
+    if ((++t_job->guard_calls & GUARD_CHECK_MASK) == 0 || t_job->stopped)
+        budget_check(ctx);
+    duk_push_true(ctx);
+    return 1;
+}
+
+/* worker.lineCount() */
+static duk_ret_t w_line_count(duk_context *ctx) {
+    budget_check(ctx);
+    duk_push_int(ctx, t_job->num_lines);
+    return 1;
+}
+
+/* worker.getLine(n) -- 1-based, undefined when out of range */
+static duk_ret_t w_get_line(duk_context *ctx) {
+    budget_check(ctx);
+    WorkerJob *job = t_job;
+    int n = duk_require_int(ctx, 0);
+    if (n < 1 || n > job->num_lines) return 0;
+    duk_push_string(ctx, job->lines[n - 1]);
+    return 1;
+}
+
+static duk_ret_t encode_result(duk_context *ctx, void *udata) {
+    (void)udata;
+    duk_json_encode(ctx, -1);
+    return 1;
+}
+
+static void run_job(WorkerJob *job) {
+    t_job = job;
+    size_t len;
+    char *code = loop_guard_source(job->code, strlen(job->code), &len);
+    /* The job is the heap's udata, which the timeout hook receives */
+    duk_context *ctx = code ? duk_create_heap(NULL, NULL, NULL, job, NULL) : NULL;
+    if (!ctx) {
+        free(code);
+        job->result = strdup("cannot create worker heap");
+        job->failed = 1;
+        return;
+    }
+
+    duk_push_object(ctx);
+    duk_push_c_function(ctx, w_line_count, 0);
+    duk_put_prop_string(ctx, -2, "lineCount");
+    duk_push_c_function(ctx, w_get_line, 1);
+    duk_put_prop_string(ctx, -2, "getLine");
+    duk_push_string(ctx, job->name);
+    duk_put_prop_string(ctx, -2, "bufferName");
+    duk_put_global_string(ctx, "worker");
+
+    duk_push_global_object(ctx);
+    duk_push_string(ctx, LOOP_GUARD_FN);
+    duk_push_c_function(ctx, w_loop_guard, 0);
+    duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE);
+    duk_pop(ctx);
+
+    if (duk_peval_lstring(ctx, code, len) != 0) {
+        job->failed = 1;
+    } else if (duk_safe_call(ctx, encode_result, NULL, 1, 1) != 0) {
+        job->failed = 1;
+    }
+    free(code);
+    if (job->stopped) {
+        /* Whatever the script made of the error, report the reason */
+        char msg[64];
+        snprintf(msg, sizeof(msg), "RangeError: worker %s", job->stopped);
+        job->result = strdup(msg);
+        job->failed = 1;
+    } else if (job->failed || duk_is_string(ctx, -1)) {
+        /* undefined encodes to undefined: no result */
+        job->result = strdup(duk_safe_to_string(ctx, -1));
+    }
+    duk_destroy_heap(ctx);
+}
+
+/* Take `job` off the running list; under s_lock */
+static void unlink_running(WorkerJob *job) {
+    WorkerJob **pp = &s_running_head;
+    while (*pp && *pp != job) pp = &(*pp)->next;
+    if (*pp) *pp = job->next;
+    job->next = NULL;
+}
+
+static void *worker_main(void *arg) {
+    WorkerJob *job = arg;
+    trace_thread_name("worker");
+    TRACE_BEGIN("worker_job");
+    run_job(job);
+    TRACE_END("worker_job");
+
+    pthread_mutex_lock(&s_lock);
+    unlink_running(job);
+    if (s_done_tail) s_done_tail->next = job;
+    else s_done_head = job;
+    s_done_tail = job;
+    s_running--;
+    pthread_mutex_unlock(&s_lock);
+
+    char c = 1;
+    if (write(s_pipe[1], &c, 1) < 0) {
+        /* pipe full: the main loop already has a wakeup pending */
+    }
+    return NULL;
+}
+
+int worker_start(WorkerJob *job) {
+    if (s_pipe[0] < 0) {
+        if (pipe(s_pipe) != 0) return -1;
+        for (int i = 0; i < 2; i++) {
+            fcntl(s_pipe[i], F_SETFL, fcntl(s_pipe[i], F_GETFL) | O_NONBLOCK);
+            fcntl(s_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    pthread_mutex_lock(&s_lock);
+    int busy = s_running >= MAX_WORKERS;
+    if (!busy) {
+        s_running++;
+        job->next = s_running_head;
+        s_running_head = job;
+    }
+    pthread_mutex_unlock(&s_lock);
+    if (busy) return -1;
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&tid, &attr, worker_main, job);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        pthread_mutex_lock(&s_lock);
+        s_running--;
+        unlink_running(job);
+        pthread_mutex_unlock(&s_lock);
+        return -1;
+    }
+    return 0;
+}
+
+int worker_cancel(int id) {
+    int found = -1;
+    pthread_mutex_lock(&s_lock);
+    for (WorkerJob *job = s_running_head; job; job = job->next) {
+        if (job->id == id) {
+            job->cancelled = 1;
+            found = 0;
+        }
+    }
+    pthread_mutex_unlock(&s_lock);
+    return found;
+}
+
+/* Pop one finished job (NULL if none), draining the notify pipe. */
+WorkerJob *worker_take_done(void) {
+    char drain[64];
+    while (s_pipe[0] >= 0 && read(s_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+    pthread_mutex_lock(&s_lock);
+    WorkerJob *job = s_done_head;
+    if (job) {
+        s_done_head = job->next;
+        if (!s_done_head) s_done_tail = NULL;
+        job->next = NULL;
+    }
+    pthread_mutex_unlock(&s_lock);
+    return job;
+}
+
+int worker_notify_fd(void) {
+    return s_pipe[0];
+}
+
+/* Jobs running or finished but not yet taken. */
+int worker_pending(void) {
+    pthread_mutex_lock(&s_lock);
+    int n = s_running + (s_done_head != NULL);
+    pthread_mutex_unlock(&s_lock);
+    return n;
+}
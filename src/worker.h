@@ -0,0 +1,43 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "buffer.h"
+#include <time.h>
+
+/*
+ * A background script: runs `code` on its own thread in a private Duktape
+ * heap against a read-only snapshot of one buffer's text.  Like an eval on
+ * the main thread it has a time budget, checked by its loop guards and
+ * bindings, and it can be cancelled; either way it stops with an error.
+ */
+typedef struct WorkerJob {
+    int id;
+    char *code;
+    char *name;             /* buffer the snapshot was taken from */
+    char *text;             /* snapshot: all lines, NUL-separated */
+    char **lines;           /* pointers into text */
+    int num_lines;
+    char *result;           /* JSON of the completion value, or error text */
+    int failed;
+    long time_limit_ms;     /* 0 = unlimited */
+    struct timespec start;
+    int cancelled;          /* under s_lock */
+    const char *stopped;    /* why the budget tripped; worker thread only */
+    unsigned guard_calls;
+    struct WorkerJob *next; /* running list, then the done queue */
+} WorkerJob;
+
+WorkerJob *worker_job_new(int id, const char *code, const Buffer *buf,
+                          long time_limit_ms);
+void worker_job_free(WorkerJob *job);
+int  worker_start(WorkerJob *job);
+/* Ask running job `id` to stop; -1 if it is not running. */
+int  worker_cancel(int id);
+/* True once `job` is cancelled or out of time; stays true.  Called on the
+ * job's own thread (its loop guard, bindings and timeout hook). */
+int  worker_budget_exceeded(WorkerJob *job);
+WorkerJob *worker_take_done(void);
+int  worker_notify_fd(void);
+int  worker_pending(void);
+
+#endif /* WORKER_H */
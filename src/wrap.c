@@ -0,0 +1,298 @@
+#include "wrap.h"
+#include "utf8.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Break line `s` into rows of at most `width` columns, at the last blank
+ * that fits (word wrap) or mid-word when a word is wider than a row.
+ * Blanks may hang past the edge instead of starting the next row.
+ */
+static void wrap_line(WrapLine *wl, const char *s, int width) {
+    free(wl->breaks);
+    wl->breaks = NULL;
+    wl->rows = 1;
+
+    int len = (int)strlen(s);
+    int cap = 0;
+    int row_start = 0, word_break = -1;
+    int col = 0;
+    for (int i = 0; i < len; ) {
+        int cp;
+        int n = utf8_decode(s + i, (size_t)(len - i), &cp);
+        int w = utf8_width(cp, col);
+        if (col + w > width && i > row_start && cp != ' ') {
+            int next = word_break > row_start ? word_break : i;
+            if (wl->rows - 1 == cap) {
+                int new_cap = cap ? cap * 2 : 4;
+                int *grown = realloc(wl->breaks, sizeof(int) * new_cap);
+                if (!grown) return;     /* the rest shows as one long row */
+                wl->breaks = grown;
+                cap = new_cap;
+            }
+            wl->breaks[wl->rows - 1] = next;
+            wl->rows++;
+            row_start = next;
+            word_break = -1;
+            i = next;
+            col = 0;
+            continue;
+        }
+        col += w;
+        i += n;
+        if (cp == ' ' || cp == '\t') word_break = i;
+    }
+}
+
+/* --- Fenwick tree over row counts --- */
+
+static void tree_build(WrapIndex *w) {
+    for (int i = 1; i <= w->num_lines; i++) w->tree[i] = w->lines[i - 1].rows;
+    for (int i = 1; i <= w->num_lines; i++) {
+        int j = i + (i & -i);
+        if (j <= w->num_lines) w->tree[j] += w->tree[i];
+    }
+    w->tree_valid = 1;
+}
+
+static void tree_add(WrapIndex *w, int i, long delta) {
+    for (i++; i <= w->num_lines; i += i & -i) w->tree[i] += delta;
+}
+
+/* Rows of the first n lines. */
+static long tree_prefix(const WrapIndex *w, int n) {
+    long sum = 0;
+    for (; n > 0; n -= n & -n) sum += w->tree[n];
+    return sum;
+}
+
+/* Set up line i (0-based) as the new last entry: O(log n). */
+static void tree_append(WrapIndex *w, int i) {
+    int k = i + 1;
+    w->tree[k] = w->lines[i].rows + tree_prefix(w, k - 1) - tree_prefix(w, k - (k & -k));
+}
+
+static int reserve(WrapIndex *w, int need) {
+    if (need <= w->cap) return 0;
+    int new_cap = w->cap ? w->cap : 64;
+    while (new_cap < need) new_cap *= 2;
+    WrapLine *lines = realloc(w->lines, sizeof(WrapLine) * new_cap);
+    if (!lines) return -1;
+    w->lines = lines;
+    long *tree = realloc(w->tree, sizeof(long) * (new_cap + 1));
+    if (!tree) return -1;
+    w->tree = tree;
+    w->cap = new_cap;
+    return 0;
+}
+
+static void free_lines(WrapIndex *w, int start, int n) {
+    for (int i = start; i < start + n; i++) free(w->lines[i].breaks);
+}
+
+/* The index for buf, re-wrapped and with a valid tree, or NULL. */
+static WrapIndex *wrap_ready(Buffer *buf) {
+    WrapIndex *w = buf->wrap;
+    if (!w) return NULL;
+    if (w->stale) {
+        free_lines(w, 0, w->num_lines);
+        w->num_lines = 0;
+        if (reserve(w, buf->num_lines) != 0) return NULL;
+        for (int i = 0; i < buf->num_lines; i++) {
+            w->lines[i].breaks = NULL;
+            wrap_line(&w->lines[i], buf->lines[i], w->width);
+        }
+        w->num_lines = buf->num_lines;
+        w->stale = 0;
+        w->tree_valid = 0;
+    }
+    if (!w->tree_valid) tree_build(w);
+    return w;
+}
+
+void wrap_enable(Buffer *buf, int width) {
+    if (buf->wrap || width < 1) return;
+    buf->wrap = calloc(1, sizeof(WrapIndex));
+    if (!buf->wrap) return;
+    buf->wrap->width = width;
+    buf->wrap->stale = 1;
+    buf->left_col = 0;
+    buf->top_row = 0;
+}
+
+void wrap_disable(Buffer *buf) {
+    WrapIndex *w = buf->wrap;
+    if (!w) return;
+    free_lines(w, 0, w->num_lines);
+    free(w->lines);
+    free(w->tree);
+    free(w);
+    buf->wrap = NULL;
+    buf->top_row = 0;
+}
+
+void wrap_set_width(Buffer *buf, int width) {
+    WrapIndex *w = buf->wrap;
+    if (!w || width < 1 || width == w->width) return;
+    w->width = width;
+    w->stale = 1;
+}
+
+void wrap_lines_changed(Buffer *buf, int start, int old_n, int new_n) {
+    WrapIndex *w = buf->wrap;
+    if (!w || w->stale) return;
+    if (start < 0 || start + old_n > w->num_lines ||
+        w->num_lines - old_n + new_n != buf->num_lines ||
+        reserve(w, buf->num_lines) != 0) {
+        w->stale = 1;           /* out of step: rebuild on next use */
+        return;
+    }
+
+    if (old_n == new_n) {
+        /* Lines edited in place: point updates */
+        for (int i = start; i < start + new_n; i++) {
+            long before = w->lines[i].rows;
+            wrap_line(&w->lines[i], buf->lines[i], w->width);
+            if (w->tree_valid) tree_add(w, i, w->lines[i].rows - before);
+        }
+        return;
+    }
+
+    free_lines(w, start, old_n);
+    int tail = start + old_n == w->num_lines;
+    memmove(&w->lines[start + new_n], &w->lines[start + old_n],
+            sizeof(WrapLine) * (size_t)(w->num_lines - start - old_n));
+    w->num_lines += new_n - old_n;
+    for (int i = start; i < start + new_n; i++) {
+        w->lines[i].breaks = NULL;
+        wrap_line(&w->lines[i], buf->lines[i], w->width);
+    }
+    /* Lines changed at the end (shell output, followed files) extend the
+     * tree; anywhere else the tree is rebuilt on next use */
+    if (tail && w->tree_valid) {
+        for (int i = start; i < w->num_lines; i++) tree_append(w, i);
+    } else {
+        w->tree_valid = 0;
+    }
+}
+
+int wrap_rows(Buffer *buf, int ln) {
+    WrapIndex *w = wrap_ready(buf);
+    if (!w || ln < 0 || ln >= w->num_lines) return 1;
+    return w->lines[ln].rows;
+}
+
+int wrap_row_start(Buffer *buf, int ln, int row) {
+    WrapIndex *w = wrap_ready(buf);
+    if (!w || ln < 0 || ln >= w->num_lines || row <= 0) return 0;
+    if (row >= w->lines[ln].rows) row = w->lines[ln].rows - 1;
+    return row > 0 ? w->lines[ln].breaks[row - 1] : 0;
+}
+
+/* Byte offset just past row `row` of line ln. */
+int wrap_row_end(Buffer *buf, int ln, int row) {
+    WrapIndex *w = wrap_ready(buf);
+    if (w && ln >= 0 && ln < w->num_lines && row >= 0 && row < w->lines[ln].rows - 1)
+        return w->lines[ln].breaks[row];
+    return ln >= 0 && ln < buf->num_lines ? (int)strlen(buf->lines[ln]) : 0;
+}
+
+/* Row of line ln holding byte offset `byte`. */
+int wrap_row_of(Buffer *buf, int ln, int byte) {
+    WrapIndex *w = wrap_ready(buf);
+    if (!w || ln < 0 || ln >= w->num_lines) return 0;
+    const WrapLine *wl = &w->lines[ln];
+    int lo = 0, hi = wl->rows - 1;
+    while (lo < hi) {       /* last row starting at or before byte */
+        int mid = (lo + hi + 1) / 2;
+        if (wl->breaks[mid - 1] <= byte) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Screen column of byte offset `byte` within its row. */
+int wrap_col_in_row(Buffer *buf, int ln, int byte) {
+    if (ln < 0 || ln >= buf->num_lines) return 0;
+    const char *s = buf->lines[ln];
+    int col = 0;
+    for (int i = wrap_row_start(buf, ln, wrap_row_of(buf, ln, byte)); i < byte && s[i]; ) {
+        int cp;
+        int n = utf8_decode(s + i, 4, &cp);
+        col += utf8_width(cp, col);
+        i += n;
+    }
+    return col;
+}
+
+/* Visual row at which line ln starts. */
+long wrap_vrow(Buffer *buf, int ln) {
+    WrapIndex *w = wrap_ready(buf);
+    if (!w) return ln;
+    if (ln > w->num_lines) ln = w->num_lines;
+    return tree_prefix(w, ln < 0 ? 0 : ln);
+}
+
+long wrap_total_rows(Buffer *buf) {
+    WrapIndex *w = wrap_ready(buf);
+    return w ? tree_prefix(w, w->num_lines) : buf->num_lines;
+}
+
+/* Line and row shown at visual row vrow (clamped to the buffer). */
+void wrap_locate(Buffer *buf, long vrow, int *ln, int *row) {
+    WrapIndex *w = wrap_ready(buf);
+    if (!w) {
+        *ln = vrow < 0 ? 0 : vrow >= buf->num_lines ? buf->num_lines - 1 : (int)vrow;
+        *row = 0;
+        return;
+    }
+    long total = tree_prefix(w, w->num_lines);
+    if (vrow >= total) vrow = total - 1;
+    if (vrow < 0) vrow = 0;
+
+    /* Descend to the last line whose prefix sum is <= vrow */
+    int pos = 0;
+    int step = 1;
+    while (step * 2 <= w->num_lines) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= w->num_lines && w->tree[pos + step] <= vrow) {
+            pos += step;
+            vrow -= w->tree[pos];
+        }
+    }
+    *ln = pos;
+    *row = (int)vrow;
+}
+
+/* Byte offset at screen column `col` of row `row` of line ln. */
+static int row_col_to_byte(Buffer *buf, int ln, int row, int col) {
+    const char *s = buf->lines[ln];
+    int start = wrap_row_start(buf, ln, row);
+    int end = wrap_row_end(buf, ln, row);
+    int last_row = row == wrap_rows(buf, ln) - 1;
+    int best = start, c = 0;
+    for (int i = start; i < end; ) {
+        int cp;
+        int n = utf8_decode(s + i, (size_t)(end - i), &cp);
+        if (c > col) break;
+        if (utf8_width(cp, c) > 0 || cp <= 0x7F) best = i;
+        c += utf8_width(cp, c);
+        i += n;
+        if (i == end && last_row && c <= col) best = end;
+    }
+    return best;
+}
+
+void wrap_move_rows(Buffer *buf, int drows) {
+    buffer_clamp_cursor(buf);
+    int cl = buf->cursor_line;
+    if (buf->goal_line != cl || buf->goal_byte != buf->cursor_col)
+        buf->goal_col = wrap_col_in_row(buf, cl, buf->cursor_col);
+    long v = wrap_vrow(buf, cl) + wrap_row_of(buf, cl, buf->cursor_col) + drows;
+    int ln, row;
+    wrap_locate(buf, v, &ln, &row);
+    buf->cursor_line = ln;
+    buf->cursor_col = row_col_to_byte(buf, ln, row, buf->goal_col);
+    buf->goal_line = buf->cursor_line;
+    buf->goal_byte = buf->cursor_col;
+}
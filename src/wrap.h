@@ -0,0 +1,45 @@
+#ifndef WRAP_H
+#define WRAP_H
+
+#include "buffer.h"
+
+/*
+ * Visual line wrap index of one buffer.  Each line caches where its
+ * screen rows start for the current width; a Fenwick tree over the row
+ * counts maps lines to visual rows and back in O(log n).  Lines are
+ * re-wrapped only when an edit touches them or the width changes.
+ */
+typedef struct WrapLine {
+    int rows;               /* screen rows the line takes (>= 1) */
+    int *breaks;            /* byte offsets where rows 2..rows start */
+} WrapLine;
+
+typedef struct WrapIndex {
+    int width;              /* columns per row */
+    int stale;              /* width changed: re-wrap everything on use */
+    WrapLine *lines;        /* parallel to Buffer.lines */
+    int num_lines;
+    int cap;
+    long *tree;             /* Fenwick tree of rows, 1-based */
+    int tree_valid;
+} WrapIndex;
+
+void wrap_enable(Buffer *buf, int width);
+void wrap_disable(Buffer *buf);
+/* Lines [start, start + old_n) of buf became [start, start + new_n). */
+void wrap_lines_changed(Buffer *buf, int start, int old_n, int new_n);
+void wrap_set_width(Buffer *buf, int width);
+
+int  wrap_rows(Buffer *buf, int ln);
+int  wrap_row_start(Buffer *buf, int ln, int row);
+int  wrap_row_end(Buffer *buf, int ln, int row);
+int  wrap_row_of(Buffer *buf, int ln, int byte);
+int  wrap_col_in_row(Buffer *buf, int ln, int byte);
+long wrap_vrow(Buffer *buf, int ln);
+void wrap_locate(Buffer *buf, long vrow, int *ln, int *row);
+long wrap_total_rows(Buffer *buf);
+
+/* Move the cursor by visual rows, keeping its column within the row. */
+void wrap_move_rows(Buffer *buf, int drows);
+
+#endif /* WRAP_H */